@@ -16,6 +16,8 @@
 #define fstat           _fstat
 #define mkdir           _mkdir
 #define snprintf        _snprintf
+#define fseeko          _fseeki64
+#define ftello          _ftelli64
 #if _MSC_VER <= 1200 /* Versions below VC++ 6 */
 #define vsnprintf       _vsnprintf
 #endif
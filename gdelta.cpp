@@ -1,414 +1,1468 @@
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
-#include <stdint.h>
-
-#ifdef _MSC_VER
-#include <compat/msvc.h>
-#else
-#include <ctime>
-#endif
-
-#include "gdelta_internal.h"
-#include "gdelta.h"
-#include "gear_matrix.h"
-
-#define INIT_BUFFER_SIZE 128 * 1024 
-#define FPTYPE uint64_t
-#define STRLOOK 16
-#define STRLSTEP 2
-
-#define PRINT_PERF 0
-
-void GFixSizeChunking(const uint8_t *data, int len, int begflag, int begsize,
-                     uint32_t *hash_table, int mask) {
-  if (len < STRLOOK)
-    return;
-
-  int i = 0;
-  int movebitlength = sizeof(FPTYPE) * 8 / STRLOOK;
-  if (sizeof(FPTYPE) * 8 % STRLOOK != 0)
-    movebitlength++;
-  FPTYPE fingerprint = 0;
-
-  /** GEAR **/
-  for (; i < STRLOOK; i++) {
-    fingerprint = (fingerprint << (movebitlength)) + GEARmx[data[i]];
-  }
-
-  i -= STRLOOK;
-  FPTYPE index = 0;
-  int numChunks = len - STRLOOK + 1;
-
-  int flag = 0;
-  int _begsize = begflag ? begsize : 0;
-  while (i < numChunks) {
-    if (flag == STRLSTEP) {
-      flag = 0;
-      index = (fingerprint) >> (sizeof(FPTYPE) * 8 - mask);
-      if (hash_table[index] != 0) {
-        index = fingerprint >> (sizeof(FPTYPE) * 8 - mask);
-      }
-      hash_table[index] = i + _begsize;
-    }
-    /** GEAR **/
-    fingerprint = (fingerprint << (movebitlength)) + GEARmx[data[i + STRLOOK]];
-    i++;
-    flag++;
-  }
-
-  return;
-}
-
-int gencode(const uint8_t *newBuf, uint32_t newSize, const uint8_t *baseBuf,
-            uint32_t baseSize, uint8_t **deltaBuf, uint32_t *deltaSize) {
-#if PRINT_PERF
-  struct timespec tf0, tf1;
-  clock_gettime(CLOCK_MONOTONIC, &tf0);
-#endif
-
-  /* detect the head and tail of one chunk */
-  uint32_t beg = 0, end = 0, begSize = 0, endSize = 0;
-
-  if (*deltaBuf == nullptr) {
-    *deltaBuf = (uint8_t*)malloc(INIT_BUFFER_SIZE);
-  }
-  uint8_t* databuf = (uint8_t*)malloc(INIT_BUFFER_SIZE);
-  uint8_t* instbuf = (uint8_t*)malloc(INIT_BUFFER_SIZE);
-
-  // Find first difference 
-  // First in 8 byte blocks and then in 1 byte blocks for speed
-  while (begSize + sizeof(uint64_t) <= baseSize &&
-         begSize + sizeof(uint64_t) <= newSize &&
-         *(uint64_t *)(baseBuf + begSize) == *(uint64_t *)(newBuf + begSize)) {
-    begSize += sizeof(uint64_t);
-  }
-
-  while (begSize < baseSize && 
-         begSize < newSize && 
-         baseBuf[begSize] == newBuf[begSize]) {
-    begSize++;
-  }
-
-  if (begSize > 16)
-    beg = 1;
-  else
-    begSize = 0;
-
-  // Find first difference (from the end)
-  while (endSize + sizeof(uint64_t) <= baseSize &&
-         endSize + sizeof(uint64_t) <= newSize &&
-         *(uint64_t *)(baseBuf + baseSize - endSize - sizeof(uint64_t)) ==
-         *(uint64_t *)(newBuf + newSize - endSize - sizeof(uint64_t))) {
-    endSize += sizeof(uint64_t);
-  }
-
-  while (endSize < baseSize && 
-         endSize < newSize && 
-         baseBuf[baseSize - endSize - 1] == newBuf[newSize - endSize - 1]) {
-    endSize++;
-  }
-
-  if (begSize + endSize > newSize)
-    endSize = newSize - begSize;
-
-  if (endSize > 16)
-    end = 1;
-  else
-    endSize = 0;
-  /* end of detect */
-
-  BufferStreamDescriptor deltaStream = {*deltaBuf, 0, *deltaSize};
-  BufferStreamDescriptor instStream = {instbuf, 0, sizeof(instbuf)}; // Instruction stream
-  BufferStreamDescriptor dataStream = {databuf, 0, sizeof(databuf)};
-  ReadOnlyBufferStreamDescriptor newStream = {newBuf, begSize, newSize};
-  DeltaUnitMem unit = {}; // In-memory represtation of current working unit
-
-  if (begSize + endSize >= baseSize) { // TODO: test this path
-    if (beg) {
-      // Data at start is from the original file, write instruction to copy from base
-      unit.flag = true;
-      unit.offset = 0;
-      unit.length = begSize;
-      write_unit(instStream, unit);
-    }
-    if (newSize - begSize - endSize > 0) {
-      int32_t litlen = newSize - begSize - endSize;
-      unit.flag = false;
-      unit.length = litlen;
-      write_unit(instStream, unit);
-      stream_into(dataStream, newStream, litlen);
-    }
-    if (end) {
-      int32_t matchlen = endSize;
-      int32_t offset = baseSize - endSize;
-      unit.flag = true;
-      unit.offset = offset;
-      unit.length = matchlen;
-      write_unit(instStream, unit);
-    }
-
-    write_varint(deltaStream, instStream.cursor);
-    write_concat_buffer(deltaStream, instStream);
-    write_concat_buffer(deltaStream, dataStream);
-
-    *deltaSize = deltaStream.cursor; 
-    *deltaBuf = deltaStream.buf;
-
-#if PRINT_PERF
-    clock_gettime(CLOCK_MONOTONIC, &tf1);
-    fprintf(stderr, "gencode took: %zdns\n", (tf1.tv_sec - tf0.tv_sec) * 1000000000 + tf1.tv_nsec - tf0.tv_nsec);
-#endif
-    free(dataStream.buf);
-    free(instStream.buf);
-    return deltaStream.cursor;
-  }
-
-  /* chunk the baseFile */
-  int32_t tmp = (baseSize - begSize - endSize) + 10;
-  int32_t bit;
-  for (bit = 0; tmp; bit++)
-    tmp >>= 1;
-  uint64_t xxsize = 0XFFFFFFFFFFFFFFFF >> (64 - bit); // mask
-  uint32_t hash_size = xxsize + 1;
-  uint32_t *hash_table = (uint32_t *)malloc(hash_size * sizeof(uint32_t));
-  memset(hash_table, 0, sizeof(uint32_t) * hash_size);
-
-#if PRINT_PERF
-  struct timespec t0, t1;
-  clock_gettime(CLOCK_MONOTONIC, &t0);
-#endif
-
-  GFixSizeChunking(baseBuf + begSize, baseSize - begSize - endSize, beg,
-                   begSize, hash_table, bit);
-#if PRINT_PERF
-  clock_gettime(CLOCK_MONOTONIC, &t1);
-
-  fprintf(stderr, "size:%d\n", baseSize - begSize - endSize);
-  fprintf(stderr, "hash size:%d\n", hash_size);
-  fprintf(stderr, "rolling hash:%.3fMB/s\n",
-          (double)(baseSize - begSize - endSize) / 1024 / 1024 /
-              ((t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec) *
-              1000000000);
-  fprintf(stderr, "rolling hash:%zd\n",
-          (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
-
-  clock_gettime(CLOCK_MONOTONIC, &t0);
-  fprintf(stderr, "hash table :%zd\n",
-          (t0.tv_sec - t1.tv_sec) * 1000000000 + t0.tv_nsec - t1.tv_nsec);
-#endif
-  /* end of inserting */
-
-  uint32_t inputPos = begSize;
-  uint32_t cursor;
-  int32_t movebitlength = 0;
-  if (sizeof(FPTYPE) * 8 % STRLOOK == 0)
-    movebitlength = sizeof(FPTYPE) * 8 / STRLOOK;
-  else
-    movebitlength = sizeof(FPTYPE) * 8 / STRLOOK + 1;
-
-  if (beg) {
-    // Data at start is from the original file, write instruction to copy from base
-    unit.flag = true;
-    unit.offset = 0;
-    unit.length = begSize;
-    write_unit(instStream, unit);
-    unit.length = 0; // Mark as written
-  }
-
-  FPTYPE fingerprint = 0;
-  for (uint32_t i = 0; i < STRLOOK && i < newSize - endSize - inputPos; i++) {
-    fingerprint = (fingerprint << (movebitlength)) + GEARmx[(newBuf + inputPos)[i]];
-  }
-
-  uint32_t handlebytes = begSize;
-  while (inputPos + STRLOOK <= newSize - endSize) {
-    uint32_t length;
-    bool matchflag = false;
-    if (newSize - endSize - inputPos < STRLOOK) {
-      cursor = inputPos + (newSize - endSize);
-      length = newSize - endSize - inputPos;
-    } else {
-      cursor = inputPos + STRLOOK;
-      length = STRLOOK;
-    }
-    int32_t index1 = fingerprint >> (sizeof(FPTYPE) * 8 - bit);
-    uint32_t offset = 0;
-    if (hash_table[index1] != 0 && memcmp(newBuf + inputPos, baseBuf + hash_table[index1], length) == 0) {
-      matchflag = true;
-      offset = hash_table[index1];
-    }
-
-    /* New data match found in hashtable/base data; attempt to create copy instruction*/
-    if (matchflag) {
-      // Check how much is possible to copy
-      int32_t j = 0;
-#if 1 /* 8-bytes optimization */
-      while (offset + length + j + 7 < baseSize - endSize &&
-             cursor + j + 7 < newSize - endSize && 
-             *(uint64_t *)(baseBuf + offset + length + j) ==*(uint64_t *)(newBuf + cursor + j)) {
-        j += sizeof(uint64_t);
-      }
-      while (offset + length + j < baseSize - endSize &&
-             cursor + j < newSize - endSize &&
-             baseBuf[offset + length + j] == newBuf[cursor + j]) {
-        j++;
-      }
-#endif
-      cursor += j;
-
-
-      int32_t matchlen = cursor - inputPos;
-      handlebytes += cursor - inputPos;
-      uint64_t _offset = offset;
-
-
-      // Check if switching modes Literal -> Copy, and dump instruction if available
-      if (!unit.flag && unit.length) {
-        /* Detect if end of previous literal could have been a partial copy*/
-        uint32_t k = 0;
-        while (k + 1 <= offset && k + 1 <= unit.length) {
-          if (baseBuf[offset - (k + 1)] == newBuf[inputPos - (k + 1)])
-            k++;
-          else
-            break;
-        }
-
-        if (k > 0) {
-          // Reduce literal by the amount covered by the copy
-          unit.length -= k;
-          // Set up adjusted copy parameters
-          matchlen += k;
-          _offset -= k;
-          // Last few literal bytes can be overwritten, so move cursor back
-          dataStream.cursor -= k;
-        }
-
-        write_unit(instStream, unit);
-        unit.length = 0; // Mark written
-      }
-
-      unit.flag = true;
-      unit.offset = _offset;
-      unit.length = matchlen;
-      write_unit(instStream, unit);
-      unit.length = 0; // Mark written
-
-
-      // Update cursor (inputPos) and fingerprint
-      for (uint32_t k = cursor; k < cursor + STRLOOK && cursor + STRLOOK < newSize - endSize; k++) {
-        fingerprint = (fingerprint << (movebitlength)) + GEARmx[newBuf[k]];
-      }
-      inputPos = cursor;
-    } else { // No match, need to write additional (literal) data
-      /* 
-       * Accumulate length one byte at a time (as literal) in unit while no match is found
-       * Pre-emptively write to datastream
-       */
-
-      unit.flag = false;
-      unit.length += 1;
-      stream_from(dataStream, newStream, inputPos, 1);
-      handlebytes += 1;
-
-
-      // Update cursor (inputPos) and fingerprint
-      if (inputPos + STRLOOK < newSize - endSize)
-        fingerprint = (fingerprint << (movebitlength)) + GEARmx[newBuf[inputPos + STRLOOK]];
-      inputPos++;
-    }
-  }
-
-#if PRINT_PERF
-  clock_gettime(CLOCK_MONOTONIC, &t1);
-  fprintf(stderr, "look up:%zd\n",
-          (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
-  fprintf(stderr, "look up:%.3fMB/s\n",
-          (double)(baseSize - begSize - endSize) / 1024 / 1024 /
-              ((t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec) *
-              1000000000);
-#endif
-
-  // If last unit was unwritten literal, update it to use the rest of the data
-  if (!unit.flag && unit.length) {
-    newStream.cursor = handlebytes;
-    stream_into(dataStream, newStream, newSize - endSize - handlebytes);
-
-    unit.length += (newSize - endSize - handlebytes);
-    write_unit(instStream, unit);
-    unit.length = 0;
-  } else { // Last unit was Copy, need new instruction
-    if (newSize - endSize - handlebytes) {
-      newStream.cursor = inputPos;
-      stream_into(dataStream, newStream, newSize - endSize - handlebytes);
-
-      unit.flag = false;
-      unit.length = newSize - endSize - handlebytes;
-      write_unit(instStream, unit);
-      unit.length = 0;
-    }
-  }
-
-  if (end) {
-    int32_t matchlen = endSize;
-    int32_t offset = baseSize - endSize;
-     
-    unit.flag = true;
-    unit.offset = offset;
-    unit.length = matchlen;
-    write_unit(instStream, unit);
-    unit.length = 0;
-  }
-
-  deltaStream.cursor = 0;
-  write_varint(deltaStream, instStream.cursor);
-  write_concat_buffer(deltaStream, instStream);
-  write_concat_buffer(deltaStream, dataStream);
-  *deltaSize = deltaStream.cursor;
-  *deltaBuf = deltaStream.buf;
-#if PRINT_PERF
-    clock_gettime(CLOCK_MONOTONIC, &tf1);
-    fprintf(stderr, "gencode took: %zdns\n", (tf1.tv_sec - tf0.tv_sec) * 1000000000 + tf1.tv_nsec - tf0.tv_nsec);
-#endif
- 
-  free(dataStream.buf);
-  free(instStream.buf);
-  free(hash_table);
-  return deltaStream.cursor; 
-}
-
-int gdecode(const uint8_t *deltaBuf, uint32_t deltaSize, const uint8_t *baseBuf, uint32_t baseSize,
-            uint8_t **outBuf, uint32_t *outSize) {
-
-  if (*outBuf == nullptr) {
-    *outBuf = (uint8_t*)malloc(INIT_BUFFER_SIZE);
-  }
-
-#if PRINT_PERF
-  struct timespec tf0, tf1;
-  clock_gettime(CLOCK_MONOTONIC, &tf0);
-#endif
-  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize}; // Instructions
-  const uint64_t instructionLength = read_varint(deltaStream);
-  const uint64_t instOffset = deltaStream.cursor;
-  ReadOnlyBufferStreamDescriptor addDeltaStream = {deltaBuf, deltaStream.cursor + instructionLength, deltaSize};
-  ReadOnlyBufferStreamDescriptor baseStream = {baseBuf, 0, baseSize}; // Data in
-  BufferStreamDescriptor outStream = {*outBuf, 0, *outSize};   // Data out
-  DeltaUnitMem unit = {};
-
-  while (deltaStream.cursor < instructionLength + instOffset) {
-    read_unit(deltaStream, unit);
-    if (unit.flag) // Read from original file using offset
-      stream_from(outStream, baseStream, unit.offset, unit.length);
-    else          // Read from delta file at current cursor
-      stream_into(outStream, addDeltaStream, unit.length);
-  }
-
-  *outSize = outStream.cursor;
-  *outBuf = outStream.buf;
-#if PRINT_PERF
-    clock_gettime(CLOCK_MONOTONIC, &tf1);
-    fprintf(stderr, "gdecode took: %zdns\n", (tf1.tv_sec - tf0.tv_sec) * 1000000000 + tf1.tv_nsec - tf0.tv_nsec);
-#endif
-  return outStream.cursor;
-}
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <compat/msvc.h>
+#else
+#include <ctime>
+#endif
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+#include "gear_matrix.h"
+
+#define INIT_BUFFER_SIZE 128 * 1024 
+#define FPTYPE uint64_t
+#define STRLOOK 16
+#define STRLSTEP 2
+static_assert(STRLSTEP < STRLOOK, "Sampling step must stay inside the window");
+
+// Largest index (2^bits entries), bounds memory use on very large bases
+#define MAX_HASH_BITS 30
+
+// With acceleration, the literal scan widens its step by one byte every
+// 2^SKIP_TRIGGER (64) consecutive misses
+#define SKIP_TRIGGER 6
+// Off: every position is probed, as before acceleration existed
+#define DEFAULT_ACCELERATION 0
+
+// Backward reach considered when ranking bucket candidates
+#define MAX_SCORED_BACKWARD 256
+
+// Decoded output is checksummed in pieces of this size while still in cache
+#define CHECKSUM_BLOCK (64 * 1024)
+
+/*
+ * Indexes every STRLSTEP-th window of `data` into buckets of `ways` entries,
+ * most recent position first. With one way this is the single-slot table of
+ * the fast level.
+ */
+template <typename IndexT>
+uint64_t GFixSizeChunking(const uint8_t *data, uint64_t len, int begflag,
+                          uint64_t begsize, IndexT *hash_table, int mask,
+                          uint32_t ways) {
+  if (len < STRLOOK)
+    return 0;
+
+  uint64_t i = 0;
+  int movebitlength = sizeof(FPTYPE) * 8 / STRLOOK;
+  if (sizeof(FPTYPE) * 8 % STRLOOK != 0)
+    movebitlength++;
+  FPTYPE fingerprint = 0;
+
+  /** GEAR **/
+  for (; i < STRLOOK; i++) {
+    fingerprint = (fingerprint << (movebitlength)) + GEARmx[data[i]];
+  }
+
+  /*
+   * Only every STRLSTEP-th window is indexed, so advance STRLSTEP bytes per
+   * step: the incoming bytes are combined off the dependency chain and
+   * `fingerprint` takes a single shift+add per sample instead of one per byte.
+   */
+  FPTYPE index = 0;
+  uint64_t lastWindow = len - STRLOOK;
+  uint64_t _begsize = begflag ? begsize : 0;
+  uint64_t used = 0; // buckets fill from the front, so only the last can be new
+  for (i = 0; i + STRLSTEP <= lastWindow;) {
+    FPTYPE incoming = 0;
+    for (int s = 0; s < STRLSTEP; s++)
+      incoming = (incoming << (movebitlength)) + GEARmx[data[i + STRLOOK + s]];
+    fingerprint = (fingerprint << (movebitlength * STRLSTEP)) + incoming;
+    i += STRLSTEP;
+
+    index = fingerprint >> (sizeof(FPTYPE) * 8 - mask);
+    if (ways == 1) {
+      used += hash_table[index] == 0;
+      hash_table[index] = i + _begsize;
+    } else {
+      IndexT *bucket = hash_table + index * ways;
+      used += bucket[ways - 1] == 0;
+      memmove(bucket + 1, bucket, (ways - 1) * sizeof(IndexT));
+      bucket[0] = i + _begsize;
+    }
+  }
+
+  return used;
+}
+
+// Number of fingerprint bits used to address the buckets of a table covering
+// `len` bytes; the table holds 2^bits * ways entries
+static int32_t hash_table_bits(uint64_t len, uint32_t ways) {
+  uint64_t tmp = len + 10;
+  int32_t bit;
+  for (bit = 0; tmp; bit++)
+    tmp >>= 1;
+  int32_t max_bit = MAX_HASH_BITS;
+  for (uint32_t w = ways; w > 1; w >>= 1)
+    max_bit--;
+  return bit < max_bit ? bit : max_bit;
+}
+
+// Index and search settings of each compression level
+typedef struct {
+  uint32_t ways; // entries per hash bucket, a power of two
+  uint32_t lazy; // later positions checked for a longer match
+} LevelParams;
+
+static const LevelParams level_params[GDELTA_MAX_LEVEL + 1] = {
+    {1, 0},  // unused
+    {1, 0},  // single slot, first match wins
+    {4, 0},
+    {8, 1},
+    {16, 2},
+};
+
+// Offsets past 4GiB need 64-bit table entries
+static bool needs_wide_index(uint64_t baseSize) {
+  return baseSize > UINT32_MAX;
+}
+
+gdelta_base *gdelta_base_prepare(const uint8_t *baseBuf, uint64_t baseSize) {
+  return gdelta_base_prepare_level(baseBuf, baseSize, GDELTA_DEFAULT_LEVEL);
+}
+
+gdelta_base *gdelta_base_prepare_level(const uint8_t *baseBuf,
+                                       uint64_t baseSize, int level) {
+  if (level < GDELTA_MIN_LEVEL || level > GDELTA_MAX_LEVEL)
+    return nullptr;
+  gdelta_base *base = (gdelta_base *)malloc(sizeof(gdelta_base));
+  if (base == nullptr)
+    return nullptr;
+
+  base->buf = baseBuf;
+  base->size = baseSize;
+  base->ways = level_params[level].ways;
+  base->bit = hash_table_bits(baseSize, base->ways);
+  base->wide = needs_wide_index(baseSize);
+  base->hash_table = calloc(((size_t)1 << base->bit) * base->ways,
+                            base->wide ? sizeof(uint64_t) : sizeof(uint32_t));
+  if (base->hash_table == nullptr) {
+    free(base);
+    return nullptr;
+  }
+
+  if (base->wide)
+    base->used = GFixSizeChunking(baseBuf, baseSize, 0, 0,
+                                  (uint64_t *)base->hash_table, base->bit,
+                                  base->ways);
+  else
+    base->used = GFixSizeChunking(baseBuf, baseSize, 0, 0,
+                                  (uint32_t *)base->hash_table, base->bit,
+                                  base->ways);
+  return base;
+}
+
+void gdelta_base_free(gdelta_base *base) {
+  if (base == nullptr)
+    return;
+  free(base->hash_table);
+  free(base);
+}
+
+gdelta_ctx *gdelta_ctx_new() {
+  return gdelta_ctx_new_with_allocator(nullptr);
+}
+
+gdelta_ctx *gdelta_ctx_new_with_allocator(const gdelta_allocator *alloc) {
+  void *mem = gdelta_malloc(alloc, sizeof(gdelta_ctx));
+  if (mem == nullptr)
+    return nullptr;
+  gdelta_ctx *ctx = new (mem) gdelta_ctx();
+  if (alloc != nullptr) {
+    ctx->custom = *alloc;
+    ctx->alloc = &ctx->custom;
+  }
+
+  ctx->inst = {(uint8_t *)gdelta_malloc(ctx->alloc, INIT_BUFFER_SIZE), 0, INIT_BUFFER_SIZE, ctx->alloc};
+  ctx->data = {(uint8_t *)gdelta_malloc(ctx->alloc, INIT_BUFFER_SIZE), 0, INIT_BUFFER_SIZE, ctx->alloc};
+  ctx->out = {nullptr, 0, 0, ctx->alloc};
+  ctx->acceleration = DEFAULT_ACCELERATION;
+  ctx->level = GDELTA_DEFAULT_LEVEL;
+  if (ctx->inst.buf == nullptr || ctx->data.buf == nullptr) {
+    gdelta_ctx_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+void gdelta_ctx_reset(gdelta_ctx *ctx) {
+  ctx->inst.cursor = 0;
+  ctx->data.cursor = 0;
+  ctx->out.cursor = 0;
+  ctx->inst.grows = ctx->data.grows = ctx->out.grows = 0;
+  ctx->inst.failed = ctx->data.failed = ctx->out.failed = false;
+  ctx->stats = {};
+}
+
+int gdelta_ctx_set_param(gdelta_ctx *ctx, int param, int64_t value) {
+  switch (param) {
+  case GDELTA_PARAM_ACCELERATION:
+    if (value < 0 || value > GDELTA_MAX_ACCELERATION)
+      return GDELTA_ERR_PARAM;
+    ctx->acceleration = (uint32_t)value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_LEVEL:
+    if (value < GDELTA_MIN_LEVEL || value > GDELTA_MAX_LEVEL)
+      return GDELTA_ERR_PARAM;
+    ctx->level = (int)value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_ENTROPY:
+    if (value != 0 && value != 1)
+      return GDELTA_ERR_PARAM;
+    ctx->entropy = value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_CHECKSUM:
+    if (value != 0 && value != 1)
+      return GDELTA_ERR_PARAM;
+    ctx->checksum = value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_IN_PLACE:
+    if (value != 0 && value != 1)
+      return GDELTA_ERR_PARAM;
+    ctx->inPlace = value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_INDEX_INTERVAL:
+    if (value < 0)
+      return GDELTA_ERR_PARAM;
+    ctx->indexInterval = value;
+    return GDELTA_OK;
+  case GDELTA_PARAM_STATS:
+    if (value != 0 && value != 1)
+      return GDELTA_ERR_PARAM;
+    ctx->collectStats = value;
+    return GDELTA_OK;
+  default:
+    return GDELTA_ERR_PARAM;
+  }
+}
+
+void gdelta_ctx_free(gdelta_ctx *ctx) {
+  if (ctx == nullptr)
+    return;
+  gdelta_allocator custom = ctx->custom;
+  const gdelta_allocator *alloc = ctx->alloc ? &custom : nullptr;
+  gdelta_free(alloc, ctx->inst.buf);
+  gdelta_free(alloc, ctx->data.buf);
+  gdelta_free(alloc, ctx->out.buf);
+  gdelta_free(alloc, ctx->hash_table);
+  gdelta_free(alloc, ctx);
+}
+
+int gdelta_ctx_stats(const gdelta_ctx *ctx, gdelta_stats *stats) {
+  if (!ctx->collectStats)
+    return GDELTA_ERR_PARAM;
+  *stats = ctx->stats;
+  return GDELTA_OK;
+}
+
+// Monotonic time for the phase timings, 0 unless the context collects stats
+static uint64_t stats_clock(const gdelta_ctx *ctx) {
+  if (!ctx->collectStats)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds the units of an instruction section to the unit counters; `inPlace`
+// sections carry a target offset before every unit
+static void tally_units(const uint8_t *inst, uint64_t size, bool inPlace,
+                        gdelta_stats &stats) {
+  ReadOnlyBufferStreamDescriptor instStream = {inst, 0, size};
+  DeltaUnitMem unit = {};
+  while (instStream.cursor < size) {
+    if (inPlace)
+      read_varint(instStream);
+    read_unit(instStream, unit);
+    if (unit.flag) {
+      stats.copy_units++;
+      stats.copy_bytes += unit.length;
+    } else {
+      stats.literal_units++;
+      stats.literal_bytes += unit.length;
+    }
+  }
+}
+
+// Zeroed table of 2^bit buckets from the context, grown only when too small;
+// null if it cannot grow, the old table is kept then
+template <typename IndexT>
+static IndexT *ctx_hash_table(gdelta_ctx *ctx, int32_t bit, uint32_t ways) {
+  uint64_t hash_bytes = ((uint64_t)1 << bit) * ways * sizeof(IndexT);
+  if (hash_bytes > ctx->hash_capacity) {
+    void *table = gdelta_malloc(ctx->alloc, hash_bytes);
+    if (table == nullptr)
+      return nullptr;
+    gdelta_free(ctx->alloc, ctx->hash_table);
+    ctx->hash_table = table;
+    ctx->hash_capacity = hash_bytes;
+  }
+  memset(ctx->hash_table, 0, hash_bytes);
+  return (IndexT *)ctx->hash_table;
+}
+
+/*
+ * Picks the bucket candidate covering the most bytes for the window at
+ * `pos`, counting what it takes back from the `pending` literal bytes before
+ * it (up to MAX_SCORED_BACKWARD, so long literal runs stay linear). Returns
+ * its length from `pos` (0 if none matches) and sets `offset`. Candidates
+ * failing the byte compare are counted in `rejected`.
+ */
+template <typename IndexT>
+static uint64_t best_match(const IndexT *bucket, uint32_t ways,
+                           const uint8_t *baseBuf, uint64_t baseLimit,
+                           const uint8_t *newBuf, uint64_t pos,
+                           uint64_t newLimit, uint64_t pending,
+                           uint64_t &offset, uint64_t &rejected) {
+  uint64_t bestCover = 0, bestLength = 0;
+  for (uint32_t w = 0; w < ways && bucket[w] != 0; w++) {
+    uint64_t cand = bucket[w];
+    if (memcmp(newBuf + pos, baseBuf + cand, STRLOOK) != 0) {
+      rejected++;
+      continue;
+    }
+
+    uint64_t baseRest = cand + STRLOOK < baseLimit ? baseLimit - (cand + STRLOOK) : 0;
+    uint64_t newRest = newLimit - pos - STRLOOK;
+    uint64_t length = STRLOOK + match_forward(baseBuf + cand + STRLOOK, newBuf + pos + STRLOOK,
+                                              baseRest < newRest ? baseRest : newRest);
+    uint64_t reach = pending < MAX_SCORED_BACKWARD ? pending : MAX_SCORED_BACKWARD;
+    uint64_t back = match_backward(baseBuf + cand, newBuf + pos,
+                                   cand < reach ? cand : reach);
+    if (length + back > bestCover) {
+      bestCover = length + back;
+      bestLength = length;
+      offset = cand;
+    }
+  }
+  return bestLength;
+}
+
+void write_sections(BufferStreamDescriptor &deltaStream,
+                           const BufferStreamDescriptor &instStream,
+                           const BufferStreamDescriptor &dataStream,
+                           bool entropy) {
+  if (entropy) {
+    huffman_write_block(deltaStream, instStream.buf, instStream.cursor);
+    huffman_write_block(deltaStream, dataStream.buf, dataStream.cursor);
+    return;
+  }
+  write_varint(deltaStream, instStream.cursor);
+  write_concat_buffer(deltaStream, instStream);
+  write_concat_buffer(deltaStream, dataStream);
+}
+
+// Output timing, unit counts and buffer growth of an encode; the rest of
+// the stats are filled by the encoder as it goes
+static void finish_encode_stats(gdelta_ctx *ctx,
+                                const BufferStreamDescriptor &deltaStream,
+                                uint64_t outputStart) {
+  gdelta_stats &stats = ctx->stats;
+  stats.output_ns = stats_clock(ctx) - outputStart;
+  stats.reallocs = ctx->inst.grows + ctx->data.grows + deltaStream.grows;
+  if (ctx->collectStats)
+    tally_units(ctx->inst.buf, ctx->inst.cursor, false, stats);
+}
+
+/*
+ * Shared encoder body; when `base` is given its index (covering the whole
+ * base) is used instead of chunking the region between head and tail.
+ * The plain delta is appended to `deltaStream`. IndexT is the hash
+ * table entry type, wide enough to hold any base offset. Deep enables the
+ * bucketed search of the higher levels, the fast level keeps the single
+ * probe.
+ */
+template <typename IndexT, bool Deep>
+static int64_t gencode_impl(gdelta_ctx *ctx, const uint8_t *newBuf,
+                            uint64_t newSize, const uint8_t *baseBuf,
+                            uint64_t baseSize, const gdelta_base *base,
+                            bool entropy, BufferStreamDescriptor &deltaStream) {
+  gdelta_stats &stats = ctx->stats;
+  uint64_t tStart = stats_clock(ctx);
+
+  /* detect the head and tail of one chunk */
+  uint64_t beg = 0, end = 0, begSize = 0, endSize = 0;
+
+  // Find first difference
+  uint64_t common = baseSize < newSize ? baseSize : newSize;
+  begSize = match_forward(baseBuf, newBuf, common);
+
+  if (begSize > 16)
+    beg = 1;
+  else
+    begSize = 0;
+
+  // Find first difference (from the end)
+  endSize = match_backward(baseBuf + baseSize, newBuf + newSize, common);
+
+  if (begSize + endSize > newSize)
+    endSize = newSize - begSize;
+
+  if (endSize > 16)
+    end = 1;
+  else
+    endSize = 0;
+  /* end of detect */
+  uint64_t tDetect = stats_clock(ctx);
+  stats.prefix_suffix_ns = tDetect - tStart;
+
+  BufferStreamDescriptor &instStream = ctx->inst; // Instruction stream
+  BufferStreamDescriptor &dataStream = ctx->data;
+  ReadOnlyBufferStreamDescriptor newStream = {newBuf, begSize, newSize};
+  DeltaUnitMem unit = {}; // In-memory represtation of current working unit
+
+  if (begSize + endSize >= baseSize) { // TODO: test this path
+    if (beg) {
+      // Data at start is from the original file, write instruction to copy from base
+      unit.flag = true;
+      unit.offset = 0;
+      unit.length = begSize;
+      write_unit(instStream, unit);
+    }
+    if (newSize - begSize - endSize > 0) {
+      uint64_t litlen = newSize - begSize - endSize;
+      unit.flag = false;
+      unit.length = litlen;
+      write_unit(instStream, unit);
+      stream_into(dataStream, newStream, litlen);
+    }
+    if (end) {
+      uint64_t matchlen = endSize;
+      uint64_t offset = baseSize - endSize;
+      unit.flag = true;
+      unit.offset = offset;
+      unit.length = matchlen;
+      write_unit(instStream, unit);
+    }
+
+    write_sections(deltaStream, instStream, dataStream, entropy);
+    finish_encode_stats(ctx, deltaStream, tDetect);
+    return deltaStream.cursor;
+  }
+
+  IndexT *hash_table;
+  int32_t bit;
+  uint32_t ways;
+  if (base != nullptr) {
+    // Prepared index over the whole base, skip straight to the lookup
+    hash_table = (IndexT *)base->hash_table;
+    bit = base->bit;
+    ways = base->ways;
+    stats.index_used = base->used;
+  } else {
+    /* chunk the baseFile */
+    ways = level_params[ctx->level].ways;
+    bit = hash_table_bits(baseSize - begSize - endSize, ways);
+    hash_table = ctx_hash_table<IndexT>(ctx, bit, ways);
+    if (hash_table == nullptr)
+      return GDELTA_ERR_MEMORY;
+
+    stats.index_used = GFixSizeChunking(baseBuf + begSize,
+                                        baseSize - begSize - endSize, beg,
+                                        begSize, hash_table, bit, ways);
+  }
+  uint32_t lazy = level_params[ctx->level].lazy;
+  uint64_t tIndex = stats_clock(ctx);
+  stats.index_ns = tIndex - tDetect;
+  stats.index_slots = ((uint64_t)1 << bit) * ways;
+  /* end of inserting */
+
+  uint64_t inputPos = begSize;
+  uint64_t cursor;
+  int32_t movebitlength = 0;
+  if (sizeof(FPTYPE) * 8 % STRLOOK == 0)
+    movebitlength = sizeof(FPTYPE) * 8 / STRLOOK;
+  else
+    movebitlength = sizeof(FPTYPE) * 8 / STRLOOK + 1;
+
+  if (beg) {
+    // Data at start is from the original file, write instruction to copy from base
+    unit.flag = true;
+    unit.offset = 0;
+    unit.length = begSize;
+    write_unit(instStream, unit);
+    unit.length = 0; // Mark as written
+  }
+
+  FPTYPE fingerprint = 0;
+  for (uint64_t i = 0; i < STRLOOK && i < newSize - endSize - inputPos; i++) {
+    fingerprint = (fingerprint << (movebitlength)) + GEARmx[(newBuf + inputPos)[i]];
+  }
+
+  uint64_t handlebytes = begSize;
+  uint64_t misses = 0;
+  uint64_t probes = 0, hits = 0, rejected = 0;
+  uint32_t acceleration = ctx->acceleration;
+  while (inputPos + STRLOOK <= newSize - endSize) {
+    uint64_t length;
+    bool matchflag = false;
+    if (newSize - endSize - inputPos < STRLOOK) {
+      cursor = inputPos + (newSize - endSize);
+      length = newSize - endSize - inputPos;
+    } else {
+      cursor = inputPos + STRLOOK;
+      length = STRLOOK;
+    }
+    uint64_t index1 = fingerprint >> (sizeof(FPTYPE) * 8 - bit);
+    uint64_t offset = 0;
+    uint64_t j = 0;
+    uint64_t defer = 0;
+    probes++;
+    if (Deep) {
+      uint64_t pending = unit.flag ? 0 : unit.length;
+      uint64_t found = best_match(hash_table + index1 * ways, ways, baseBuf,
+                                  baseSize - endSize, newBuf, inputPos,
+                                  newSize - endSize, pending, offset,
+                                  rejected);
+      if (found) {
+        matchflag = true;
+        j = found - length;
+      }
+
+      // Lazy step: give up this match for a longer one starting at one of the
+      // next positions, the bytes in between stay literal
+      FPTYPE lookahead = fingerprint;
+      for (uint64_t d = 1; matchflag && d <= lazy &&
+                           inputPos + d + STRLOOK <= newSize - endSize; d++) {
+        lookahead = (lookahead << (movebitlength)) + GEARmx[newBuf[inputPos + d + STRLOOK - 1]];
+        uint64_t index2 = lookahead >> (sizeof(FPTYPE) * 8 - bit);
+        uint64_t laterOffset;
+        probes++;
+        uint64_t later = best_match(hash_table + index2 * ways, ways, baseBuf,
+                                    baseSize - endSize, newBuf, inputPos + d,
+                                    newSize - endSize, pending + d, laterOffset,
+                                    rejected);
+        if (later > found) {
+          matchflag = false;
+          defer = d;
+        }
+      }
+    } else if (hash_table[index1] != 0 && memcmp(newBuf + inputPos, baseBuf + hash_table[index1], length) != 0) {
+      rejected++;
+    } else if (hash_table[index1] != 0) {
+      matchflag = true;
+      offset = hash_table[index1];
+
+      // Check how much is possible to copy
+      uint64_t baseRest = offset + length < baseSize - endSize
+                              ? baseSize - endSize - (offset + length) : 0;
+      uint64_t newRest = newSize - endSize - cursor;
+      j = match_forward(baseBuf + offset + length, newBuf + cursor,
+                        baseRest < newRest ? baseRest : newRest);
+    }
+
+    /* New data match found in hashtable/base data; attempt to create copy instruction*/
+    if (matchflag) {
+      hits++;
+      cursor += j;
+
+
+      uint64_t matchlen = cursor - inputPos;
+      handlebytes += cursor - inputPos;
+      uint64_t _offset = offset;
+
+
+      // Check if switching modes Literal -> Copy, and dump instruction if available
+      if (!unit.flag && unit.length) {
+        uint64_t litStart = inputPos - unit.length;
+        /* Detect if end of previous literal could have been a partial copy*/
+        uint64_t k = match_backward(baseBuf + offset, newBuf + inputPos,
+                                    offset < unit.length ? offset : unit.length);
+
+        if (k > 0) {
+          // Reduce literal by the amount covered by the copy
+          unit.length -= k;
+          // Set up adjusted copy parameters
+          matchlen += k;
+          _offset -= k;
+        }
+
+        // The literal run is complete, copy its data in one go; nothing is
+        // left of it if the copy reached back over all of it
+        if (unit.length) {
+          stream_from(dataStream, newStream, litStart, unit.length);
+          write_unit(instStream, unit);
+        }
+        unit.length = 0; // Mark written
+      }
+
+      unit.flag = true;
+      unit.offset = _offset;
+      unit.length = matchlen;
+      write_unit(instStream, unit);
+      unit.length = 0; // Mark written
+
+
+      // Update cursor (inputPos) and fingerprint
+      for (uint64_t k = cursor; k < cursor + STRLOOK && cursor + STRLOOK < newSize - endSize; k++) {
+        fingerprint = (fingerprint << (movebitlength)) + GEARmx[newBuf[k]];
+      }
+      inputPos = cursor;
+      misses = 0;
+    } else { // No match, need to write additional (literal) data
+      /*
+       * Accumulate length (as literal) in unit while no match is found, the
+       * data is copied once the run ends. With acceleration the step widens
+       * as misses pile up; it stays odd so both phases of the base sampling
+       * (every STRLSTEP bytes) are probed.
+       */
+      uint64_t step = 1;
+      if (defer)
+        step = defer;
+      else if (acceleration)
+        step = (acceleration + (misses++ >> SKIP_TRIGGER)) | 1;
+      if (step > newSize - endSize - inputPos)
+        step = newSize - endSize - inputPos;
+
+      unit.flag = false;
+      unit.length += step;
+      handlebytes += step;
+
+      // Update cursor (inputPos) and fingerprint; bytes older than STRLOOK
+      // are shifted out, so a long step re-seeds from the new window only
+      uint64_t from = inputPos + (step < STRLOOK ? STRLOOK : step);
+      for (uint64_t k = from; k < inputPos + step + STRLOOK && k < newSize - endSize; k++)
+        fingerprint = (fingerprint << (movebitlength)) + GEARmx[newBuf[k]];
+      inputPos += step;
+    }
+  }
+
+  uint64_t tLookup = stats_clock(ctx);
+  stats.lookup_ns = tLookup - tIndex;
+  stats.probes = probes;
+  stats.hits = hits;
+  stats.false_positives = rejected;
+
+  // Flush the pending literal run together with the bytes left after the scan
+  uint64_t litStart = handlebytes - (unit.flag ? 0 : unit.length);
+  if (newSize - endSize > litStart) {
+    stream_from(dataStream, newStream, litStart, newSize - endSize - litStart);
+
+    unit.flag = false;
+    unit.length = newSize - endSize - litStart;
+    write_unit(instStream, unit);
+    unit.length = 0;
+  }
+
+  if (end) {
+    uint64_t matchlen = endSize;
+    uint64_t offset = baseSize - endSize;
+     
+    unit.flag = true;
+    unit.offset = offset;
+    unit.length = matchlen;
+    write_unit(instStream, unit);
+    unit.length = 0;
+  }
+
+  write_sections(deltaStream, instStream, dataStream, entropy);
+  finish_encode_stats(ctx, deltaStream, tLookup);
+  return deltaStream.cursor;
+}
+
+// Picks the index width for the base and runs the encoder
+static int64_t gencode_dispatch(gdelta_ctx *ctx, const uint8_t *newBuf,
+                                uint64_t newSize, const uint8_t *baseBuf,
+                                uint64_t baseSize, const gdelta_base *base,
+                                bool entropy,
+                                BufferStreamDescriptor &deltaStream) {
+  bool wide = base != nullptr ? base->wide : needs_wide_index(baseSize);
+  uint32_t ways = base != nullptr ? base->ways : level_params[ctx->level].ways;
+  bool deep = ways > 1 || level_params[ctx->level].lazy > 0;
+  if (wide && deep)
+    return gencode_impl<uint64_t, true>(ctx, newBuf, newSize, baseBuf,
+                                        baseSize, base, entropy, deltaStream);
+  if (wide)
+    return gencode_impl<uint64_t, false>(ctx, newBuf, newSize, baseBuf,
+                                         baseSize, base, entropy, deltaStream);
+  if (deep)
+    return gencode_impl<uint32_t, true>(ctx, newBuf, newSize, baseBuf,
+                                        baseSize, base, entropy, deltaStream);
+  return gencode_impl<uint32_t, false>(ctx, newBuf, newSize, baseBuf,
+                                       baseSize, base, entropy, deltaStream);
+}
+
+// GDELTA_ERR_MEMORY instead of `ret` when a stream of the encode could not
+// grow, its output is incomplete then
+static int64_t encode_status(const gdelta_ctx *ctx,
+                             const BufferStreamDescriptor &deltaStream,
+                             int64_t ret) {
+  if (ret >= 0 && (ctx->inst.failed || ctx->data.failed || deltaStream.failed))
+    return GDELTA_ERR_MEMORY;
+  return ret;
+}
+
+// The index and in-place rewrite of gencode_run() count as output, its
+// growth of the delta stream as reallocations
+static void finish_rewrite_stats(gdelta_ctx *ctx,
+                                 const BufferStreamDescriptor &deltaStream,
+                                 uint64_t rewriteStart) {
+  ctx->stats.output_ns += stats_clock(ctx) - rewriteStart;
+  ctx->stats.reallocs = ctx->inst.grows + ctx->data.grows + deltaStream.grows;
+}
+
+// Header flags for the context's params. The entropy stage, in-place
+// ordering and the index are flagged in the header, plain deltas never use
+// them. Placed units are not in target order, so in-place deltas go without
+// an index.
+static uint8_t run_flags(const gdelta_ctx *ctx) {
+  uint8_t flags = 0;
+  if (ctx->entropy)
+    flags |= GDELTA_FLAG_ENTROPY;
+  if (ctx->inPlace)
+    flags |= GDELTA_FLAG_IN_PLACE;
+  else if (ctx->indexInterval > 0)
+    flags |= GDELTA_FLAG_INDEX;
+  if (ctx->checksum)
+    flags |= GDELTA_FLAG_CHECKSUM;
+  return flags;
+}
+
+static void write_run_header(BufferStreamDescriptor &deltaStream,
+                             uint8_t flags, const uint8_t *newBuf,
+                             uint64_t newSize, const uint8_t *baseBuf,
+                             uint64_t baseSize) {
+  DeltaHeader fields = {GDELTA_VERSION, flags, newSize, baseSize, 1, 0, 0, 0, 0, 0};
+  if (flags & GDELTA_FLAG_CHECKSUM) {
+    fields.baseChecksum = checksum(baseBuf, baseSize);
+    fields.targetChecksum = checksum(newBuf, newSize);
+  }
+  write_header(deltaStream, fields);
+  if (flags & GDELTA_FLAG_CHECKSUM)
+    write_checksums(deltaStream, fields);
+}
+
+/*
+ * Writes the body of a delta from `bodyStart` on, built from the
+ * instruction and literal sections left in the context: the index if
+ * flagged, then the sections, rewritten into placed units for in-place
+ * deltas.
+ */
+static int64_t write_run_body(gdelta_ctx *ctx, const uint8_t *newBuf,
+                              uint8_t flags, uint64_t bodyStart,
+                              BufferStreamDescriptor &deltaStream) {
+  uint64_t tRewrite = stats_clock(ctx);
+  bool entropy = flags & GDELTA_FLAG_ENTROPY;
+  deltaStream.cursor = bodyStart;
+  if (!(flags & GDELTA_FLAG_IN_PLACE)) {
+    if (flags & GDELTA_FLAG_INDEX)
+      write_index(deltaStream, ctx->inst.buf, ctx->inst.cursor,
+                  ctx->indexInterval);
+    write_sections(deltaStream, ctx->inst, ctx->data, entropy);
+    finish_rewrite_stats(ctx, deltaStream, tRewrite);
+    return encode_status(ctx, deltaStream, deltaStream.cursor);
+  }
+  BufferStreamDescriptor placed = {nullptr, 0, 0, ctx->alloc};
+  int64_t ret = order_in_place(ctx->inst.buf, ctx->inst.cursor, newBuf,
+                               placed, ctx->data, ctx->alloc);
+  if (ret == GDELTA_OK && placed.failed)
+    ret = GDELTA_ERR_MEMORY;
+  if (ret == GDELTA_OK) {
+    write_sections(deltaStream, placed, ctx->data, entropy);
+    ret = deltaStream.cursor;
+  }
+  finish_rewrite_stats(ctx, deltaStream, tRewrite);
+  ctx->stats.reallocs += placed.grows;
+  gdelta_free(ctx->alloc, placed.buf);
+  return encode_status(ctx, deltaStream, ret);
+}
+
+int64_t gencode_run(gdelta_ctx *ctx, const uint8_t *newBuf,
+                    uint64_t newSize, const uint8_t *baseBuf,
+                    uint64_t baseSize, const gdelta_base *base, bool header,
+                    BufferStreamDescriptor &deltaStream) {
+  gdelta_ctx_reset(ctx);
+  uint8_t flags = header ? run_flags(ctx) : 0;
+  if (header)
+    write_run_header(deltaStream, flags, newBuf, newSize, baseBuf, baseSize);
+  if (!(flags & (GDELTA_FLAG_IN_PLACE | GDELTA_FLAG_INDEX)))
+    return encode_status(ctx, deltaStream,
+                         gencode_dispatch(ctx, newBuf, newSize, baseBuf,
+                                          baseSize, base,
+                                          flags & GDELTA_FLAG_ENTROPY,
+                                          deltaStream));
+
+  // The plain body is written first, then replaced by the index and the
+  // final sections
+  uint64_t bodyStart = deltaStream.cursor;
+  int64_t ret = gencode_dispatch(ctx, newBuf, newSize, baseBuf, baseSize,
+                                 base, false, deltaStream);
+  if (ret < 0)
+    return ret;
+  return write_run_body(ctx, newBuf, flags, bodyStart, deltaStream);
+}
+
+int64_t gencode_finish(gdelta_ctx *ctx, const uint8_t *newBuf,
+                       uint64_t newSize, const uint8_t *baseBuf,
+                       uint64_t baseSize, BufferStreamDescriptor &deltaStream) {
+  uint8_t flags = run_flags(ctx);
+  write_run_header(deltaStream, flags, newBuf, newSize, baseBuf, baseSize);
+  if (ctx->collectStats)
+    tally_units(ctx->inst.buf, ctx->inst.cursor, false, ctx->stats);
+  return write_run_body(ctx, newBuf, flags, deltaStream.cursor, deltaStream);
+}
+
+// Runs one encode with a throwaway context into the caller's buffer
+static int64_t gencode_oneshot(const uint8_t *newBuf, uint64_t newSize,
+                               const uint8_t *baseBuf, uint64_t baseSize,
+                               const gdelta_base *base, uint8_t **deltaBuf,
+                               uint64_t *deltaSize) {
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  if (ctx == nullptr)
+    return GDELTA_ERR_MEMORY;
+
+  BufferStreamDescriptor deltaStream = {*deltaBuf, 0, *deltaSize};
+  if (deltaStream.buf == nullptr)
+    deltaStream.length = 0;
+  int64_t ret = gencode_run(ctx, newBuf, newSize, baseBuf, baseSize, base,
+                            true, deltaStream);
+  *deltaSize = deltaStream.cursor;
+  *deltaBuf = deltaStream.buf;
+
+  gdelta_ctx_free(ctx);
+  return ret;
+}
+
+int gencode(const uint8_t *newBuf, uint32_t newSize, const uint8_t *baseBuf,
+            uint32_t baseSize, uint8_t **deltaBuf, uint32_t *deltaSize) {
+  uint64_t size = *deltaSize;
+  int64_t ret = gencode_oneshot(newBuf, newSize, baseBuf, baseSize, nullptr,
+                                deltaBuf, &size);
+  *deltaSize = size;
+  return ret;
+}
+
+int64_t gencode64(const uint8_t *newBuf, uint64_t newSize,
+                  const uint8_t *baseBuf, uint64_t baseSize,
+                  uint8_t **deltaBuf, uint64_t *deltaSize) {
+  return gencode_oneshot(newBuf, newSize, baseBuf, baseSize, nullptr,
+                         deltaBuf, deltaSize);
+}
+
+int64_t gencode_with_base(const uint8_t *newBuf, uint64_t newSize,
+                          const gdelta_base *base, uint8_t **deltaBuf,
+                          uint64_t *deltaSize) {
+  return gencode_oneshot(newBuf, newSize, base->buf, base->size, base,
+                         deltaBuf, deltaSize);
+}
+
+int64_t gencode_ctx(gdelta_ctx *ctx, const uint8_t *newBuf, uint64_t newSize,
+                    const uint8_t *baseBuf, uint64_t baseSize,
+                    const uint8_t **deltaBuf, uint64_t *deltaSize) {
+  int64_t ret = gencode_run(ctx, newBuf, newSize, baseBuf, baseSize, nullptr,
+                            true, ctx->out);
+  *deltaBuf = ctx->out.buf;
+  *deltaSize = ctx->out.cursor;
+  return ret;
+}
+
+int64_t gencode_ctx_with_base(gdelta_ctx *ctx, const uint8_t *newBuf,
+                              uint64_t newSize, const gdelta_base *base,
+                              const uint8_t **deltaBuf, uint64_t *deltaSize) {
+  int64_t ret = gencode_run(ctx, newBuf, newSize, base->buf, base->size, base,
+                            true, ctx->out);
+  *deltaBuf = ctx->out.buf;
+  *deltaSize = ctx->out.cursor;
+  return ret;
+}
+
+int64_t gencode_multi(const uint8_t *newBuf, uint64_t newSize,
+                      const uint8_t *const *baseBufs,
+                      const uint64_t *baseSizes, size_t baseCount,
+                      uint8_t **deltaBuf, uint64_t *deltaSize) {
+  if (baseCount == 1)
+    return gencode64(newBuf, newSize, baseBufs[0], baseSizes[0], deltaBuf,
+                     deltaSize);
+
+  // One index over the bases laid out back to back, so a single lookup
+  // searches them all and copy offsets fall into the concatenated space
+  BufferStreamDescriptor baseStream = {};
+  for (size_t i = 0; i < baseCount; i++) {
+    ReadOnlyBufferStreamDescriptor part = {baseBufs[i], 0, baseSizes[i]};
+    if (baseSizes[i])
+      stream_into(baseStream, part, baseSizes[i]);
+  }
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  if (ctx == nullptr || baseStream.failed) {
+    gdelta_ctx_free(ctx);
+    free(baseStream.buf);
+    return GDELTA_ERR_MEMORY;
+  }
+
+  BufferStreamDescriptor deltaStream = {*deltaBuf, 0, *deltaSize};
+  if (deltaStream.buf == nullptr)
+    deltaStream.length = 0;
+  write_header(deltaStream, {GDELTA_VERSION, GDELTA_FLAG_MULTI_BASE, newSize,
+                             baseStream.cursor, baseCount, 0, 0, 0, 0, 0});
+  write_base_list(deltaStream, baseSizes, baseCount);
+  int64_t ret = gencode_run(ctx, newBuf, newSize, baseStream.buf,
+                            baseStream.cursor, nullptr, false, deltaStream);
+  *deltaSize = deltaStream.cursor;
+  *deltaBuf = deltaStream.buf;
+
+  gdelta_ctx_free(ctx);
+  free(baseStream.buf);
+  return ret;
+}
+
+static void copy_from_base(uint8_t *out,
+                           const ReadOnlyBufferStreamDescriptor &baseStream,
+                           uint64_t offset, uint64_t length) {
+  memcpy(out, baseStream.buf + offset, length);
+}
+
+// Several bases seen as their concatenation, `starts` holds count + 1 offsets
+typedef struct {
+  const uint8_t *const *bufs;
+  const uint64_t *starts;
+  size_t count;
+} MultiBase;
+
+// Copies a range of the concatenated bases, split where it crosses into the
+// next one
+static void copy_from_base(uint8_t *out, const MultiBase &bases,
+                           uint64_t offset, uint64_t length) {
+  size_t i = 0;
+  while (length > 0) {
+    while (offset >= bases.starts[i + 1])
+      i++;
+    uint64_t n = bases.starts[i + 1] - offset;
+    if (n > length)
+      n = length;
+    memcpy(out, bases.bufs[i] + (offset - bases.starts[i]), n);
+    out += n;
+    offset += n;
+    length -= n;
+  }
+}
+
+/*
+ * Decodes the plain delta at deltaStream.cursor, appending to `outStream`;
+ * afterwards the cursor points past its literal data. The delta must have
+ * passed validate_delta() and `outStream` must have room for its target,
+ * nothing is checked here. The output is added to `sum`, if given, every
+ * CHECKSUM_BLOCK bytes while it is still in cache.
+ */
+template <typename BaseT>
+static void decode_plain(ReadOnlyBufferStreamDescriptor &deltaStream,
+                         const BaseT &baseStream,
+                         BufferStreamDescriptor &outStream,
+                         ChecksumState *sum) {
+  const uint64_t instructionLength = read_varint(deltaStream);
+  const uint64_t instEnd = deltaStream.cursor + instructionLength;
+  const uint8_t *literal = deltaStream.buf + instEnd;
+  uint8_t *out = outStream.buf + outStream.cursor;
+  uint8_t *hashed = out;
+  DeltaUnitMem unit = {};
+
+  while (deltaStream.cursor < instEnd) {
+    read_unit(deltaStream, unit);
+    if (unit.flag) { // Read from original file using offset
+      copy_from_base(out, baseStream, unit.offset, unit.length);
+    } else {         // Read from delta file at current cursor
+      memcpy(out, literal, unit.length);
+      literal += unit.length;
+    }
+    out += unit.length;
+    if (sum != nullptr && (uint64_t)(out - hashed) >= CHECKSUM_BLOCK) {
+      checksum_update(*sum, hashed, out - hashed);
+      hashed = out;
+    }
+  }
+  if (sum != nullptr)
+    checksum_update(*sum, hashed, out - hashed);
+  outStream.cursor = out - outStream.buf;
+  deltaStream.cursor = literal - deltaStream.buf;
+}
+
+// Decodes a validated delta of any format but entropy-coded, see decode_plain
+template <typename BaseT>
+static void decode_delta(const uint8_t *deltaBuf, uint64_t deltaSize,
+                         const BaseT &baseStream,
+                         BufferStreamDescriptor &outStream, ChecksumState *sum) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+
+  DeltaHeader header;
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_FRAMED)) {
+    // Frames of <window size, plain delta>, ended by an empty window
+    deltaStream.cursor = CONTAINER_PREFIX_SIZE;
+    while (read_varint(deltaStream) != 0)
+      decode_plain(deltaStream, baseStream, outStream, sum);
+  } else if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    read_header(deltaStream, header);
+    decode_plain(deltaStream, baseStream, outStream, sum);
+  } else {
+    decode_plain(deltaStream, baseStream, outStream, sum);
+  }
+}
+
+/*
+ * Validates and decodes a delta that is not entropy-coded into `outStream`,
+ * sized once up front. With `header` carrying checksums the target is
+ * hashed as it is written and checked at the end.
+ */
+template <typename BaseT>
+static int64_t decode_checked(const uint8_t *deltaBuf, uint64_t deltaSize,
+                              const BaseT &baseStream, uint64_t baseSize,
+                              const DeltaHeader *header,
+                              BufferStreamDescriptor &outStream,
+                              uint64_t capacity) {
+  int64_t size = validate_delta(deltaBuf, deltaSize, baseSize);
+  if (size < 0)
+    return size;
+  if ((uint64_t)size > capacity)
+    return GDELTA_ERR_BUFFER;
+  if (!ensure_stream_length(outStream, size))
+    return GDELTA_ERR_MEMORY;
+
+  bool verify = header != nullptr && (header->flags & GDELTA_FLAG_CHECKSUM);
+  ChecksumState sum;
+  checksum_init(sum);
+  decode_delta(deltaBuf, deltaSize, baseStream, outStream,
+               verify ? &sum : nullptr);
+  if (verify && checksum_final(sum) != header->targetChecksum)
+    return GDELTA_ERR_CHECKSUM;
+  return outStream.cursor;
+}
+
+// Checks the plain delta at deltaStream.cursor and adds its target size to
+// `size`, see validate_delta; `plain` if it has no container around it
+static bool validate_plain(ReadOnlyBufferStreamDescriptor &deltaStream,
+                           uint64_t baseSize, bool plain, uint64_t &size) {
+  uint64_t instructionLength;
+  if (!read_varint_checked(deltaStream, instructionLength) ||
+      instructionLength > deltaStream.length - deltaStream.cursor)
+    return false;
+  ReadOnlyBufferStreamDescriptor instStream = {
+      deltaStream.buf, deltaStream.cursor,
+      deltaStream.cursor + instructionLength};
+  uint64_t literal = deltaStream.length - instStream.length; // left to use
+  DeltaUnitMem unit = {};
+
+  while (instStream.cursor < instStream.length) {
+    if (!read_unit_checked(instStream, unit) || bad_empty_unit(unit, plain) ||
+        unit.length > INT64_MAX - size)
+      return false;
+    if (unit.flag) {
+      if (unit.offset > baseSize || unit.length > baseSize - unit.offset)
+        return false;
+    } else {
+      if (unit.length > literal)
+        return false;
+      literal -= unit.length;
+    }
+    size += unit.length;
+  }
+  deltaStream.cursor = deltaStream.length - literal;
+  return true;
+}
+
+int64_t validate_delta(const uint8_t *deltaBuf, uint64_t deltaSize,
+                       uint64_t baseSize) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  uint64_t size = 0;
+
+  DeltaHeader header;
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_FRAMED)) {
+    deltaStream.cursor = CONTAINER_PREFIX_SIZE;
+    uint64_t window;
+    while (true) {
+      if (!read_varint_checked(deltaStream, window))
+        return GDELTA_ERR_CORRUPT;
+      if (window == 0)
+        break;
+      if (!validate_plain(deltaStream, baseSize, false, size))
+        return GDELTA_ERR_CORRUPT;
+    }
+  } else if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    int ret = read_header(deltaStream, header);
+    if (ret != GDELTA_OK)
+      return ret;
+    bool valid = (header.flags & GDELTA_FLAG_IN_PLACE)
+                     ? validate_placed(deltaStream, baseSize,
+                                       header.targetSize, size)
+                     : validate_plain(deltaStream, baseSize, false, size);
+    if (!valid || size != header.targetSize)
+      return GDELTA_ERR_CORRUPT;
+  } else if (!validate_plain(deltaStream, baseSize, true, size)) {
+    return GDELTA_ERR_CORRUPT;
+  }
+  if (deltaStream.cursor != deltaSize)
+    return GDELTA_ERR_CORRUPT;
+  return size;
+}
+
+// Appends the units of the plain delta at deltaStream.cursor, see
+// decode_plain; `inPlace` ones carry their target offsets and `dst` ends
+// up at the furthest one written
+static void scan_plain(ReadOnlyBufferStreamDescriptor &deltaStream,
+                       bool inPlace, BufferStreamDescriptor &units,
+                       uint64_t &dst) {
+  const uint64_t instructionLength = read_varint(deltaStream);
+  const uint64_t instOffset = deltaStream.cursor;
+  uint64_t literal = instOffset + instructionLength;
+  uint64_t end = dst;
+  DeltaUnitMem unit = {};
+
+  while (deltaStream.cursor < instructionLength + instOffset) {
+    if (inPlace)
+      dst = read_varint(deltaStream);
+    read_unit(deltaStream, unit);
+    PlacedUnit placed = {dst, unit.flag ? unit.offset : literal, unit.length, unit.flag};
+    if (!unit.flag)
+      literal += unit.length;
+    dst += unit.length;
+    if (dst > end)
+      end = dst;
+    if (unit.length)
+      write_field(units, placed);
+  }
+  dst = end;
+  deltaStream.cursor = literal;
+}
+
+uint64_t scan_units(const uint8_t *deltaBuf, uint64_t deltaSize,
+                    BufferStreamDescriptor &units) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  uint64_t dst = 0;
+  units.cursor = 0;
+
+  DeltaHeader header;
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_FRAMED)) {
+    deltaStream.cursor = CONTAINER_PREFIX_SIZE;
+    while (read_varint(deltaStream) != 0)
+      scan_plain(deltaStream, false, units, dst);
+  } else if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    if (read_header(deltaStream, header) == GDELTA_OK)
+      scan_plain(deltaStream, header.flags & GDELTA_FLAG_IN_PLACE, units, dst);
+  } else {
+    scan_plain(deltaStream, false, units, dst);
+  }
+  return dst;
+}
+
+// Adds the units of the plain delta at deltaStream.cursor to the unit
+// counters, skipping past it
+static void tally_plain(ReadOnlyBufferStreamDescriptor &deltaStream,
+                        bool inPlace, gdelta_stats &stats) {
+  const uint64_t instructionLength = read_varint(deltaStream);
+  uint64_t literal = stats.literal_bytes;
+  tally_units(deltaStream.buf + deltaStream.cursor, instructionLength, inPlace,
+              stats);
+  deltaStream.cursor += instructionLength + stats.literal_bytes - literal;
+}
+
+// Unit counters of a plain, framed or (non-entropy) header delta
+static void tally_delta(const uint8_t *deltaBuf, uint64_t deltaSize,
+                        gdelta_stats &stats) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+
+  DeltaHeader header;
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_FRAMED)) {
+    deltaStream.cursor = CONTAINER_PREFIX_SIZE;
+    while (read_varint(deltaStream) != 0)
+      tally_plain(deltaStream, false, stats);
+  } else if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    if (read_header(deltaStream, header) == GDELTA_OK)
+      tally_plain(deltaStream, header.flags & GDELTA_FLAG_IN_PLACE, stats);
+  } else {
+    tally_plain(deltaStream, false, stats);
+  }
+}
+
+int64_t gdecode_size(const uint8_t *deltaBuf, uint64_t deltaSize) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  DeltaHeader header;
+
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    int ret = read_header(deltaStream, header);
+    if (ret != GDELTA_OK)
+      return ret;
+    if (header.targetSize > INT64_MAX)
+      return GDELTA_ERR_CORRUPT;
+    return header.targetSize;
+  }
+
+  // Walked with the checks of the decoders, copies may address any base
+  return validate_delta(deltaBuf, deltaSize, UINT64_MAX);
+}
+
+int expand_entropy(const uint8_t *deltaBuf, uint64_t deltaSize,
+                   BufferStreamDescriptor &plain) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  DeltaHeader header;
+  int ret = read_header(deltaStream, header);
+  if (ret != GDELTA_OK)
+    return ret;
+
+  // Same header without the flag
+  ReadOnlyBufferStreamDescriptor headerStream = {deltaBuf, 0, deltaStream.cursor};
+  plain.cursor = 0;
+  stream_into(plain, headerStream, deltaStream.cursor);
+  if (plain.failed)
+    return GDELTA_ERR_MEMORY;
+  plain.buf[CONTAINER_PREFIX_SIZE + 1] &= ~GDELTA_FLAG_ENTROPY;
+
+  // The instruction length of the plain delta is the raw size of the first
+  // block, which comes first in it
+  ReadOnlyBufferStreamDescriptor peek = deltaStream;
+  uint64_t instructionLength;
+  if (!read_varint_checked(peek, instructionLength))
+    return GDELTA_ERR_CORRUPT;
+  write_varint(plain, instructionLength);
+  if (!huffman_read_block(deltaStream, plain) ||
+      !huffman_read_block(deltaStream, plain))
+    return plain.failed ? (int)GDELTA_ERR_MEMORY : (int)GDELTA_ERR_CORRUPT;
+  return GDELTA_OK;
+}
+
+int use_expanded(const uint8_t *&deltaBuf, uint64_t &deltaSize,
+                 ReadOnlyBufferStreamDescriptor &deltaStream,
+                 DeltaHeader &header, BufferStreamDescriptor &plain) {
+  int ret = expand_entropy(deltaBuf, deltaSize, plain);
+  if (ret != GDELTA_OK)
+    return ret;
+  deltaBuf = plain.buf;
+  deltaSize = plain.cursor;
+  deltaStream = {deltaBuf, 0, deltaSize};
+  return read_header(deltaStream, header);
+}
+
+/*
+ * Applies an in-place delta (deltaStream past its header) from a separate
+ * base. The output is cleared first, as nothing checks that the units cover
+ * every target byte.
+ */
+static int64_t decode_placed(const uint8_t *deltaBuf, uint64_t deltaSize,
+                             ReadOnlyBufferStreamDescriptor &deltaStream,
+                             const uint8_t *baseBuf, const DeltaHeader &header,
+                             BufferStreamDescriptor &outStream) {
+  int64_t size = validate_delta(deltaBuf, deltaSize, header.baseSize);
+  if (size < 0)
+    return size;
+  if (!ensure_stream_length(outStream, size))
+    return GDELTA_ERR_MEMORY;
+  if (size)
+    memset(outStream.buf, 0, size);
+  apply_placed(deltaStream, baseBuf, outStream.buf);
+  outStream.cursor = size;
+  if ((header.flags & GDELTA_FLAG_CHECKSUM) &&
+      checksum(outStream.buf, size) != header.targetChecksum)
+    return GDELTA_ERR_CHECKSUM;
+  return size;
+}
+
+/*
+ * Shared decoder body, reconstructs into `outStream` from its start without
+ * growing it past `capacity`. The delta is validated first, so the output is
+ * sized once and a corrupt delta fails before any work is done. Entropy-coded
+ * deltas are expanded into `scratch` and decoded from there.
+ */
+static int64_t gdecode_impl(const uint8_t *deltaBuf, uint64_t deltaSize,
+                            const uint8_t *baseBuf, uint64_t baseSize,
+                            BufferStreamDescriptor &outStream,
+                            uint64_t capacity,
+                            BufferStreamDescriptor &scratch) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize}; // Instructions
+  ReadOnlyBufferStreamDescriptor baseStream = {baseBuf, 0, baseSize}; // Data in
+  outStream.cursor = 0; // Data out
+
+  DeltaHeader header;
+  bool headered = is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER);
+  if (headered) {
+    int ret = read_header(deltaStream, header);
+    if (ret != GDELTA_OK)
+      return ret;
+    if (header.baseSize != baseSize)
+      return GDELTA_ERR_BASE_MISMATCH;
+    if (header.targetSize > capacity)
+      return GDELTA_ERR_BUFFER;
+    if (header.flags & GDELTA_FLAG_ENTROPY) {
+      ret = use_expanded(deltaBuf, deltaSize, deltaStream, header, scratch);
+      if (ret != GDELTA_OK)
+        return ret;
+    }
+    // A wrong base of the right size is caught before decoding
+    if ((header.flags & GDELTA_FLAG_CHECKSUM) &&
+        checksum(baseBuf, baseSize) != header.baseChecksum)
+      return GDELTA_ERR_BASE_MISMATCH;
+  }
+  if (headered && (header.flags & GDELTA_FLAG_IN_PLACE))
+    return decode_placed(deltaBuf, deltaSize, deltaStream, baseBuf, header,
+                         outStream);
+
+  return decode_checked(deltaBuf, deltaSize, baseStream, baseSize,
+                        headered ? &header : nullptr, outStream, capacity);
+}
+
+// Decodes with a throwaway output stream seeded from the caller's buffer
+static int64_t gdecode_malloced(const uint8_t *deltaBuf, uint64_t deltaSize,
+                                const uint8_t *baseBuf, uint64_t baseSize,
+                                uint8_t **outBuf, uint64_t *outSize,
+                                BufferStreamDescriptor &scratch) {
+  BufferStreamDescriptor outStream = {*outBuf, 0, *outSize};
+  if (outStream.buf == nullptr)
+    outStream.length = 0;
+
+  int64_t ret = gdecode_impl(deltaBuf, deltaSize, baseBuf, baseSize, outStream,
+                             UINT64_MAX, scratch);
+  *outSize = outStream.cursor;
+  *outBuf = outStream.buf;
+  return ret;
+}
+
+// The same with a scratch stream of its own
+static int64_t gdecode_oneshot(const uint8_t *deltaBuf, uint64_t deltaSize,
+                               const uint8_t *baseBuf, uint64_t baseSize,
+                               uint8_t **outBuf, uint64_t *outSize) {
+  BufferStreamDescriptor plain = {};
+  int64_t ret = gdecode_malloced(deltaBuf, deltaSize, baseBuf, baseSize,
+                                 outBuf, outSize, plain);
+  free(plain.buf);
+  return ret;
+}
+
+int64_t gdecode_with_scratch(gdelta_ctx *ctx, const uint8_t *deltaBuf,
+                             uint64_t deltaSize, const uint8_t *baseBuf,
+                             uint64_t baseSize, uint8_t **outBuf,
+                             uint64_t *outSize) {
+  gdelta_ctx_reset(ctx);
+  return gdecode_malloced(deltaBuf, deltaSize, baseBuf, baseSize, outBuf,
+                          outSize, ctx->data);
+}
+
+int gdecode(const uint8_t *deltaBuf, uint32_t deltaSize, const uint8_t *baseBuf, uint32_t baseSize,
+            uint8_t **outBuf, uint32_t *outSize) {
+  uint64_t size = *outSize;
+  int64_t ret = gdecode_oneshot(deltaBuf, deltaSize, baseBuf, baseSize, outBuf,
+                                &size);
+  *outSize = size;
+  return ret;
+}
+
+int64_t gdecode64(const uint8_t *deltaBuf, uint64_t deltaSize,
+                  const uint8_t *baseBuf, uint64_t baseSize,
+                  uint8_t **outBuf, uint64_t *outSize) {
+  return gdecode_oneshot(deltaBuf, deltaSize, baseBuf, baseSize, outBuf,
+                         outSize);
+}
+
+// gdecode_multi() for several bases, entropy-coded deltas are expanded into
+// `plain`
+static int64_t decode_multi(const uint8_t *deltaBuf, uint64_t deltaSize,
+                            const uint8_t *const *baseBufs,
+                            const uint64_t *baseSizes, size_t baseCount,
+                            uint8_t **outBuf, uint64_t *outSize,
+                            BufferStreamDescriptor &plain) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  DeltaHeader header;
+  int ret = read_header(deltaStream, header);
+  if (ret != GDELTA_OK)
+    return ret;
+  if (!(header.flags & GDELTA_FLAG_MULTI_BASE) || header.baseCount != baseCount)
+    return GDELTA_ERR_BASE_MISMATCH;
+  if (header.flags & GDELTA_FLAG_IN_PLACE)
+    return GDELTA_ERR_UNSUPPORTED;
+  if (header.flags & GDELTA_FLAG_ENTROPY) {
+    ret = use_expanded(deltaBuf, deltaSize, deltaStream, header, plain);
+    if (ret != GDELTA_OK)
+      return ret;
+  }
+
+  // Every base must have the size it had when encoding
+  uint64_t *starts = (uint64_t *)malloc((baseCount + 1) * sizeof(uint64_t));
+  if (starts == nullptr)
+    return GDELTA_ERR_MEMORY;
+  ReadOnlyBufferStreamDescriptor list = {deltaBuf, header.baseList, deltaSize};
+  starts[0] = 0;
+  for (size_t i = 0; i < baseCount; i++) {
+    uint64_t size;
+    read_varint_checked(list, size);
+    if (size != baseSizes[i]) {
+      free(starts);
+      return GDELTA_ERR_BASE_MISMATCH;
+    }
+    starts[i + 1] = starts[i] + size;
+  }
+
+  // The checksum covers the bases as concatenated
+  if (header.flags & GDELTA_FLAG_CHECKSUM) {
+    ChecksumState sum;
+    checksum_init(sum);
+    for (size_t i = 0; i < baseCount; i++)
+      checksum_update(sum, baseBufs[i], baseSizes[i]);
+    if (checksum_final(sum) != header.baseChecksum) {
+      free(starts);
+      return GDELTA_ERR_BASE_MISMATCH;
+    }
+  }
+
+  BufferStreamDescriptor outStream = {*outBuf, 0, *outSize};
+  if (outStream.buf == nullptr)
+    outStream.length = 0;
+  int64_t size = decode_checked(deltaBuf, deltaSize,
+                                MultiBase{baseBufs, starts, baseCount},
+                                header.baseSize, &header, outStream,
+                                UINT64_MAX);
+  *outBuf = outStream.buf;
+  *outSize = outStream.cursor;
+  free(starts);
+  return size;
+}
+
+int64_t gdecode_multi(const uint8_t *deltaBuf, uint64_t deltaSize,
+                      const uint8_t *const *baseBufs,
+                      const uint64_t *baseSizes, size_t baseCount,
+                      uint8_t **outBuf, uint64_t *outSize) {
+  if (baseCount == 1)
+    return gdecode64(deltaBuf, deltaSize, baseBufs[0], baseSizes[0], outBuf,
+                     outSize);
+
+  BufferStreamDescriptor plain = {};
+  int64_t size = decode_multi(deltaBuf, deltaSize, baseBufs, baseSizes,
+                              baseCount, outBuf, outSize, plain);
+  free(plain.buf);
+  return size;
+}
+
+int64_t gdecode_into(const uint8_t *deltaBuf, uint64_t deltaSize,
+                     const uint8_t *baseBuf, uint64_t baseSize,
+                     uint8_t *outBuf, uint64_t capacity) {
+  // Never grows: deltas for more than `capacity` bytes are rejected up front
+  BufferStreamDescriptor outStream = {outBuf, 0, capacity};
+  BufferStreamDescriptor plain = {};
+  int64_t ret = gdecode_impl(deltaBuf, deltaSize, baseBuf, baseSize, outStream,
+                             capacity, plain);
+  free(plain.buf);
+  return ret;
+}
+
+int64_t gdecode_ctx(gdelta_ctx *ctx, const uint8_t *deltaBuf,
+                    uint64_t deltaSize, const uint8_t *baseBuf,
+                    uint64_t baseSize, const uint8_t **outBuf,
+                    uint64_t *outSize) {
+  gdelta_ctx_reset(ctx);
+  uint64_t tStart = stats_clock(ctx);
+  // Entropy-coded deltas are expanded into the data stream, which keeps its
+  // size between calls
+  int64_t ret = gdecode_impl(deltaBuf, deltaSize, baseBuf, baseSize, ctx->out,
+                             UINT64_MAX, ctx->data);
+  *outBuf = ctx->out.buf;
+  *outSize = ctx->out.cursor;
+
+  // Counted after the fact so the decode loop itself stays untouched; an
+  // expanded delta is counted from its expansion
+  if (ctx->collectStats && ret >= 0) {
+    ctx->stats.decode_ns = stats_clock(ctx) - tStart;
+    ctx->stats.reallocs = ctx->out.grows + ctx->data.grows;
+    if (ctx->data.cursor)
+      tally_delta(ctx->data.buf, ctx->data.cursor, ctx->stats);
+    else
+      tally_delta(deltaBuf, deltaSize, ctx->stats);
+  }
+  return ret;
+}
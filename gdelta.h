@@ -1,11 +1,286 @@
-#ifndef GDELTA_GDELTA_H
-#define GDELTA_GDELTA_H
-#include <stdint.h>
-
-int gencode(const uint8_t *newBuf, uint32_t newSize, const uint8_t *baseBuf,
-            uint32_t baseSize, uint8_t **deltaBuf, uint32_t *deltaSize);
-
-int gdecode(const uint8_t *deltaBuf, uint32_t deltaSize, const uint8_t *baseBuf,
-            uint32_t baseSize, uint8_t **outBuf, uint32_t *outSize);
-
-#endif // GDELTA_GDELTA_H
+#ifndef GDELTA_GDELTA_H
+#define GDELTA_GDELTA_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Status codes, errors are negative
+enum {
+  GDELTA_OK = 0,
+  GDELTA_STREAM_END = 1,
+  GDELTA_ERR_MEMORY = -1,
+  GDELTA_ERR_CORRUPT = -2,
+  GDELTA_ERR_PARAM = -3,
+  GDELTA_ERR_BASE_MISMATCH = -4, // delta was made against another base
+  GDELTA_ERR_BUFFER = -5,        // output buffer too small
+  GDELTA_ERR_UNSUPPORTED = -6,   // delta needs a newer version of the library
+  GDELTA_ERR_CHECKSUM = -7,      // decoded target differs from the original
+};
+
+// Encoders write deltas behind a versioned header ('G', 0, 'D', 'H', then
+// version, flags, target and base size). Decoders from before the header
+// was introduced cannot read these deltas, they misparse the header as
+// instructions; plain deltas from those versions still decode here.
+int gencode(const uint8_t *newBuf, uint32_t newSize, const uint8_t *baseBuf,
+            uint32_t baseSize, uint8_t **deltaBuf, uint32_t *deltaSize);
+
+int gdecode(const uint8_t *deltaBuf, uint32_t deltaSize, const uint8_t *baseBuf,
+            uint32_t baseSize, uint8_t **outBuf, uint32_t *outSize);
+
+// 64-bit variants for buffers beyond 4GiB, return the output size
+int64_t gencode64(const uint8_t *newBuf, uint64_t newSize,
+                  const uint8_t *baseBuf, uint64_t baseSize,
+                  uint8_t **deltaBuf, uint64_t *deltaSize);
+
+int64_t gdecode64(const uint8_t *deltaBuf, uint64_t deltaSize,
+                  const uint8_t *baseBuf, uint64_t baseSize,
+                  uint8_t **outBuf, uint64_t *outSize);
+
+// Size of the target a delta reconstructs, read from its header (deltas
+// without one, i.e. framed or from older versions, are walked and checked
+// instead); GDELTA_ERR_CORRUPT for malformed input
+int64_t gdecode_size(const uint8_t *deltaBuf, uint64_t deltaSize);
+
+// Decodes into a caller-owned buffer of `capacity` bytes without allocating;
+// returns the target size or GDELTA_ERR_BUFFER if it does not fit
+int64_t gdecode_into(const uint8_t *deltaBuf, uint64_t deltaSize,
+                     const uint8_t *baseBuf, uint64_t baseSize,
+                     uint8_t *outBuf, uint64_t capacity);
+
+// Merges a delta from A to B (`first`) and one from B to C (`second`) into a
+// delta from A to C, in time proportional to the deltas and without B. The
+// result has a header, checksums and entropy coding where the inputs allow:
+// a header needs one on `first`, checksums need them on both. In-place
+// deltas are rejected with GDELTA_ERR_UNSUPPORTED, a `second` made against
+// another B with GDELTA_ERR_BASE_MISMATCH. Output works like gencode64().
+int64_t gdelta_compose(const uint8_t *firstBuf, uint64_t firstSize,
+                       const uint8_t *secondBuf, uint64_t secondSize,
+                       uint8_t **deltaBuf, uint64_t *deltaSize);
+
+// Decodes `length` bytes of the target from `offset` into `outBuf`, walking
+// only the units from the nearest index entry (GDELTA_PARAM_INDEX_INTERVAL)
+// up to the end of the range, or from the start for deltas without an index.
+// Returns the number of bytes written, short only at the end of the target.
+// Units are checked as they are walked; checksums are not verified, and
+// entropy-coded deltas are expanded in full first.
+int64_t gdecode_range(const uint8_t *deltaBuf, uint64_t deltaSize,
+                      const uint8_t *baseBuf, uint64_t baseSize,
+                      uint64_t offset, uint64_t length, uint8_t *outBuf);
+
+// Rebuilds the target of a delta written with GDELTA_PARAM_IN_PLACE inside
+// `buf`, which holds the base and has room for `capacity` bytes, at least the
+// larger of base and target. Returns the target size; other deltas fail with
+// GDELTA_ERR_PARAM. Corrupt deltas are rejected before `buf` is modified, a
+// target checksum mismatch (GDELTA_ERR_CHECKSUM) only shows afterwards.
+int64_t gdecode_in_place(const uint8_t *deltaBuf, uint64_t deltaSize,
+                         uint8_t *buf, uint64_t baseSize, uint64_t capacity);
+
+// Gear index over a base buffer, reusable across encodes; the base buffer
+// must outlive it. Immutable once prepared, so it can be shared by threads.
+typedef struct gdelta_base gdelta_base;
+
+gdelta_base *gdelta_base_prepare(const uint8_t *baseBuf, uint64_t baseSize);
+
+// Index built for a compression level (see GDELTA_PARAM_LEVEL); higher
+// levels keep several positions per bucket and take longer to build.
+// Returns null for an invalid level.
+gdelta_base *gdelta_base_prepare_level(const uint8_t *baseBuf,
+                                       uint64_t baseSize, int level);
+
+void gdelta_base_free(gdelta_base *base);
+
+int64_t gencode_with_base(const uint8_t *newBuf, uint64_t newSize,
+                          const gdelta_base *base, uint8_t **deltaBuf,
+                          uint64_t *deltaSize);
+
+// Encodes against several bases at once, indexed together so copies can
+// come from any of them. The delta records the base sizes; decode it with
+// gdecode_multi() and the same bases in the same order, or with the other
+// decoders and the bases concatenated into one buffer.
+int64_t gencode_multi(const uint8_t *newBuf, uint64_t newSize,
+                      const uint8_t *const *baseBufs,
+                      const uint64_t *baseSizes, size_t baseCount,
+                      uint8_t **deltaBuf, uint64_t *deltaSize);
+
+int64_t gdecode_multi(const uint8_t *deltaBuf, uint64_t deltaSize,
+                      const uint8_t *const *baseBufs,
+                      const uint64_t *baseSizes, size_t baseCount,
+                      uint8_t **outBuf, uint64_t *outSize);
+
+// Custom memory routines; realloc_fn may be null for allocators that cannot
+// resize in place, buffers are then moved with alloc_fn/memcpy/free_fn.
+typedef struct {
+  void *(*alloc_fn)(void *opaque, size_t size);
+  void *(*realloc_fn)(void *opaque, void *ptr, size_t size);
+  void (*free_fn)(void *opaque, void *ptr);
+  void *opaque;
+} gdelta_allocator;
+
+// Reusable scratch space for encoding/decoding. Buffers are kept between
+// calls, so steady-state use performs no heap allocations. Output returned by
+// the *_ctx functions is owned by the context and stays valid until its next
+// call, gdelta_ctx_reset() or gdelta_ctx_free(). A context is not thread-safe.
+typedef struct gdelta_ctx gdelta_ctx;
+
+gdelta_ctx *gdelta_ctx_new();
+
+// Context whose own memory and buffers all come from `alloc` (copied)
+gdelta_ctx *gdelta_ctx_new_with_allocator(const gdelta_allocator *alloc);
+
+void gdelta_ctx_reset(gdelta_ctx *ctx);
+
+void gdelta_ctx_free(gdelta_ctx *ctx);
+
+// Encoder parameters, kept across gdelta_ctx_reset()
+enum {
+  // Speed/ratio trade-off for unmatched regions: 0 probes every position,
+  // higher values skip ahead faster through runs of misses, at some cost in
+  // delta size (default 0)
+  GDELTA_PARAM_ACCELERATION = 1,
+  // GDELTA_MIN_LEVEL (fast, default) to GDELTA_MAX_LEVEL: higher levels
+  // search more candidates per position for smaller deltas. With a prepared
+  // base the candidates come from the level it was prepared for.
+  GDELTA_PARAM_LEVEL = 2,
+  // 1 entropy-codes the instruction and literal sections with the built-in
+  // Huffman stage (default 0). gdecode() and friends detect it; the
+  // push-based decoder rejects such deltas with GDELTA_ERR_UNSUPPORTED.
+  GDELTA_PARAM_ENTROPY = 3,
+  // 1 makes the *_ctx calls record gdelta_stats (default 0)
+  GDELTA_PARAM_STATS = 4,
+  // 1 stores checksums of base and target in the header (default 0).
+  // Decoders then reject a wrong base with GDELTA_ERR_BASE_MISMATCH before
+  // decoding and a corrupted result with GDELTA_ERR_CHECKSUM.
+  GDELTA_PARAM_CHECKSUM = 5,
+  // 1 writes deltas that gdecode_in_place() can apply inside the base buffer
+  // (default 0). Copies that would read overwritten bytes become literals.
+  // The other decoders but the push-based one accept them too.
+  GDELTA_PARAM_IN_PLACE = 6,
+  // Target bytes between the entries of an index that gdecode_range() uses
+  // to start near the requested bytes, 0 for none (default). Each entry
+  // costs 24 bytes of delta; in-place deltas are never indexed.
+  GDELTA_PARAM_INDEX_INTERVAL = 7,
+};
+#define GDELTA_MAX_ACCELERATION 65536
+#define GDELTA_MIN_LEVEL 1
+#define GDELTA_MAX_LEVEL 4
+#define GDELTA_DEFAULT_LEVEL GDELTA_MIN_LEVEL
+
+// Returns GDELTA_OK, or GDELTA_ERR_PARAM for unknown params/invalid values
+int gdelta_ctx_set_param(gdelta_ctx *ctx, int param, int64_t value);
+
+int64_t gencode_ctx(gdelta_ctx *ctx, const uint8_t *newBuf, uint64_t newSize,
+                    const uint8_t *baseBuf, uint64_t baseSize,
+                    const uint8_t **deltaBuf, uint64_t *deltaSize);
+
+int64_t gencode_ctx_with_base(gdelta_ctx *ctx, const uint8_t *newBuf,
+                              uint64_t newSize, const gdelta_base *base,
+                              const uint8_t **deltaBuf, uint64_t *deltaSize);
+
+int64_t gdecode_ctx(gdelta_ctx *ctx, const uint8_t *deltaBuf,
+                    uint64_t deltaSize, const uint8_t *baseBuf,
+                    uint64_t baseSize, const uint8_t **outBuf,
+                    uint64_t *outSize);
+
+// What the last gencode_ctx*()/gdecode_ctx() call did. Encodes fill the
+// phase timings, index and probe counters; decodes fill decode_ns. Both
+// count the units of the delta and the buffer reallocations of the call.
+typedef struct gdelta_stats {
+  uint64_t prefix_suffix_ns; // common head/tail detection
+  uint64_t index_ns;         // GFixSizeChunking over the base
+  uint64_t lookup_ns;        // scan of the target
+  uint64_t output_ns;        // sections, index and in-place ordering
+  uint64_t decode_ns;
+  uint64_t probes;           // hash table lookups
+  uint64_t hits;             // lookups that became a copy
+  uint64_t false_positives;  // candidates rejected by the byte compare
+  uint64_t index_slots;      // table entries
+  uint64_t index_used;       // entries holding a base position
+  uint64_t copy_units;
+  uint64_t copy_bytes;
+  uint64_t literal_units;
+  uint64_t literal_bytes;
+  uint64_t reallocs;
+} gdelta_stats;
+
+// Returns GDELTA_OK, or GDELTA_ERR_PARAM unless GDELTA_PARAM_STATS is set
+int gdelta_ctx_stats(const gdelta_ctx *ctx, gdelta_stats *stats);
+
+// Splits the target into segments encoded concurrently against the shared
+// prepared base, then stitches them into one delta. threads = 0 uses all
+// hardware threads; small targets are encoded on the calling thread.
+int64_t gencode_parallel(const uint8_t *newBuf, uint64_t newSize,
+                         const gdelta_base *base, uint8_t **deltaBuf,
+                         uint64_t *deltaSize, unsigned threads);
+
+// gencode_parallel() with the params of `ctx`, output as for gencode_ctx().
+// The segments are encoded with its level and acceleration. Stats cover the
+// stitched delta only: its units, output time and reallocations.
+int64_t gencode_ctx_parallel(gdelta_ctx *ctx, const uint8_t *newBuf,
+                             uint64_t newSize, const gdelta_base *base,
+                             const uint8_t **deltaBuf, uint64_t *deltaSize,
+                             unsigned threads);
+
+// Decodes with a pre-scan that places every unit in the output, then copies
+// disjoint output ranges on `threads` threads into a buffer sized once.
+int64_t gdecode_parallel(const uint8_t *deltaBuf, uint64_t deltaSize,
+                         const uint8_t *baseBuf, uint64_t baseSize,
+                         uint8_t **outBuf, uint64_t *outSize,
+                         unsigned threads);
+
+// One (target, base) pair of a batch. `in` holds the target when encoding
+// and the delta when decoding; `base`, if set, is a prepared index over
+// baseBuf. out/outSize behave like the output arguments of gencode64() and
+// gdecode64(): a null or too small buffer is (re)allocated with malloc and
+// belongs to the caller. `result` receives the output size or an error.
+typedef struct {
+  const uint8_t *in;
+  uint64_t inSize;
+  const uint8_t *baseBuf;
+  uint64_t baseSize;
+  const gdelta_base *base;
+  uint8_t *out;
+  uint64_t outSize;
+  int64_t result;
+} gdelta_batch_item;
+
+// Runs every item of the batch on `threads` threads (0 uses all hardware
+// threads), each reusing its own context. Returns GDELTA_OK, or the error of
+// the first failed item; the other items are still processed.
+int gencode_batch(gdelta_batch_item *items, size_t count, unsigned threads);
+
+int gdecode_batch(gdelta_batch_item *items, size_t count, unsigned threads);
+
+// Push-based decoder with bounded memory: feed delta bytes as they arrive and
+// receive the target in caller-sized chunks. Each call consumes input and
+// fills output as far as possible; returns GDELTA_OK when it needs more input
+// or output space, GDELTA_STREAM_END once the target is complete.
+typedef struct gdelta_decoder gdelta_decoder;
+
+gdelta_decoder *gdelta_decoder_new(const uint8_t *baseBuf, uint64_t baseSize);
+
+void gdelta_decoder_free(gdelta_decoder *dec);
+
+int gdelta_decoder_decode(gdelta_decoder *dec, const uint8_t *in,
+                          uint64_t inSize, uint64_t *inConsumed, uint8_t *out,
+                          uint64_t outSize, uint64_t *outProduced);
+
+// Windowed encoder for targets larger than memory. Target data is pushed in
+// any split; every full window is encoded against the prepared base and
+// emitted as a frame that gdecode() and the streaming decoder understand.
+// Output is owned by the encoder and valid until its next call.
+// A windowSize of 0 selects the default (8MiB).
+typedef struct gdelta_encoder gdelta_encoder;
+
+gdelta_encoder *gdelta_encoder_new(const gdelta_base *base,
+                                   uint64_t windowSize);
+
+void gdelta_encoder_free(gdelta_encoder *enc);
+
+int gdelta_encoder_encode(gdelta_encoder *enc, const uint8_t *in,
+                          uint64_t inSize, const uint8_t **out,
+                          uint64_t *outSize);
+
+// Encodes the last partial window and terminates the stream
+int gdelta_encoder_finish(gdelta_encoder *enc, const uint8_t **out,
+                          uint64_t *outSize);
+
+#endif // GDELTA_GDELTA_H
@@ -0,0 +1,484 @@
+//
+// Benchmark harness: encodes/decodes synthetic workloads and file pairs and
+// reports speed, ratio and memory as JSON.
+//
+
+#include "gdelta.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#ifdef _MSC_VER
+#include <compat/msvc.h>
+#include <compat/getopt.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#define DEFAULT_SIZES "64K,1M,16M"
+#define DEFAULT_WORKLOADS "edits,inserts,shifts,append,random"
+#define DEFAULT_REPS 5
+#define DEFAULT_SEED 1
+// Average distance between changes in the edit-style workloads
+#define EDIT_INTERVAL 4096
+
+typedef std::vector<uint8_t> Buffer;
+
+// splitmix64, so a seed gives the same data on every platform
+typedef struct {
+  uint64_t state;
+} Rng;
+
+static uint64_t next(Rng &rng) {
+  uint64_t z = (rng.state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t below(Rng &rng, uint64_t bound) {
+  return bound ? next(rng) % bound : 0;
+}
+
+// FNV-1a, mixes workload names into their seeds
+static uint64_t hash_name(const char *name) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (; *name; name++)
+    h = (h ^ (uint8_t)*name) * 0x100000001B3ull;
+  return h;
+}
+
+static Buffer random_bytes(Rng &rng, uint64_t size) {
+  Buffer buf(size);
+  for (uint64_t i = 0; i < size; i++)
+    buf[i] = next(rng);
+  return buf;
+}
+
+// Log-like lines of words and numbers, roughly as compressible as real text
+static void append_lines(Rng &rng, Buffer &buf, uint64_t size) {
+  static const char *words[] = {"INFO ", "WARN ", "request ", "id=", "user ",
+                                "took ", "ms ", "cache ", "miss ", "hit ",
+                                "GET /api/v1/", "object ", "version "};
+  const uint64_t nwords = sizeof(words) / sizeof(words[0]);
+  char number[24];
+  while (buf.size() < size) {
+    uint64_t count = 3 + below(rng, 8);
+    for (uint64_t w = 0; w < count; w++) {
+      const char *word = words[below(rng, nwords)];
+      buf.insert(buf.end(), word, word + strlen(word));
+      if (below(rng, 3) == 0) {
+        int n = snprintf(number, sizeof(number), "%u ", (unsigned)below(rng, 100000));
+        buf.insert(buf.end(), number, number + n);
+      }
+    }
+    buf.push_back('\n');
+  }
+  buf.resize(size);
+}
+
+static Buffer text(Rng &rng, uint64_t size) {
+  Buffer buf;
+  buf.reserve(size);
+  append_lines(rng, buf, size);
+  return buf;
+}
+
+// Overwrites short runs, one every EDIT_INTERVAL bytes on average
+static Buffer with_edits(Rng &rng, const Buffer &base) {
+  Buffer target = base;
+  for (uint64_t e = 0; e < base.size() / EDIT_INTERVAL + 1 && !target.empty(); e++) {
+    uint64_t pos = below(rng, target.size());
+    uint64_t end = std::min<uint64_t>(target.size(), pos + 1 + below(rng, 64));
+    for (; pos < end; pos++)
+      target[pos] = next(rng);
+  }
+  return target;
+}
+
+// Inserts and deletes short runs, shifting everything behind them
+static Buffer with_inserts(Rng &rng, const Buffer &base) {
+  Buffer target = base;
+  for (uint64_t e = 0; e < base.size() / EDIT_INTERVAL + 1; e++) {
+    uint64_t pos = below(rng, target.size() + 1);
+    uint64_t length = 1 + below(rng, 256);
+    if (below(rng, 2)) {
+      Buffer run = text(rng, length);
+      target.insert(target.begin() + pos, run.begin(), run.end());
+    } else {
+      target.erase(target.begin() + pos,
+                   target.begin() + std::min<uint64_t>(target.size(), pos + length));
+    }
+  }
+  return target;
+}
+
+// Moves blocks around: the base cut into 16 pieces reassembled in another
+// order behind a new prefix
+static Buffer with_shifts(Rng &rng, const Buffer &base) {
+  const uint64_t pieces = 16;
+  uint64_t piece = (base.size() + pieces - 1) / pieces;
+  std::vector<uint64_t> order(pieces);
+  for (uint64_t i = 0; i < pieces; i++)
+    order[i] = i;
+  for (uint64_t i = pieces - 1; i > 0; i--)
+    std::swap(order[i], order[below(rng, i + 1)]);
+
+  Buffer target = text(rng, 1 + below(rng, 1024));
+  for (uint64_t i : order) {
+    uint64_t begin = std::min<uint64_t>(base.size(), i * piece);
+    uint64_t end = std::min<uint64_t>(base.size(), begin + piece);
+    target.insert(target.end(), base.begin() + begin, base.begin() + end);
+  }
+  return target;
+}
+
+typedef struct {
+  const char *name;
+  std::string label; // file pairs: the file names
+  Buffer base;
+  Buffer target;
+} Workload;
+
+static bool make_workload(const char *name, uint64_t size, Rng &rng,
+                          Workload &w) {
+  w.name = name;
+  if (strcmp(name, "random") == 0) { // Incompressible, unrelated buffers
+    w.base = random_bytes(rng, size);
+    w.target = random_bytes(rng, size);
+    return true;
+  }
+  if (strcmp(name, "append") == 0) { // Append-only log growing by 1/8
+    w.base = text(rng, size);
+    w.target = w.base;
+    append_lines(rng, w.target, size + size / 8);
+    return true;
+  }
+  w.base = text(rng, size);
+  if (strcmp(name, "edits") == 0)
+    w.target = with_edits(rng, w.base);
+  else if (strcmp(name, "inserts") == 0)
+    w.target = with_inserts(rng, w.base);
+  else if (strcmp(name, "shifts") == 0)
+    w.target = with_shifts(rng, w.base);
+  else
+    return false;
+  return true;
+}
+
+static bool load_file(const char *path, Buffer &buf) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return false;
+  buf.clear();
+  uint8_t chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    buf.insert(buf.end(), chunk, chunk + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Sizes like 4096, 64K, 16M or 1G
+static bool parse_size(const char *s, uint64_t &size) {
+  char *end;
+  size = strtoull(s, &end, 10);
+  if (end == s)
+    return false;
+  switch (*end) {
+  case 'K': case 'k': size <<= 10; end++; break;
+  case 'M': case 'm': size <<= 20; end++; break;
+  case 'G': case 'g': size <<= 30; end++; break;
+  }
+  return *end == '\0';
+}
+
+static std::vector<std::string> split(const char *list) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char *p = list;; p++) {
+    if (*p == ',' || *p == '\0') {
+      if (!item.empty())
+        items.push_back(item);
+      item.clear();
+      if (*p == '\0')
+        break;
+    } else {
+      item += *p;
+    }
+  }
+  return items;
+}
+
+/*
+ * Allocator for the contexts that tracks the bytes they hold, so the peak
+ * covers all scratch and output memory of an encode or decode.
+ */
+typedef struct {
+  uint64_t current;
+  uint64_t peak;
+} MemoryCounter;
+
+static void *counted_alloc(void *opaque, size_t size) {
+  MemoryCounter *mem = (MemoryCounter *)opaque;
+  uint64_t *block = (uint64_t *)malloc(size + sizeof(uint64_t));
+  if (block == nullptr)
+    return nullptr;
+  block[0] = size;
+  mem->current += size;
+  mem->peak = std::max(mem->peak, mem->current);
+  return block + 1;
+}
+
+static void counted_free(void *opaque, void *ptr) {
+  if (ptr == nullptr)
+    return;
+  MemoryCounter *mem = (MemoryCounter *)opaque;
+  uint64_t *block = (uint64_t *)ptr - 1;
+  mem->current -= block[0];
+  free(block);
+}
+
+typedef struct {
+  int level;
+  int entropy;
+  int checksum;
+  int reps;
+} Settings;
+
+typedef struct {
+  uint64_t deltaSize;
+  double encodeNs; // median per call
+  double decodeNs;
+  uint64_t encodePeak; // bytes held by the context
+  uint64_t decodePeak;
+} Result;
+
+static double median(std::vector<double> &v) {
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2];
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+// Times encode and decode `reps` times each and checks the round trip
+static int run(const Workload &w, const Settings &settings, Result &result) {
+  MemoryCounter encodeMem = {0, 0}, decodeMem = {0, 0};
+  gdelta_allocator encodeAlloc = {counted_alloc, nullptr, counted_free, &encodeMem};
+  gdelta_allocator decodeAlloc = {counted_alloc, nullptr, counted_free, &decodeMem};
+  gdelta_ctx *enc = gdelta_ctx_new_with_allocator(&encodeAlloc);
+  gdelta_ctx *dec = gdelta_ctx_new_with_allocator(&decodeAlloc);
+  if (enc == nullptr || dec == nullptr ||
+      gdelta_ctx_set_param(enc, GDELTA_PARAM_LEVEL, settings.level) != GDELTA_OK ||
+      gdelta_ctx_set_param(enc, GDELTA_PARAM_ENTROPY, settings.entropy) != GDELTA_OK ||
+      gdelta_ctx_set_param(enc, GDELTA_PARAM_CHECKSUM, settings.checksum) != GDELTA_OK) {
+    gdelta_ctx_free(enc);
+    gdelta_ctx_free(dec);
+    return GDELTA_ERR_MEMORY;
+  }
+
+  std::vector<double> encodeNs, decodeNs;
+  const uint8_t *delta = nullptr, *out = nullptr;
+  uint64_t deltaSize = 0, outSize = 0;
+  int64_t ret = GDELTA_OK;
+  for (int r = 0; r < settings.reps && ret >= 0; r++) {
+    auto t0 = std::chrono::steady_clock::now();
+    ret = gencode_ctx(enc, w.target.data(), w.target.size(), w.base.data(),
+                      w.base.size(), &delta, &deltaSize);
+    encodeNs.push_back(elapsed_ns(t0));
+  }
+  for (int r = 0; r < settings.reps && ret >= 0; r++) {
+    auto t0 = std::chrono::steady_clock::now();
+    ret = gdecode_ctx(dec, delta, deltaSize, w.base.data(), w.base.size(),
+                      &out, &outSize);
+    decodeNs.push_back(elapsed_ns(t0));
+  }
+  if (ret >= 0 && (outSize != w.target.size() ||
+                   (outSize && memcmp(out, w.target.data(), outSize) != 0)))
+    ret = GDELTA_ERR_CORRUPT;
+
+  if (ret >= 0) {
+    result.deltaSize = deltaSize;
+    result.encodeNs = median(encodeNs);
+    result.decodeNs = median(decodeNs);
+    result.encodePeak = encodeMem.peak;
+    result.decodePeak = decodeMem.peak;
+  }
+  gdelta_ctx_free(enc);
+  gdelta_ctx_free(dec);
+  return ret < 0 ? (int)ret : GDELTA_OK;
+}
+
+static void print_result(FILE *out, const Workload &w, const Result &r,
+                         bool first) {
+  double mb = (double)w.target.size() / 1e6;
+  fprintf(out, "%s\n    {\"workload\": \"%s\", ", first ? "" : ",", w.name);
+  if (!w.label.empty()) {
+    fputs("\"files\": \"", out);
+    for (char ch : w.label) {
+      if (ch == '"' || ch == '\\')
+        fputc('\\', out);
+      if ((unsigned char)ch >= 0x20)
+        fputc(ch, out);
+    }
+    fputs("\", ", out);
+  }
+  fprintf(out,
+          "\"base_bytes\": %llu, \"target_bytes\": %llu, "
+          "\"delta_bytes\": %llu, \"ratio\": %.4f, "
+          "\"encode_mb_s\": %.2f, \"encode_ns_op\": %.0f, "
+          "\"decode_mb_s\": %.2f, \"decode_ns_op\": %.0f, "
+          "\"encode_peak_bytes\": %llu, \"decode_peak_bytes\": %llu}",
+          (unsigned long long)w.base.size(),
+          (unsigned long long)w.target.size(),
+          (unsigned long long)r.deltaSize,
+          r.deltaSize ? (double)w.target.size() / r.deltaSize : 0.0,
+          r.encodeNs > 0 ? mb / (r.encodeNs / 1e9) : 0.0, r.encodeNs,
+          r.decodeNs > 0 ? mb / (r.decodeNs / 1e9) : 0.0, r.decodeNs,
+          (unsigned long long)r.encodePeak,
+          (unsigned long long)r.decodePeak);
+}
+
+int main(int argc, char *argv[]) {
+  const char *sizes = DEFAULT_SIZES;
+  const char *workloads = DEFAULT_WORKLOADS;
+  const char *outPath = nullptr;
+  uint64_t seed = DEFAULT_SEED;
+  Settings settings = {GDELTA_DEFAULT_LEVEL, 0, 0, DEFAULT_REPS};
+  std::vector<std::string> filePairs;
+  int c;
+
+  while ((c = getopt(argc, argv, "w:s:r:S:l:zkf:o:")) != -1) {
+    switch (c) {
+    case 'w':
+      workloads = optarg;
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'r':
+      settings.reps = atoi(optarg);
+      break;
+    case 'S':
+      seed = strtoull(optarg, nullptr, 10);
+      break;
+    case 'l':
+      settings.level = atoi(optarg);
+      break;
+    case 'z':
+      settings.entropy = 1;
+      break;
+    case 'k':
+      settings.checksum = 1;
+      break;
+    case 'f':
+      filePairs.push_back(optarg);
+      break;
+    case 'o':
+      outPath = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: gdelta_bench [-w <workload,...>] [-s <size,...>] "
+              "[-r <reps>] [-S <seed>] [-l <level>] [-z] [-k]\n"
+              "                    [-f <basefile>:<targetfile>]... "
+              "[-o <output.json>]\n"
+              "Workloads: " DEFAULT_WORKLOADS " (default all), "
+              "sizes default to " DEFAULT_SIZES "\n");
+      return 1;
+    }
+  }
+  if (settings.reps < 1 || settings.level < GDELTA_MIN_LEVEL ||
+      settings.level > GDELTA_MAX_LEVEL) {
+    fprintf(stderr, "Invalid repetition count or level.\n");
+    return 1;
+  }
+
+  std::vector<uint64_t> sizeList;
+  for (const std::string &s : split(sizes)) {
+    uint64_t size;
+    if (!parse_size(s.c_str(), size)) {
+      fprintf(stderr, "Invalid size `%s'.\n", s.c_str());
+      return 1;
+    }
+    sizeList.push_back(size);
+  }
+
+  FILE *out = stdout;
+  if (outPath != nullptr && (out = fopen(outPath, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s\n", outPath);
+    return 1;
+  }
+  fprintf(out,
+          "{\n  \"seed\": %llu, \"level\": %d, \"entropy\": %d, "
+          "\"checksum\": %d, \"reps\": %d,\n  \"results\": [",
+          (unsigned long long)seed, settings.level, settings.entropy,
+          settings.checksum, settings.reps);
+
+  bool first = true;
+  int status = 0;
+  // Every workload and size gets its own stream, so its data does not depend
+  // on what else is run
+  std::vector<std::string> names = split(workloads);
+  for (uint64_t n = 0; n < names.size() && status == 0; n++) {
+    for (uint64_t s = 0; s < sizeList.size() && status == 0; s++) {
+      Rng rng = {seed};
+      rng.state ^= hash_name(names[n].c_str()) ^ next(rng) * sizeList[s];
+      Workload w;
+      Result r;
+      if (!make_workload(names[n].c_str(), sizeList[s], rng, w)) {
+        fprintf(stderr, "Unknown workload `%s'.\n", names[n].c_str());
+        status = 1;
+      } else if (int ret = run(w, settings, r)) {
+        fprintf(stderr, "%s/%llu failed (%d)\n", names[n].c_str(),
+                (unsigned long long)sizeList[s], ret);
+        status = 1;
+      } else {
+        print_result(out, w, r, first);
+        first = false;
+      }
+    }
+  }
+
+  for (uint64_t i = 0; i < filePairs.size() && status == 0; i++) {
+    const std::string &pair = filePairs[i];
+    size_t colon = pair.find(':');
+    Workload w;
+    Result r;
+    w.name = "files";
+    w.label = pair;
+    if (colon == std::string::npos ||
+        !load_file(pair.substr(0, colon).c_str(), w.base) ||
+        !load_file(pair.substr(colon + 1).c_str(), w.target)) {
+      fprintf(stderr, "Failed to read file pair `%s'\n", pair.c_str());
+      status = 1;
+    } else if (int ret = run(w, settings, r)) {
+      fprintf(stderr, "%s failed (%d)\n", pair.c_str(), ret);
+      status = 1;
+    } else {
+      print_result(out, w, r, first);
+      first = false;
+    }
+  }
+
+  long maxRss = 0;
+#ifndef _MSC_VER
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    maxRss = usage.ru_maxrss;
+#endif
+  fprintf(out, "\n  ],\n  \"max_rss_kb\": %ld\n}\n", maxRss);
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
@@ -0,0 +1,126 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+// XXH64 (seed 0), stripes of four 64-bit lanes
+#define CHECKSUM_STRIPE 32
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t lane) {
+  acc += lane * PRIME64_2;
+  return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t hash, uint64_t acc) {
+  hash ^= round64(0, acc);
+  return hash * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint32_t load_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+// Whole stripes of `buf`, returns how many bytes they cover
+static uint64_t consume_stripes(uint64_t *acc, const uint8_t *buf,
+                                uint64_t size) {
+  uint64_t v0 = acc[0], v1 = acc[1], v2 = acc[2], v3 = acc[3];
+  uint64_t pos = 0;
+  for (; pos + CHECKSUM_STRIPE <= size; pos += CHECKSUM_STRIPE) {
+    v0 = round64(v0, load_le64(buf + pos));
+    v1 = round64(v1, load_le64(buf + pos + 8));
+    v2 = round64(v2, load_le64(buf + pos + 16));
+    v3 = round64(v3, load_le64(buf + pos + 24));
+  }
+  acc[0] = v0;
+  acc[1] = v1;
+  acc[2] = v2;
+  acc[3] = v3;
+  return pos;
+}
+
+void checksum_init(ChecksumState &state) {
+  state.acc[0] = PRIME64_1 + PRIME64_2;
+  state.acc[1] = PRIME64_2;
+  state.acc[2] = 0;
+  state.acc[3] = -PRIME64_1;
+  state.pending = 0;
+  state.total = 0;
+}
+
+void checksum_update(ChecksumState &state, const uint8_t *buf,
+                     uint64_t size) {
+  if (size == 0)
+    return;
+  state.total += size;
+  if (state.pending) {
+    uint64_t n = CHECKSUM_STRIPE - state.pending;
+    if (n > size)
+      n = size;
+    memcpy(state.stripe + state.pending, buf, n);
+    state.pending += n;
+    buf += n;
+    size -= n;
+    if (state.pending < CHECKSUM_STRIPE)
+      return;
+    consume_stripes(state.acc, state.stripe, CHECKSUM_STRIPE);
+    state.pending = 0;
+  }
+  uint64_t done = consume_stripes(state.acc, buf, size);
+  memcpy(state.stripe, buf + done, size - done);
+  state.pending = size - done;
+}
+
+uint64_t checksum_final(const ChecksumState &state) {
+  uint64_t hash;
+  if (state.total >= CHECKSUM_STRIPE) {
+    const uint64_t *v = state.acc;
+    hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+           rotl64(v[3], 18);
+    for (int i = 0; i < 4; i++)
+      hash = merge64(hash, v[i]);
+  } else {
+    hash = PRIME64_5;
+  }
+  hash += state.total;
+
+  // Tail below one stripe: 8, then 4, then single bytes
+  const uint8_t *p = state.stripe;
+  uint32_t left = state.pending;
+  for (; left >= 8; p += 8, left -= 8)
+    hash = rotl64(hash ^ round64(0, load_le64(p)), 27) * PRIME64_1 + PRIME64_4;
+  if (left >= 4) {
+    hash = rotl64(hash ^ (uint64_t)load_le32(p) * PRIME64_1, 23) * PRIME64_2 +
+           PRIME64_3;
+    p += 4;
+    left -= 4;
+  }
+  for (; left > 0; p++, left--)
+    hash = rotl64(hash ^ *p * PRIME64_5, 11) * PRIME64_1;
+
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+uint64_t checksum(const uint8_t *buf, uint64_t size) {
+  ChecksumState state;
+  checksum_init(state);
+  checksum_update(state, buf, size);
+  return checksum_final(state);
+}
@@ -0,0 +1,204 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+/*
+ * Composition maps every copy of the second delta, a range of B, through the
+ * units of the first one that produced that range of B: pieces built by
+ * copies become copies from A, pieces built by literals take the literal
+ * bytes along. B itself is never rebuilt.
+ */
+
+// One delta to compose, validated, its entropy coding expanded and its
+// units listed in target order
+typedef struct {
+  const uint8_t *buf;
+  uint64_t size;
+  bool headered;
+  DeltaHeader header;
+  BufferStreamDescriptor expanded;
+  BufferStreamDescriptor units;
+  uint64_t targetSize;
+} ComposeInput;
+
+// `baseSize` is UINT64_MAX when unknown, the header's then applies
+static int open_input(ComposeInput &in, const uint8_t *deltaBuf,
+                      uint64_t deltaSize, uint64_t baseSize) {
+  in.buf = deltaBuf;
+  in.size = deltaSize;
+  in.headered = is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER);
+  if (in.headered) {
+    ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+    int ret = read_header(deltaStream, in.header);
+    if (ret != GDELTA_OK)
+      return ret;
+    // Placed units may come in any order and overlap
+    if (in.header.flags & GDELTA_FLAG_IN_PLACE)
+      return GDELTA_ERR_UNSUPPORTED;
+    if (baseSize == UINT64_MAX)
+      baseSize = in.header.baseSize;
+    if (in.header.baseSize != baseSize)
+      return GDELTA_ERR_BASE_MISMATCH;
+    if (in.header.flags & GDELTA_FLAG_ENTROPY) {
+      ret = expand_entropy(deltaBuf, deltaSize, in.expanded);
+      if (ret != GDELTA_OK)
+        return ret;
+      in.buf = in.expanded.buf;
+      in.size = in.expanded.cursor;
+    }
+  }
+
+  int64_t size = validate_delta(in.buf, in.size, baseSize);
+  if (size < 0)
+    return size;
+  in.targetSize = scan_units(in.buf, in.size, in.units);
+  return in.units.failed ? GDELTA_ERR_MEMORY : GDELTA_OK;
+}
+
+// Output sections, the last unit is held back so the next can extend it
+typedef struct {
+  BufferStreamDescriptor inst;
+  BufferStreamDescriptor data;
+  DeltaUnitMem pending; // none while its length is 0
+} Composer;
+
+static void flush_unit(Composer &c) {
+  if (c.pending.length)
+    write_unit(c.inst, c.pending);
+  c.pending.length = 0;
+}
+
+static void add_copy(Composer &c, uint64_t offset, uint64_t length) {
+  if (c.pending.length && c.pending.flag &&
+      c.pending.offset + c.pending.length == offset) {
+    c.pending.length += length;
+    return;
+  }
+  flush_unit(c);
+  c.pending = {1, length, offset};
+}
+
+static void add_literal(Composer &c, const uint8_t *src, uint64_t length) {
+  ReadOnlyBufferStreamDescriptor srcStream = {src, 0, length};
+  stream_from(c.data, srcStream, 0, length);
+  if (c.pending.length && !c.pending.flag) {
+    c.pending.length += length;
+    return;
+  }
+  flush_unit(c);
+  c.pending = {0, length, 0};
+}
+
+// Last of the units (in target order, covering it without gaps) that
+// starts at or before `pos`
+static uint64_t unit_at(const PlacedUnit *units, uint64_t count, uint64_t pos) {
+  uint64_t lo = 0, hi = count;
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (units[mid].dst <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void compose_units(const ComposeInput &first,
+                          const ComposeInput &second, Composer &c) {
+  const PlacedUnit *map = (const PlacedUnit *)first.units.buf;
+  const uint64_t mapCount = first.units.cursor / sizeof(PlacedUnit);
+  const PlacedUnit *units = (const PlacedUnit *)second.units.buf;
+  const uint64_t count = second.units.cursor / sizeof(PlacedUnit);
+
+  for (uint64_t k = 0; k < count; k++) {
+    const PlacedUnit &u = units[k];
+    if (!u.flag) {
+      add_literal(c, second.buf + u.src, u.length);
+      continue;
+    }
+    uint64_t pos = u.src, end = u.src + u.length;
+    for (uint64_t i = unit_at(map, mapCount, pos); pos < end; i++) {
+      const PlacedUnit &m = map[i];
+      uint64_t n = (m.dst + m.length < end ? m.dst + m.length : end) - pos;
+      if (m.flag)
+        add_copy(c, m.src + (pos - m.dst), n);
+      else
+        add_literal(c, first.buf + m.src + (pos - m.dst), n);
+      pos += n;
+    }
+  }
+  flush_unit(c);
+}
+
+int64_t gdelta_compose(const uint8_t *firstBuf, uint64_t firstSize,
+                       const uint8_t *secondBuf, uint64_t secondSize,
+                       uint8_t **deltaBuf, uint64_t *deltaSize) {
+  ComposeInput first = {}, second = {};
+  int64_t ret = open_input(first, firstBuf, firstSize, UINT64_MAX);
+  if (ret == GDELTA_OK)
+    ret = open_input(second, secondBuf, secondSize, first.targetSize);
+  // Both sides hash B, so a second delta against another B of the same size
+  // is caught when they both have checksums
+  bool checksums = first.headered && second.headered &&
+                   (first.header.flags & GDELTA_FLAG_CHECKSUM) &&
+                   (second.header.flags & GDELTA_FLAG_CHECKSUM);
+  if (ret == GDELTA_OK && checksums &&
+      first.header.targetChecksum != second.header.baseChecksum)
+    ret = GDELTA_ERR_BASE_MISMATCH;
+
+  if (ret == GDELTA_OK) {
+    Composer c = {};
+    compose_units(first, second, c);
+
+    BufferStreamDescriptor deltaStream = {*deltaBuf, 0, *deltaSize};
+    if (deltaStream.buf == nullptr)
+      deltaStream.length = 0;
+    // Only the first delta knows the size of A
+    bool entropy = false;
+    if (first.headered) {
+      entropy = (first.header.flags | second.header.flags) & GDELTA_FLAG_ENTROPY;
+      DeltaHeader fields = {GDELTA_VERSION,
+                            (uint8_t)(first.header.flags & GDELTA_FLAG_MULTI_BASE),
+                            second.targetSize,
+                            first.header.baseSize,
+                            first.header.baseCount,
+                            0,
+                            first.header.baseChecksum,
+                            second.header.targetChecksum,
+                            0,
+                            0};
+      if (entropy)
+        fields.flags |= GDELTA_FLAG_ENTROPY;
+      if (checksums)
+        fields.flags |= GDELTA_FLAG_CHECKSUM;
+      write_header(deltaStream, fields);
+      if (fields.flags & GDELTA_FLAG_MULTI_BASE) {
+        ReadOnlyBufferStreamDescriptor list = {first.buf, first.header.baseList,
+                                               first.size};
+        write_varint(deltaStream, fields.baseCount);
+        for (uint64_t i = 0; i < fields.baseCount; i++)
+          write_varint(deltaStream, read_varint(list));
+      }
+      if (checksums)
+        write_checksums(deltaStream, fields);
+    }
+    write_sections(deltaStream, c.inst, c.data, entropy);
+    free(c.inst.buf);
+    free(c.data.buf);
+
+    *deltaBuf = deltaStream.buf;
+    *deltaSize = deltaStream.cursor;
+    ret = deltaStream.cursor;
+    if (c.inst.failed || c.data.failed || deltaStream.failed)
+      ret = GDELTA_ERR_MEMORY;
+  }
+
+  free(first.expanded.buf);
+  free(first.units.buf);
+  free(second.expanded.buf);
+  free(second.units.buf);
+  return ret;
+}
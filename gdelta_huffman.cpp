@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+// Longest code, sets the size of the decoding table
+#define HUFFMAN_MAX_BITS 11
+#define HUFFMAN_SYMBOLS 256
+// Code lengths are stored as 4-bit nibbles
+#define HUFFMAN_TABLE_SIZE (HUFFMAN_SYMBOLS / 2)
+// Smaller blocks are always stored, the table alone would not pay off
+#define HUFFMAN_MIN_BLOCK (2 * HUFFMAN_TABLE_SIZE)
+// Larger ones too, so every stream size fits its 32-bit jump table entry
+#define HUFFMAN_MAX_BLOCK ((uint64_t)1 << 32)
+// Independent bit streams per block, decoded interleaved
+#define HUFFMAN_STREAMS 4
+// 32-bit sizes of all streams but the last
+#define HUFFMAN_JUMP_SIZE (4 * (HUFFMAN_STREAMS - 1))
+
+enum BlockMethod { BLOCK_STORED = 0, BLOCK_HUFFMAN = 1 };
+
+/*
+ * Huffman code lengths for the symbol counts, built with the two-queue
+ * method over the symbols sorted by count. Lengths beyond HUFFMAN_MAX_BITS
+ * are clamped and the code is made valid again by lengthening the rarest
+ * symbols still below the limit.
+ */
+static void build_lengths(const uint64_t *freq, uint8_t *lengths) {
+  uint16_t sym[HUFFMAN_SYMBOLS];
+  int n = 0;
+  memset(lengths, 0, HUFFMAN_SYMBOLS);
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s++)
+    if (freq[s])
+      sym[n++] = s;
+  if (n == 0)
+    return;
+  if (n == 1) {
+    lengths[sym[0]] = 1;
+    return;
+  }
+  std::sort(sym, sym + n, [&](uint16_t a, uint16_t b) {
+    return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+  });
+
+  // Leaves are nodes [0, n), merged nodes follow in ascending weight
+  uint64_t weight[2 * HUFFMAN_SYMBOLS];
+  uint16_t parent[2 * HUFFMAN_SYMBOLS];
+  uint8_t depth[2 * HUFFMAN_SYMBOLS];
+  for (int i = 0; i < n; i++)
+    weight[i] = freq[sym[i]];
+  int leaf = 0, merged = n;
+  for (int k = n; k < 2 * n - 1; k++) {
+    int pick[2];
+    for (int &p : pick)
+      p = leaf < n && (merged >= k || weight[leaf] <= weight[merged]) ? leaf++ : merged++;
+    weight[k] = weight[pick[0]] + weight[pick[1]];
+    parent[pick[0]] = parent[pick[1]] = k;
+  }
+  depth[2 * n - 2] = 0;
+  for (int k = 2 * n - 3; k >= 0; k--)
+    depth[k] = depth[parent[k]] + 1;
+
+  const uint64_t limit = (uint64_t)1 << HUFFMAN_MAX_BITS;
+  uint64_t kraft = 0;
+  for (int i = 0; i < n; i++) {
+    lengths[sym[i]] = depth[i] < HUFFMAN_MAX_BITS ? depth[i] : HUFFMAN_MAX_BITS;
+    kraft += limit >> lengths[sym[i]];
+  }
+  for (int i = 0; i < n && kraft > limit; i++) {
+    while (kraft > limit && lengths[sym[i]] < HUFFMAN_MAX_BITS) {
+      kraft -= limit >> (lengths[sym[i]] + 1);
+      lengths[sym[i]]++;
+    }
+  }
+}
+
+// Canonical codes for the lengths, bit-reversed for an LSB-first stream
+static void build_codes(const uint8_t *lengths, uint16_t *codes) {
+  uint16_t count[HUFFMAN_MAX_BITS + 1] = {};
+  uint16_t next[HUFFMAN_MAX_BITS + 1] = {};
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s++)
+    count[lengths[s]]++;
+  count[0] = 0;
+  for (int len = 1; len <= HUFFMAN_MAX_BITS; len++)
+    next[len] = (next[len - 1] + count[len - 1]) << 1;
+
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+    uint16_t code = next[lengths[s]]++, reversed = 0;
+    for (int b = 0; b < lengths[s]; b++)
+      reversed |= ((code >> b) & 1) << (lengths[s] - 1 - b);
+    codes[s] = reversed;
+  }
+}
+
+// Writes the codes of `size` symbols as an LSB-first bit stream at `p`, which
+// needs 8 bytes of slack; returns its size in bytes
+static uint64_t encode_stream(uint8_t *p, const uint8_t *src, uint64_t size,
+                              const uint16_t *codes, const uint8_t *lengths) {
+  const uint8_t *begin = p;
+  uint64_t acc = 0;
+  unsigned n = 0;
+  uint64_t i = 0;
+  // Four codes (44 bits) fit next to the up to 7 bits left over
+  for (; i + 4 <= size; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      acc |= (uint64_t)codes[src[i + k]] << n;
+      n += lengths[src[i + k]];
+    }
+    store_le64(p, acc);
+    p += n >> 3;
+    acc >>= n & ~7u;
+    n &= 7;
+  }
+  for (; i < size; i++) {
+    acc |= (uint64_t)codes[src[i]] << n;
+    n += lengths[src[i]];
+  }
+  store_le64(p, acc); // The tail holds at most 3 codes and 7 bits
+  return p - begin + (n + 7) / 8;
+}
+
+void huffman_write_block(BufferStreamDescriptor &out, const uint8_t *src,
+                         uint64_t size) {
+  write_varint(out, size);
+
+  // Counted per stream, which also sizes the streams up front
+  uint64_t freq[HUFFMAN_STREAMS][HUFFMAN_SYMBOLS] = {};
+  uint64_t total[HUFFMAN_SYMBOLS] = {};
+  uint8_t lengths[HUFFMAN_SYMBOLS];
+  uint64_t streamSize[HUFFMAN_STREAMS] = {};
+  uint64_t segment = (size + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+  uint64_t coded = HUFFMAN_JUMP_SIZE;
+  bool huffman = size >= HUFFMAN_MIN_BLOCK && size <= HUFFMAN_MAX_BLOCK;
+  if (huffman) {
+    for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+      uint64_t end = (k + 1) * segment < size ? (k + 1) * segment : size;
+      for (uint64_t i = k * segment; i < end; i++)
+        freq[k][src[i]]++;
+    }
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++)
+      for (int k = 0; k < HUFFMAN_STREAMS; k++)
+        total[s] += freq[k][s];
+    build_lengths(total, lengths);
+    for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+      uint64_t bits = 0;
+      for (int s = 0; s < HUFFMAN_SYMBOLS; s++)
+        bits += freq[k][s] * lengths[s];
+      streamSize[k] = (bits + 7) / 8;
+      coded += streamSize[k];
+    }
+    huffman = HUFFMAN_TABLE_SIZE + coded + 8 < size;
+  }
+  if (!huffman) {
+    uint8_t method = BLOCK_STORED;
+    write_field(out, method);
+    ReadOnlyBufferStreamDescriptor srcStream = {src, 0, size};
+    if (size)
+      stream_into(out, srcStream, size);
+    return;
+  }
+
+  uint8_t method = BLOCK_HUFFMAN;
+  write_field(out, method);
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s += 2) {
+    uint8_t pair = lengths[s] | lengths[s + 1] << 4;
+    write_field(out, pair);
+  }
+  write_varint(out, coded);
+  for (int k = 0; k + 1 < HUFFMAN_STREAMS; k++) {
+    uint32_t jump = streamSize[k];
+    for (int b = 0; b < 4; b++) {
+      uint8_t byte = jump >> (8 * b);
+      write_field(out, byte);
+    }
+  }
+
+  uint16_t codes[HUFFMAN_SYMBOLS];
+  build_codes(lengths, codes);
+  // Slack for the whole-word stores of the last stream
+  if (!ensure_stream_length(out, out.cursor + coded + sizeof(uint64_t)))
+    return;
+  for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+    uint64_t begin = k * segment < size ? k * segment : size;
+    uint64_t end = (k + 1) * segment < size ? (k + 1) * segment : size;
+    out.cursor += encode_stream(out.buf + out.cursor, src + begin, end - begin,
+                                codes, lengths);
+  }
+}
+
+// LSB-first reader over one bit stream; bits of `acc` above `n` are either
+// zero or the next bits of the stream
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t acc;
+  unsigned n;
+} BitReader;
+
+bool huffman_read_block(ReadOnlyBufferStreamDescriptor &in,
+                        BufferStreamDescriptor &out) {
+  uint64_t size;
+  if (!read_varint_checked(in, size) || in.cursor >= in.length)
+    return false;
+  uint8_t method;
+  read_field(in, method);
+  if (method == BLOCK_STORED) {
+    if (size > in.length - in.cursor)
+      return false;
+    if (size)
+      stream_into(out, in, size);
+    return true;
+  }
+  if (method != BLOCK_HUFFMAN || size > HUFFMAN_MAX_BLOCK ||
+      in.length - in.cursor < HUFFMAN_TABLE_SIZE)
+    return false;
+
+  uint8_t lengths[HUFFMAN_SYMBOLS];
+  uint64_t kraft = 0;
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s += 2) {
+    uint8_t pair;
+    read_field(in, pair);
+    lengths[s] = pair & 15;
+    lengths[s + 1] = pair >> 4;
+  }
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+    if (lengths[s] > HUFFMAN_MAX_BITS)
+      return false;
+    if (lengths[s])
+      kraft += ((uint64_t)1 << HUFFMAN_MAX_BITS) >> lengths[s];
+  }
+  // Every symbol takes at least one bit
+  uint64_t coded;
+  if (kraft > ((uint64_t)1 << HUFFMAN_MAX_BITS) ||
+      !read_varint_checked(in, coded) || coded > in.length - in.cursor ||
+      coded < HUFFMAN_JUMP_SIZE || size / 8 > coded)
+    return false;
+
+  // Every HUFFMAN_MAX_BITS-bit prefix maps to symbol << 4 | code length;
+  // zero entries belong to no code
+  uint16_t codes[HUFFMAN_SYMBOLS];
+  uint16_t table[1 << HUFFMAN_MAX_BITS] = {};
+  build_codes(lengths, codes);
+  for (int s = 0; s < HUFFMAN_SYMBOLS; s++)
+    if (lengths[s])
+      for (uint32_t j = codes[s]; j < (1u << HUFFMAN_MAX_BITS); j += 1u << lengths[s])
+        table[j] = s << 4 | lengths[s];
+
+  if (!ensure_stream_length(out, out.cursor + size))
+    return false;
+
+  // The streams decode consecutive quarters of the block
+  BitReader r[HUFFMAN_STREAMS];
+  uint8_t *dst[HUFFMAN_STREAMS], *dstEnd[HUFFMAN_STREAMS];
+  const uint8_t *p = in.buf + in.cursor, *end = p + coded;
+  const uint8_t *stream = p + HUFFMAN_JUMP_SIZE;
+  uint64_t segment = (size + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+  for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+    uint64_t length = end - stream;
+    if (k + 1 < HUFFMAN_STREAMS) {
+      uint64_t jump = 0;
+      for (int b = 0; b < 4; b++)
+        jump |= (uint64_t)p[4 * k + b] << (8 * b);
+      if (jump > length)
+        return false;
+      length = jump;
+    }
+    r[k] = {stream, stream + length, 0, 0};
+    stream += length;
+    uint64_t begin = k * segment < size ? k * segment : size;
+    uint64_t last = (k + 1) * segment < size ? (k + 1) * segment : size;
+    dst[k] = out.buf + out.cursor + begin;
+    dstEnd[k] = out.buf + out.cursor + last;
+  }
+
+  const uint64_t mask = (1u << HUFFMAN_MAX_BITS) - 1;
+  // Interleaved so the streams' table lookups overlap: refill each reader
+  // to at least 56 bits with one load, then take four codes from each
+  uint16_t bad = 0;
+  for (;;) {
+    bool room = true;
+    for (int k = 0; k < HUFFMAN_STREAMS; k++)
+      room &= r[k].end - r[k].p >= 8 && dstEnd[k] - dst[k] >= 4;
+    if (!room)
+      break;
+    for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+      r[k].acc |= load_le64(r[k].p) << r[k].n;
+      r[k].p += (63 - r[k].n) >> 3;
+      r[k].n |= 56;
+    }
+    for (int i = 0; i < 4; i++) {
+      for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+        uint16_t e = table[r[k].acc & mask];
+        bad |= (e & 15) == 0;
+        *dst[k]++ = e >> 4;
+        r[k].acc >>= e & 15;
+        r[k].n -= e & 15;
+      }
+    }
+  }
+  if (bad)
+    return false;
+  for (int k = 0; k < HUFFMAN_STREAMS; k++) {
+    BitReader &b = r[k];
+    while (dst[k] < dstEnd[k]) {
+      while (b.n <= 56 && b.p < b.end) {
+        b.acc |= (uint64_t)*b.p++ << b.n;
+        b.n += 8;
+      }
+      uint16_t e = table[b.acc & mask];
+      if ((e & 15) == 0 || (e & 15) > b.n)
+        return false;
+      *dst[k]++ = e >> 4;
+      b.acc >>= e & 15;
+      b.n -= e & 15;
+    }
+  }
+
+  in.cursor += coded;
+  out.cursor += size;
+  return true;
+}
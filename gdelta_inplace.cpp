@@ -0,0 +1,248 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+/*
+ * Rebuilding the target inside the base buffer breaks when a copy reads
+ * bytes that an earlier unit already overwrote. The encoder orders the
+ * copies so this never happens: copy u has to run before every copy v
+ * whose target range overlaps u's source range, and a reverse post-order of
+ * a depth-first search over these edges runs each copy before everything it
+ * points to, except along the edges that close a cycle. One end of each such
+ * edge, the shorter copy, becomes a literal instead. Literals never read the
+ * buffer, so they all go last.
+ */
+enum { UNVISITED, ACTIVE, ORDERED, AS_LITERAL };
+
+typedef struct {
+  uint64_t node;
+  uint64_t next; // next copy to check for an overlap
+} SearchFrame;
+
+// First of the copies (in target order) whose target range ends after `pos`
+static uint64_t first_write_after(const PlacedUnit *copies, uint64_t count,
+                                  uint64_t pos) {
+  uint64_t lo = 0, hi = count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (copies[mid].dst + copies[mid].length > pos)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+template <typename B>
+static void write_placed(B &instStream, uint64_t dst, const DeltaUnitMem &unit) {
+  write_varint(instStream, dst);
+  write_unit(instStream, unit);
+}
+
+int order_in_place(const uint8_t *inst, uint64_t instSize,
+                   const uint8_t *newBuf, BufferStreamDescriptor &instStream,
+                   BufferStreamDescriptor &dataStream,
+                   const gdelta_allocator *alloc) {
+  // The copies with their target offsets, which the plain delta leaves
+  // implicit; they come out in target order with disjoint target ranges
+  BufferStreamDescriptor copyList = {nullptr, 0, 0, alloc};
+  ReadOnlyBufferStreamDescriptor planStream = {inst, 0, instSize};
+  DeltaUnitMem unit = {};
+  uint64_t targetSize = 0;
+  while (planStream.cursor < instSize) {
+    read_unit(planStream, unit);
+    if (unit.flag && unit.length) {
+      PlacedUnit placed = {targetSize, unit.offset, unit.length, 1};
+      write_field(copyList, placed);
+    }
+    targetSize += unit.length;
+  }
+  const PlacedUnit *copies = (const PlacedUnit *)copyList.buf;
+  const uint64_t count = copyList.cursor / sizeof(PlacedUnit);
+
+  uint8_t *state = (uint8_t *)gdelta_malloc(alloc, count + 1);
+  SearchFrame *stack =
+      (SearchFrame *)gdelta_malloc(alloc, (count + 1) * sizeof(SearchFrame));
+  uint64_t *order = (uint64_t *)gdelta_malloc(alloc, (count + 1) * sizeof(uint64_t));
+  if (copyList.failed || state == nullptr || stack == nullptr ||
+      order == nullptr) {
+    gdelta_free(alloc, state);
+    gdelta_free(alloc, stack);
+    gdelta_free(alloc, order);
+    gdelta_free(alloc, copyList.buf);
+    return GDELTA_ERR_MEMORY;
+  }
+  memset(state, UNVISITED, count);
+
+  // Iterative search, the edges of a copy are the run of copies whose
+  // target ranges meet its source range
+  uint64_t ordered = 0;
+  for (uint64_t root = 0; root < count; root++) {
+    if (state[root] != UNVISITED)
+      continue;
+    uint64_t depth = 0;
+    stack[depth++] = {root, first_write_after(copies, count, copies[root].src)};
+    state[root] = ACTIVE;
+    while (depth > 0) {
+      SearchFrame &top = stack[depth - 1];
+      const PlacedUnit &u = copies[top.node];
+      // Converted while its descendants were searched
+      if (state[top.node] == AS_LITERAL) {
+        depth--;
+        continue;
+      }
+      if (top.next < count && copies[top.next].dst < u.src + u.length) {
+        uint64_t v = top.next++;
+        // memmove handles a copy overlapping itself
+        if (v == top.node || state[v] == ORDERED || state[v] == AS_LITERAL)
+          continue;
+        if (state[v] == ACTIVE) {
+          if (copies[v].length < u.length) {
+            state[v] = AS_LITERAL;
+          } else {
+            state[top.node] = AS_LITERAL;
+            depth--;
+          }
+          continue;
+        }
+        state[v] = ACTIVE;
+        stack[depth++] = {v, first_write_after(copies, count, copies[v].src)};
+      } else {
+        state[top.node] = ORDERED;
+        order[ordered++] = top.node;
+        depth--;
+      }
+    }
+  }
+
+  instStream.cursor = 0;
+  dataStream.cursor = 0;
+  for (uint64_t i = ordered; i-- > 0;) {
+    const PlacedUnit &c = copies[order[i]];
+    write_placed(instStream, c.dst, DeltaUnitMem{1, c.length, c.src});
+  }
+
+  // Literals for the gaps between the remaining copies, in target order
+  ReadOnlyBufferStreamDescriptor newStream = {newBuf, 0, targetSize};
+  uint64_t pos = 0;
+  for (uint64_t i = 0; i <= count; i++) {
+    if (i < count && state[i] == AS_LITERAL)
+      continue;
+    uint64_t end = i < count ? copies[i].dst : targetSize;
+    if (end > pos) {
+      write_placed(instStream, pos, DeltaUnitMem{0, end - pos, 0});
+      stream_from(dataStream, newStream, pos, end - pos);
+    }
+    if (i < count)
+      pos = copies[i].dst + copies[i].length;
+  }
+
+  gdelta_free(alloc, state);
+  gdelta_free(alloc, stack);
+  gdelta_free(alloc, order);
+  gdelta_free(alloc, copyList.buf);
+  return GDELTA_OK;
+}
+
+bool validate_placed(ReadOnlyBufferStreamDescriptor &deltaStream,
+                     uint64_t baseSize, uint64_t targetSize, uint64_t &size) {
+  uint64_t instructionLength;
+  if (!read_varint_checked(deltaStream, instructionLength) ||
+      instructionLength > deltaStream.length - deltaStream.cursor)
+    return false;
+  ReadOnlyBufferStreamDescriptor instStream = {
+      deltaStream.buf, deltaStream.cursor,
+      deltaStream.cursor + instructionLength};
+  uint64_t literal = deltaStream.length - instStream.length; // left to use
+  DeltaUnitMem unit = {};
+  uint64_t dst;
+
+  while (instStream.cursor < instStream.length) {
+    if (!read_varint_checked(instStream, dst) ||
+        !read_unit_checked(instStream, unit) || bad_empty_unit(unit, false) ||
+        dst > targetSize ||
+        unit.length > targetSize - dst || unit.length > targetSize - size)
+      return false;
+    if (unit.flag) {
+      if (unit.offset > baseSize || unit.length > baseSize - unit.offset)
+        return false;
+    } else {
+      if (unit.length > literal)
+        return false;
+      literal -= unit.length;
+    }
+    size += unit.length;
+  }
+  deltaStream.cursor = deltaStream.length - literal;
+  return true;
+}
+
+void apply_placed(ReadOnlyBufferStreamDescriptor &deltaStream,
+                  const uint8_t *baseBuf, uint8_t *out) {
+  const uint64_t instructionLength = read_varint(deltaStream);
+  const uint64_t instEnd = deltaStream.cursor + instructionLength;
+  const uint8_t *literal = deltaStream.buf + instEnd;
+  DeltaUnitMem unit = {};
+
+  while (deltaStream.cursor < instEnd) {
+    uint64_t dst = read_varint(deltaStream);
+    read_unit(deltaStream, unit);
+    if (unit.flag) {
+      memmove(out + dst, baseBuf + unit.offset, unit.length);
+    } else {
+      memcpy(out + dst, literal, unit.length);
+      literal += unit.length;
+    }
+  }
+  deltaStream.cursor = literal - deltaStream.buf;
+}
+
+// gdecode_in_place(), entropy-coded deltas are expanded into `plain`
+static int64_t decode_in_place(const uint8_t *deltaBuf, uint64_t deltaSize,
+                               uint8_t *buf, uint64_t baseSize,
+                               uint64_t capacity,
+                               BufferStreamDescriptor &plain) {
+  if (!is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER))
+    return GDELTA_ERR_PARAM;
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  DeltaHeader header;
+  int ret = read_header(deltaStream, header);
+  if (ret != GDELTA_OK)
+    return ret;
+  if (!(header.flags & GDELTA_FLAG_IN_PLACE))
+    return GDELTA_ERR_PARAM;
+  if (header.baseSize != baseSize)
+    return GDELTA_ERR_BASE_MISMATCH;
+  if (header.targetSize > capacity || baseSize > capacity)
+    return GDELTA_ERR_BUFFER;
+  if (header.flags & GDELTA_FLAG_ENTROPY) {
+    ret = use_expanded(deltaBuf, deltaSize, deltaStream, header, plain);
+    if (ret != GDELTA_OK)
+      return ret;
+  }
+  if ((header.flags & GDELTA_FLAG_CHECKSUM) &&
+      checksum(buf, baseSize) != header.baseChecksum)
+    return GDELTA_ERR_BASE_MISMATCH;
+
+  // Nothing is overwritten before the whole delta has been checked
+  int64_t size = validate_delta(deltaBuf, deltaSize, baseSize);
+  if (size < 0)
+    return size;
+  apply_placed(deltaStream, buf, buf);
+  if ((header.flags & GDELTA_FLAG_CHECKSUM) &&
+      checksum(buf, size) != header.targetChecksum)
+    return GDELTA_ERR_CHECKSUM;
+  return size;
+}
+
+int64_t gdecode_in_place(const uint8_t *deltaBuf, uint64_t deltaSize,
+                         uint8_t *buf, uint64_t baseSize, uint64_t capacity) {
+  BufferStreamDescriptor plain = {};
+  int64_t size = decode_in_place(deltaBuf, deltaSize, buf, baseSize, capacity,
+                                 plain);
+  free(plain.buf);
+  return size;
+}
@@ -1,8 +1,18 @@
 #ifndef GDELTA_INTERNAL_H
 #define GDELTA_INTERNAL_H
 
+#include <cassert>
 #include <type_traits>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "gdelta.h"
+
 #pragma pack(push, 1)
 /*
  * ABI:
@@ -45,10 +55,42 @@ static_assert(sizeof(VarIntPart) == 1, "Expected VarInt to be 1 byte");
 
 #define DEBUG_UNITS 0
 
+// Allocation helpers; a null allocator means the C library
+inline void *gdelta_malloc(const gdelta_allocator *alloc, size_t size) {
+  if (alloc == nullptr)
+    return malloc(size);
+  return alloc->alloc_fn(alloc->opaque, size);
+}
+
+inline void gdelta_free(const gdelta_allocator *alloc, void *ptr) {
+  if (alloc == nullptr)
+    free(ptr);
+  else if (ptr != nullptr)
+    alloc->free_fn(alloc->opaque, ptr);
+}
+
+inline void *gdelta_realloc(const gdelta_allocator *alloc, void *ptr,
+                            size_t old_size, size_t size) {
+  if (alloc == nullptr)
+    return realloc(ptr, size);
+  if (alloc->realloc_fn != nullptr)
+    return alloc->realloc_fn(alloc->opaque, ptr, size);
+
+  void *moved = alloc->alloc_fn(alloc->opaque, size);
+  if (moved != nullptr && ptr != nullptr) {
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    alloc->free_fn(alloc->opaque, ptr);
+  }
+  return moved;
+}
+
 typedef struct {
   uint8_t *buf;
   uint64_t cursor;
   uint64_t length;
+  const gdelta_allocator *alloc = nullptr;
+  uint64_t grows = 0; // reallocations, reported in gdelta_stats
+  bool failed = false; // could not grow, writes are dropped from then on
 } BufferStreamDescriptor;
 
 typedef struct {
@@ -57,23 +99,42 @@ typedef struct {
   uint64_t length;
 } ReadOnlyBufferStreamDescriptor;
 
+/*
+ * Grow geometrically so byte-wise appends are amortized O(1). Returns false
+ * if the stream cannot grow: the buffer is kept as it was and the stream
+ * marked failed, so the writers below drop everything that follows and the
+ * caller reports GDELTA_ERR_MEMORY once it is done.
+ */
 template <typename B>
-void ensure_stream_length(B &stream, size_t length) {
+bool ensure_stream_length(B &stream, size_t length) {
   if constexpr (!std::is_const<decltype(stream.buf)>::value) {
+    if (stream.failed)
+      return false;
     if (length > stream.length) {
-      stream.buf = (uint8_t*)realloc(stream.buf, length);
-      stream.length = length;
+      size_t grown = stream.length + (stream.length >> 1);
+      if (grown < length)
+        grown = length;
+      uint8_t *buf = (uint8_t*)gdelta_realloc(stream.alloc, stream.buf, stream.length, grown);
+      if (buf == nullptr) {
+        stream.failed = true;
+        return false;
+      }
+      stream.buf = buf;
+      stream.length = grown;
+      stream.grows++;
     }
   }
+  return true;
 }
 
 template <typename B, typename T>
 void write_field(B &buffer, const T &field) {
   static_assert(!std::is_const<decltype(buffer.buf)>::value, "Stream needs to be writeable for write_field");
-  ensure_stream_length(buffer, buffer.cursor + sizeof(T));
+  // The bounds check: grows the buffer past the field or fails the stream
+  if (!ensure_stream_length(buffer, buffer.cursor + sizeof(T)))
+    return;
   memcpy(buffer.buf + buffer.cursor, &field, sizeof(T));
   buffer.cursor += sizeof(T);
-  // TODO: check bounds (buffer->length)?
 }
 
 
@@ -81,14 +142,16 @@ template <typename B, typename T>
 void read_field(B &buffer, T& field) {  
   memcpy(&field, buffer.buf + buffer.cursor, sizeof(T));
   buffer.cursor += sizeof(T);
-  // TODO: check bounds (buffer->length)?
+  // Unchecked: the decoders run validate_delta() first, the *_checked
+  // readers test the length themselves
 }
 
 
 template <typename DstT, typename SrcT>
 void stream_into(DstT &dest, SrcT &src, size_t length) {
   static_assert(!std::is_const<decltype(dest.buf)>::value, "Stream needs to be writeable for write_field");
-  ensure_stream_length(dest, dest.cursor + length);
+  if (!ensure_stream_length(dest, dest.cursor + length))
+    return;
   memcpy(dest.buf + dest.cursor, src.buf + src.cursor, length);
   dest.cursor += length;
   src.cursor += length;
@@ -97,7 +160,8 @@ void stream_into(DstT &dest, SrcT &src, size_t length) {
 template <typename DstT, typename SrcT>
 void stream_from(DstT &dest, const SrcT &src, size_t src_cursor, size_t length) {
   static_assert(!std::is_const<decltype(dest.buf)>::value, "Stream needs to be writeable for write_field");
-  ensure_stream_length(dest, dest.cursor + length);
+  if (!ensure_stream_length(dest, dest.cursor + length))
+    return;
   memcpy(dest.buf + dest.cursor, src.buf + src_cursor, length);
   dest.cursor += length;
 }
@@ -105,37 +169,152 @@ void stream_from(DstT &dest, const SrcT &src, size_t src_cursor, size_t length)
 template <typename DstT, typename SrcT>
 void write_concat_buffer(DstT &dest, const SrcT &src) {
   static_assert(!std::is_const<decltype(dest.buf)>::value, "Stream needs to be writeable for write_field");
-  ensure_stream_length(dest, dest.cursor + src.cursor + 1);
-  memcpy(dest.buf + dest.cursor, src.buf, src.cursor);
+  if (!ensure_stream_length(dest, dest.cursor + src.cursor + 1))
+    return;
+  if (src.cursor)
+    memcpy(dest.buf + dest.cursor, src.buf, src.cursor);
   dest.cursor += src.cursor;
 }
 
+inline unsigned ctz64(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward64(&i, v);
+  return i;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+
+inline unsigned clz64(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanReverse64(&i, v);
+  return 63 - i;
+#else
+  return __builtin_clzll(v);
+#endif
+}
+
+inline uint64_t load_le64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+inline void store_le64(uint8_t *p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * Decodes the varint at the start of `word` (8 bytes loaded little-endian)
+ * without a per-byte loop: the first clear `more` bit ends it, and the 7-bit
+ * groups are packed with pext or three mask-and-shift rounds. Sets `bytes`
+ * to its size, or to 0 if it runs past the word.
+ */
+inline uint64_t varint_from_word(uint64_t word, unsigned &bytes) {
+  const uint64_t more_bits = 0x0101010101010101ULL;
+  uint64_t stops = ~word & more_bits;
+  if (stops == 0) {
+    bytes = 0;
+    return 0;
+  }
+  bytes = ctz64(stops) / 8 + 1;
+  uint64_t keep = ((stops ^ (stops - 1)) << 7) | 0x7F; // bytes through the stop
+  word &= keep;
+#ifdef __BMI2__
+  return _pext_u64(word, ~more_bits);
+#else
+  uint64_t x = (word >> 1) & 0x7F7F7F7F7F7F7F7FULL;
+  x = ((x & 0x7F007F007F007F00ULL) >> 1) | (x & 0x007F007F007F007FULL);
+  x = ((x & 0x3FFF00003FFF0000ULL) >> 2) | (x & 0x00003FFF00003FFFULL);
+  x = ((x & 0x0FFFFFFF00000000ULL) >> 4) | (x & 0x000000000FFFFFFFULL);
+  return x;
+#endif
+}
+
+// Byte-wise decoding, used near the end of a buffer and for varints over
+// 8 bytes (values of 2^56 and up)
 template <typename B>
-uint64_t read_varint(B& buffer) {
+uint64_t read_varint_slow(B& buffer) {
   VarIntPart vi;
   uint64_t val = 0;
   uint8_t offset = 0;
   do {
     read_field(buffer, vi);
-    val |= vi.subint << offset;
+    if (offset < 64)
+      val |= (uint64_t)vi.subint << offset;
     offset += VarIntPart::lenbits;
   } while(vi.more);
   return val;
 }
 
 template <typename B>
-void read_unit(B& buffer, DeltaUnitMem& unit) {
+void read_unit_slow(B& buffer, DeltaUnitMem& unit) {
   DeltaHeadUnit head;
   read_field(buffer, head);
- 
+
   unit.flag = head.flag;
   unit.length = head.length;
   if (head.more) {
-    unit.length = read_varint(buffer) << DeltaHeadUnit::lenbits | unit.length;
+    unit.length = read_varint_slow(buffer) << DeltaHeadUnit::lenbits | unit.length;
   }
   if (head.flag) {
-    unit.offset = read_varint(buffer);
+    unit.offset = read_varint_slow(buffer);
+  }
+}
+
+template <typename B>
+uint64_t read_varint(B& buffer) {
+  if (buffer.length - buffer.cursor >= sizeof(uint64_t)) {
+    unsigned bytes;
+    uint64_t val = varint_from_word(load_le64(buffer.buf + buffer.cursor), bytes);
+    if (bytes) {
+      buffer.cursor += bytes;
+      return val;
+    }
+  }
+  return read_varint_slow(buffer);
+}
+
+/*
+ * Decodes a unit from the next 1 + 2 * 8 bytes, which must be readable.
+ * Returns false, leaving the cursor alone, if a varint runs past its word.
+ * Head byte: flag in bit 0, more in bit 1, low length bits above.
+ */
+template <typename B>
+bool read_unit_word(B& buffer, DeltaUnitMem& unit) {
+  const uint8_t *p = buffer.buf + buffer.cursor;
+  uint8_t head = p[0];
+  uint64_t pos = 1;
+  unsigned bytes = 1;
+  unit.flag = head & 1;
+  unit.length = head >> 2;
+  if (head & 2) {
+    unit.length |= varint_from_word(load_le64(p + pos), bytes) << DeltaHeadUnit::lenbits;
+    pos += bytes;
   }
+  if (bytes && unit.flag) {
+    unit.offset = varint_from_word(load_le64(p + pos), bytes);
+    pos += bytes;
+  }
+  if (!bytes)
+    return false;
+  buffer.cursor += pos;
+  return true;
+}
+
+template <typename B>
+void read_unit(B& buffer, DeltaUnitMem& unit) {
+  if (buffer.length - buffer.cursor < 1 + 2 * sizeof(uint64_t) ||
+      !read_unit_word(buffer, unit))
+    read_unit_slow(buffer, unit);
 #if DEBUG_UNITS
   fprintf(stderr, "Reading unit %d %zu %zu\n", unit.flag, unit.length, unit.offset);
 #endif
@@ -164,7 +343,7 @@ void write_varint(B& buffer, uint64_t val)
 template <typename B>
 void write_unit(B& buffer, const DeltaUnitMem& unit) {
   static_assert(!std::is_const<decltype(buffer.buf)>::value, "Stream needs to be writeable for write_field");
-  // TODO: Abort if length 0?
+  assert(unit.length > 0 && "empty units are rejected by the decoders");
 #if DEBUG_UNITS
   fprintf(stderr, "Writing unit %d %zu %zu\n", unit.flag, unit.length, unit.offset);
 #endif
@@ -172,11 +351,374 @@ void write_unit(B& buffer, const DeltaUnitMem& unit) {
   DeltaHeadUnit head = {unit.flag, unit.length > head_varint_mask, (uint8_t)(unit.length & head_varint_mask)};
   write_field(buffer, head);
 
-  uint64_t remaining_length = unit.length >> DeltaHeadUnit::lenbits;
-  write_varint(buffer, remaining_length);
+  // Readers only expect the rest of the length when `more` is set. Older
+  // writers always emitted it: after a short literal the stray zero byte
+  // reads as an empty literal, but a short copy took its offset (0) from it
+  // and its real offset was misread as further units.
+  if (head.more)
+    write_varint(buffer, unit.length >> DeltaHeadUnit::lenbits);
   if (unit.flag) {
     write_varint(buffer, unit.offset);
   }
 }
 
+// Empty units are corrupt, except for empty literals in plain deltas: the
+// stray byte older writers left after every short literal (see above)
+inline bool bad_empty_unit(const DeltaUnitMem &unit, bool plain) {
+  return unit.length == 0 && (unit.flag || !plain);
+}
+
+/*
+ * Gear index over a complete base, built once and shared read-only by any
+ * number of gencode_with_base() calls (also across threads).
+ */
+struct gdelta_base {
+  const uint8_t *buf;
+  uint64_t size;
+  void *hash_table; // uint64_t entries if wide, else uint32_t
+  int32_t bit;
+  uint32_t ways; // entries per bucket
+  bool wide;
+  uint64_t used; // entries holding a position, for gdelta_stats
+};
+
+/*
+ * Scratch state recycled across calls: instruction/literal streams and the
+ * hash table are only rewound between uses, and the output stream backs the
+ * buffers returned by the *_ctx functions.
+ */
+struct gdelta_ctx {
+  BufferStreamDescriptor inst;
+  BufferStreamDescriptor data;
+  BufferStreamDescriptor out;
+  void *hash_table;
+  uint64_t hash_capacity; // bytes
+  gdelta_allocator custom;
+  const gdelta_allocator *alloc; // &custom, or null for the C library
+  uint32_t acceleration;
+  int level;
+  bool entropy;
+  bool checksum;
+  bool inPlace;
+  uint64_t indexInterval; // 0 for no index
+  bool collectStats;
+  gdelta_stats stats; // of the last call
+};
+
+/*
+ * Match-length kernels (gdelta_match.cpp), dispatched to the widest vector
+ * unit available at startup. match_forward() counts equal bytes from a[0]
+ * and b[0] onwards, match_backward() counts equal bytes going down from
+ * a[-1] and b[-1]; both stop after `max`.
+ */
+uint64_t match_forward(const uint8_t *a, const uint8_t *b, uint64_t max);
+uint64_t match_backward(const uint8_t *a, const uint8_t *b, uint64_t max);
+
+// Appends a delta to `deltaStream` using the context's scratch space; a
+// plain delta, or with `header` a complete versioned one
+int64_t gencode_run(gdelta_ctx *ctx, const uint8_t *newBuf, uint64_t newSize,
+                    const uint8_t *baseBuf, uint64_t baseSize,
+                    const gdelta_base *base, bool header,
+                    BufferStreamDescriptor &deltaStream);
+
+// Appends a complete versioned delta, with the header and body gencode_run()
+// writes for the context's params, from the instruction and literal
+// sections already in the context
+int64_t gencode_finish(gdelta_ctx *ctx, const uint8_t *newBuf,
+                       uint64_t newSize, const uint8_t *baseBuf,
+                       uint64_t baseSize, BufferStreamDescriptor &deltaStream);
+
+// gdecode64() expanding entropy-coded deltas into the context's scratch;
+// the output is still the caller's malloc'd buffer
+int64_t gdecode_with_scratch(gdelta_ctx *ctx, const uint8_t *deltaBuf,
+                             uint64_t deltaSize, const uint8_t *baseBuf,
+                             uint64_t baseSize, uint8_t **outBuf,
+                             uint64_t *outSize);
+
+// Index over the units of an instruction section, an entry about every
+// `interval` target bytes (gdelta_range.cpp)
+void write_index(BufferStreamDescriptor &deltaStream, const uint8_t *inst,
+                 uint64_t instSize, uint64_t interval);
+
+// Instruction and literal sections, as a plain delta or entropy-coded blocks
+void write_sections(BufferStreamDescriptor &deltaStream,
+                    const BufferStreamDescriptor &instStream,
+                    const BufferStreamDescriptor &dataStream, bool entropy);
+
+// A unit with its resolved positions: target offset and source offset in
+// the base (copy) or in the delta buffer (literal)
+typedef struct {
+  uint64_t dst;
+  uint64_t src;
+  uint64_t length;
+  uint8_t flag;
+} PlacedUnit;
+
+// Lists the units of a delta (any format, entropy-coded ones expanded first)
+// as PlacedUnit records in `units`, returns the target size. Units come in
+// delta order, for in-place deltas the order they must be applied in.
+uint64_t scan_units(const uint8_t *deltaBuf, uint64_t deltaSize,
+                    BufferStreamDescriptor &units);
+
+/*
+ * One pass over the instructions of a delta (entropy-coded ones expanded
+ * first) checking that every unit is complete and not empty (see
+ * bad_empty_unit()), copies stay inside a base of
+ * `baseSize` bytes and literals inside the delta, which they must use up.
+ * Returns the target size, after which the delta can be decoded without
+ * further checks, or GDELTA_ERR_CORRUPT/GDELTA_ERR_UNSUPPORTED.
+ */
+int64_t validate_delta(const uint8_t *deltaBuf, uint64_t deltaSize,
+                       uint64_t baseSize);
+
+/*
+ * Container formats start with GDELTA_MAGIC and a format byte. A plain delta
+ * can never begin this way: 'G' has its `more` bit set and a zero group never
+ * terminates a varint written by write_varint().
+ */
+const uint8_t GDELTA_MAGIC[] = {'G', 0x00, 'D'};
+const uint8_t GDELTA_FORMAT_FRAMED = 'F';
+const uint8_t GDELTA_FORMAT_HEADER = 'H';
+#define CONTAINER_PREFIX_SIZE (sizeof(GDELTA_MAGIC) + 1)
+
+inline bool is_container(const uint8_t *buf, uint64_t size, uint8_t format) {
+  return size >= CONTAINER_PREFIX_SIZE &&
+         memcmp(buf, GDELTA_MAGIC, sizeof(GDELTA_MAGIC)) == 0 &&
+         buf[sizeof(GDELTA_MAGIC)] == format;
+}
+
+template <typename B>
+void write_container_prefix(B &buffer, uint8_t format) {
+  for (uint8_t c : GDELTA_MAGIC)
+    write_field(buffer, c);
+  write_field(buffer, format);
+}
+
+/*
+ * Versioned header, followed by one plain delta:
+ *
+ * prefix('H') | version 1 | flags 1 | VarInt target size | VarInt base size
+ *   [| VarInt base count | VarInt size of each base]  (GDELTA_FLAG_MULTI_BASE)
+ *   [| LE64 base checksum | LE64 target checksum]     (GDELTA_FLAG_CHECKSUM)
+ *   [| VarInt entry count | index entries]             (GDELTA_FLAG_INDEX)
+ *
+ * With several bases, copy offsets address the bases concatenated in order
+ * and the base size is their total. With GDELTA_FLAG_ENTROPY the plain delta
+ * is replaced by its instruction and literal sections as entropy-coded
+ * blocks. With GDELTA_FLAG_IN_PLACE every unit is preceded by a VarInt target
+ * offset and the units are listed in the order that rebuilds the target
+ * inside the base buffer (see gdelta_inplace.cpp). The index lets range
+ * decodes start part way into the delta (see gdelta_range.cpp). Readers
+ * reject versions and flags they do not know.
+ */
+const uint8_t GDELTA_VERSION = 1;
+const uint8_t GDELTA_FLAG_MULTI_BASE = 1;
+const uint8_t GDELTA_FLAG_ENTROPY = 2;
+const uint8_t GDELTA_FLAG_CHECKSUM = 4;
+const uint8_t GDELTA_FLAG_IN_PLACE = 8;
+const uint8_t GDELTA_FLAG_INDEX = 16;
+const uint8_t GDELTA_KNOWN_FLAGS = GDELTA_FLAG_MULTI_BASE | GDELTA_FLAG_ENTROPY |
+                                   GDELTA_FLAG_CHECKSUM | GDELTA_FLAG_IN_PLACE |
+                                   GDELTA_FLAG_INDEX;
+
+/*
+ * An index entry marks the first unit starting at or after a multiple of
+ * the index interval: its target offset, and where it and its literal bytes
+ * start relative to the instruction and literal sections of the plain
+ * delta, as LE64 each.
+ */
+const uint64_t INDEX_ENTRY_SIZE = 3 * sizeof(uint64_t);
+
+typedef struct {
+  uint8_t version;
+  uint8_t flags;
+  uint64_t targetSize;
+  uint64_t baseSize;
+  uint64_t baseCount; // 1 unless GDELTA_FLAG_MULTI_BASE
+  uint64_t baseList;  // buffer offset of the base sizes, if any
+  uint64_t baseChecksum;   // if GDELTA_FLAG_CHECKSUM
+  uint64_t targetChecksum;
+  uint64_t indexCount;     // if GDELTA_FLAG_INDEX
+  uint64_t indexList;      // buffer offset of the first entry
+} DeltaHeader;
+
+template <typename B>
+void write_header(B &buffer, const DeltaHeader &header) {
+  write_container_prefix(buffer, GDELTA_FORMAT_HEADER);
+  write_field(buffer, header.version);
+  write_field(buffer, header.flags);
+  write_varint(buffer, header.targetSize);
+  write_varint(buffer, header.baseSize);
+}
+
+template <typename B>
+void write_base_list(B &buffer, const uint64_t *baseSizes, uint64_t count) {
+  write_varint(buffer, count);
+  for (uint64_t i = 0; i < count; i++)
+    write_varint(buffer, baseSizes[i]);
+}
+
+template <typename B>
+void write_checksums(B &buffer, const DeltaHeader &header) {
+  if (!ensure_stream_length(buffer, buffer.cursor + 2 * sizeof(uint64_t)))
+    return;
+  store_le64(buffer.buf + buffer.cursor, header.baseChecksum);
+  store_le64(buffer.buf + buffer.cursor + 8, header.targetChecksum);
+  buffer.cursor += 2 * sizeof(uint64_t);
+}
+
+// Bounds-checked read_varint(), false on truncated or overlong input
+template <typename B>
+bool read_varint_checked(B &buffer, uint64_t &val) {
+  val = 0;
+  for (uint8_t offset = 0; offset < 64; offset += VarIntPart::lenbits) {
+    if (buffer.cursor >= buffer.length)
+      return false;
+    VarIntPart vi;
+    read_field(buffer, vi);
+    val |= (uint64_t)vi.subint << offset;
+    if (!vi.more)
+      return true;
+  }
+  return false;
+}
+
+// Bounds-checked read_unit(), false on truncated or overlong input
+template <typename B>
+bool read_unit_checked(B &buffer, DeltaUnitMem &unit) {
+  if (buffer.length - buffer.cursor >= 1 + 2 * sizeof(uint64_t) &&
+      read_unit_word(buffer, unit))
+    return true;
+  if (buffer.cursor >= buffer.length)
+    return false;
+  DeltaHeadUnit head;
+  read_field(buffer, head);
+  unit.flag = head.flag;
+  unit.length = head.length;
+  uint64_t high;
+  if (head.more) {
+    if (!read_varint_checked(buffer, high) ||
+        high >> (64 - DeltaHeadUnit::lenbits) != 0)
+      return false;
+    unit.length |= high << DeltaHeadUnit::lenbits;
+  }
+  return !head.flag || read_varint_checked(buffer, unit.offset);
+}
+
+/*
+ * Parses the header of a delta in the versioned format, leaving the cursor
+ * at its plain delta. Returns GDELTA_OK, GDELTA_ERR_CORRUPT or
+ * GDELTA_ERR_UNSUPPORTED.
+ */
+template <typename B>
+int read_header(B &buffer, DeltaHeader &header) {
+  if (!is_container(buffer.buf, buffer.length, GDELTA_FORMAT_HEADER) ||
+      buffer.length < CONTAINER_PREFIX_SIZE + 2)
+    return GDELTA_ERR_CORRUPT;
+  buffer.cursor = CONTAINER_PREFIX_SIZE;
+  read_field(buffer, header.version);
+  read_field(buffer, header.flags);
+  if (header.version != GDELTA_VERSION || (header.flags & ~GDELTA_KNOWN_FLAGS))
+    return GDELTA_ERR_UNSUPPORTED;
+  if (!read_varint_checked(buffer, header.targetSize) ||
+      !read_varint_checked(buffer, header.baseSize))
+    return GDELTA_ERR_CORRUPT;
+
+  header.baseCount = 1;
+  header.baseList = buffer.cursor;
+  if (header.flags & GDELTA_FLAG_MULTI_BASE) {
+    // Skipped here, the sizes only have to add up to the total
+    uint64_t total = 0, size;
+    if (!read_varint_checked(buffer, header.baseCount))
+      return GDELTA_ERR_CORRUPT;
+    header.baseList = buffer.cursor;
+    for (uint64_t i = 0; i < header.baseCount; i++) {
+      if (!read_varint_checked(buffer, size) || size > header.baseSize - total)
+        return GDELTA_ERR_CORRUPT;
+      total += size;
+    }
+    if (total != header.baseSize)
+      return GDELTA_ERR_CORRUPT;
+  }
+  if (header.flags & GDELTA_FLAG_CHECKSUM) {
+    if (buffer.length - buffer.cursor < 2 * sizeof(uint64_t))
+      return GDELTA_ERR_CORRUPT;
+    header.baseChecksum = load_le64(buffer.buf + buffer.cursor);
+    header.targetChecksum = load_le64(buffer.buf + buffer.cursor + 8);
+    buffer.cursor += 2 * sizeof(uint64_t);
+  }
+  header.indexCount = 0;
+  header.indexList = buffer.cursor;
+  if (header.flags & GDELTA_FLAG_INDEX) {
+    if (!read_varint_checked(buffer, header.indexCount) ||
+        header.indexCount > (buffer.length - buffer.cursor) / INDEX_ENTRY_SIZE)
+      return GDELTA_ERR_CORRUPT;
+    header.indexList = buffer.cursor;
+    buffer.cursor += header.indexCount * INDEX_ENTRY_SIZE;
+  }
+  return GDELTA_OK;
+}
+
+/*
+ * Checksums of headers with GDELTA_FLAG_CHECKSUM (gdelta_checksum.cpp):
+ * XXH64 with seed 0. The state takes data in pieces of any size, so the
+ * decoders hash their output right after writing it.
+ */
+typedef struct {
+  uint64_t acc[4];
+  uint8_t stripe[32]; // bytes short of a full stripe
+  uint32_t pending;
+  uint64_t total;
+} ChecksumState;
+
+void checksum_init(ChecksumState &state);
+void checksum_update(ChecksumState &state, const uint8_t *buf, uint64_t size);
+uint64_t checksum_final(const ChecksumState &state);
+uint64_t checksum(const uint8_t *buf, uint64_t size);
+
+/*
+ * Entropy stage (gdelta_huffman.cpp). A block is
+ *
+ * VarInt raw size | method 1 | stored bytes
+ *                            | 4-bit code lengths | VarInt size | bit stream
+ *
+ * and falls back to storing the bytes when coding would not shrink them.
+ */
+void huffman_write_block(BufferStreamDescriptor &out, const uint8_t *src,
+                         uint64_t size);
+
+// Appends the decoded block to `out`, false if it is corrupt
+bool huffman_read_block(ReadOnlyBufferStreamDescriptor &in,
+                        BufferStreamDescriptor &out);
+
+// Rewrites a delta with GDELTA_FLAG_ENTROPY into the same delta without it
+int expand_entropy(const uint8_t *deltaBuf, uint64_t deltaSize,
+                   BufferStreamDescriptor &plain);
+
+// Points the delta, its stream and header at its expansion into `plain`, so
+// a decoder carries on from there; `plain` must outlive the decode
+int use_expanded(const uint8_t *&deltaBuf, uint64_t &deltaSize,
+                 ReadOnlyBufferStreamDescriptor &deltaStream,
+                 DeltaHeader &header, BufferStreamDescriptor &plain);
+
+/*
+ * In-place deltas (gdelta_inplace.cpp). order_in_place() turns the
+ * instruction section of a plain delta for `newBuf` into placed units:
+ * copies in an order where none reads bytes an earlier one overwrote, then
+ * the literals, which take in the copies that could not be ordered.
+ */
+int order_in_place(const uint8_t *inst, uint64_t instSize,
+                   const uint8_t *newBuf, BufferStreamDescriptor &instStream,
+                   BufferStreamDescriptor &dataStream,
+                   const gdelta_allocator *alloc);
+
+// Checks the placed units at deltaStream.cursor like validate_delta(), each
+// must also land inside the target; adds their lengths to `size`
+bool validate_placed(ReadOnlyBufferStreamDescriptor &deltaStream,
+                     uint64_t baseSize, uint64_t targetSize, uint64_t &size);
+
+// Applies validated placed units to `out`; `baseBuf` may be `out` itself
+void apply_placed(ReadOnlyBufferStreamDescriptor &deltaStream,
+                  const uint8_t *baseBuf, uint8_t *out);
+
 #endif // GDELTA_INTERNAL_H
@@ -0,0 +1,151 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MATCH_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if MATCH_SSE2 && (defined(__GNUC__) || defined(__clang__))
+#define MATCH_AVX2 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Word-at-a-time tails shared by all kernels: the first differing byte is
+ * found from the XOR of two little-endian words.
+ */
+static uint64_t forward_scalar(const uint8_t *a, const uint8_t *b,
+                               uint64_t n, uint64_t max) {
+  while (n + sizeof(uint64_t) <= max) {
+    uint64_t diff = load_le64(a + n) ^ load_le64(b + n);
+    if (diff)
+      return n + ctz64(diff) / 8;
+    n += sizeof(uint64_t);
+  }
+  while (n < max && a[n] == b[n])
+    n++;
+  return n;
+}
+
+static uint64_t backward_scalar(const uint8_t *a, const uint8_t *b,
+                                uint64_t n, uint64_t max) {
+  while (n + sizeof(uint64_t) <= max) {
+    uint64_t diff = load_le64(a - n - sizeof(uint64_t)) ^ load_le64(b - n - sizeof(uint64_t));
+    if (diff)
+      return n + clz64(diff) / 8;
+    n += sizeof(uint64_t);
+  }
+  while (n < max && a[-(int64_t)n - 1] == b[-(int64_t)n - 1])
+    n++;
+  return n;
+}
+
+#if !MATCH_SSE2
+static uint64_t forward_generic(const uint8_t *a, const uint8_t *b,
+                                uint64_t max) {
+  return forward_scalar(a, b, 0, max);
+}
+
+static uint64_t backward_generic(const uint8_t *a, const uint8_t *b,
+                                 uint64_t max) {
+  return backward_scalar(a, b, 0, max);
+}
+#endif
+
+#if MATCH_SSE2
+// 16 bytes per compare, movemask bit i is set when byte i matches
+static uint64_t forward_sse2(const uint8_t *a, const uint8_t *b,
+                             uint64_t max) {
+  uint64_t n = 0;
+  while (n + 16 <= max) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + n));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + n));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (mask != 0xFFFF)
+      return n + ctz64(~mask & 0xFFFF);
+    n += 16;
+  }
+  return forward_scalar(a, b, n, max);
+}
+
+static uint64_t backward_sse2(const uint8_t *a, const uint8_t *b,
+                              uint64_t max) {
+  uint64_t n = 0;
+  while (n + 16 <= max) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a - n - 16));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b - n - 16));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (mask != 0xFFFF)
+      return n + (clz64(~mask & 0xFFFF) - 48);
+    n += 16;
+  }
+  return backward_scalar(a, b, n, max);
+}
+#endif
+
+#if MATCH_AVX2
+__attribute__((target("avx2")))
+static uint64_t forward_avx2(const uint8_t *a, const uint8_t *b,
+                             uint64_t max) {
+  uint64_t n = 0;
+  while (n + 32 <= max) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + n));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + n));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (mask != 0xFFFFFFFF)
+      return n + ctz64(~(uint64_t)mask & 0xFFFFFFFF);
+    n += 32;
+  }
+  return forward_scalar(a, b, n, max);
+}
+
+__attribute__((target("avx2")))
+static uint64_t backward_avx2(const uint8_t *a, const uint8_t *b,
+                              uint64_t max) {
+  uint64_t n = 0;
+  while (n + 32 <= max) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a - n - 32));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b - n - 32));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (mask != 0xFFFFFFFF)
+      return n + (clz64(~(uint64_t)mask & 0xFFFFFFFF) - 32);
+    n += 32;
+  }
+  return backward_scalar(a, b, n, max);
+}
+#endif
+
+typedef uint64_t (*match_fn)(const uint8_t *, const uint8_t *, uint64_t);
+
+typedef struct {
+  match_fn forward;
+  match_fn backward;
+} MatchKernels;
+
+// Widest kernels the running CPU supports
+static MatchKernels select_kernels() {
+#if MATCH_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {forward_avx2, backward_avx2};
+#endif
+#if MATCH_SSE2
+  return {forward_sse2, backward_sse2};
+#else
+  return {forward_generic, backward_generic};
+#endif
+}
+
+static const MatchKernels kernels = select_kernels();
+
+uint64_t match_forward(const uint8_t *a, const uint8_t *b, uint64_t max) {
+  return kernels.forward(a, b, max);
+}
+
+uint64_t match_backward(const uint8_t *a, const uint8_t *b, uint64_t max) {
+  return kernels.backward(a, b, max);
+}
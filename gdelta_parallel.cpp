@@ -0,0 +1,384 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <thread>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+// Smallest target slice worth handing to a worker
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+// Smallest output range worth copying on its own thread
+#define MIN_COPY_SIZE (1024 * 1024)
+// Slices per thread, so faster workers pick up the slack
+#define SEGMENTS_PER_THREAD 4
+
+static unsigned worker_count(unsigned threads) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  return threads ? threads : 1;
+}
+
+/*
+ * Rebuilds one instruction/literal stream from units in target order. Units
+ * are held back by one so neighbours of the same kind can be merged, and
+ * literal data is taken from the target at flush time.
+ */
+typedef struct {
+  BufferStreamDescriptor inst;
+  BufferStreamDescriptor data;
+  DeltaUnitMem pending;
+  uint64_t pendingPos; // target position of `pending`
+} UnitWriter;
+
+static void flush_unit(UnitWriter &w, const ReadOnlyBufferStreamDescriptor &newStream) {
+  if (w.pending.length == 0)
+    return;
+  write_unit(w.inst, w.pending);
+  if (!w.pending.flag)
+    stream_from(w.data, newStream, w.pendingPos, w.pending.length);
+  w.pending.length = 0;
+}
+
+static void push_unit(UnitWriter &w, const ReadOnlyBufferStreamDescriptor &newStream,
+                      const DeltaUnitMem &unit, uint64_t pos) {
+  if (unit.length == 0)
+    return;
+  if (w.pending.length && w.pending.flag == unit.flag &&
+      (!unit.flag || w.pending.offset + w.pending.length == unit.offset)) {
+    w.pending.length += unit.length;
+    return;
+  }
+  flush_unit(w, newStream);
+  w.pending = unit;
+  w.pendingPos = pos;
+}
+
+/*
+ * Segments are encoded without knowledge of their neighbours; let a copy on
+ * one side of a seam absorb matching literal bytes on the other side.
+ */
+static void extend_across_seam(UnitWriter &w, DeltaUnitMem &unit, uint64_t &pos,
+                               const uint8_t *newBuf, const gdelta_base *base) {
+  DeltaUnitMem &prev = w.pending;
+  if (prev.length == 0 || unit.length == 0 || prev.flag == unit.flag)
+    return;
+
+  if (!prev.flag) { // Literal | Copy: grow the copy backwards
+    uint64_t k = 0;
+    while (k < prev.length && k < unit.offset &&
+           base->buf[unit.offset - k - 1] == newBuf[pos - k - 1])
+      k++;
+    prev.length -= k;
+    unit.offset -= k;
+    unit.length += k;
+    pos -= k;
+  } else {          // Copy | Literal: grow the copy forwards
+    uint64_t end = prev.offset + prev.length;
+    uint64_t j = 0;
+    while (j < unit.length && end + j < base->size &&
+           base->buf[end + j] == newBuf[pos + j])
+      j++;
+    prev.length += j;
+    unit.length -= j;
+    pos += j;
+  }
+}
+
+/*
+ * Shared body of gencode_parallel() and gencode_ctx_parallel(): segments are
+ * encoded by workers with the level and acceleration of `ctx`, stitched into
+ * its instruction and literal streams and written out with its other params.
+ */
+static int64_t parallel_run(gdelta_ctx *ctx, const uint8_t *newBuf,
+                            uint64_t newSize, const gdelta_base *base,
+                            BufferStreamDescriptor &deltaStream,
+                            unsigned threads) {
+  threads = worker_count(threads);
+  uint64_t segments = threads * SEGMENTS_PER_THREAD;
+  if (segments > newSize / MIN_SEGMENT_SIZE)
+    segments = newSize / MIN_SEGMENT_SIZE;
+  if (threads == 1 || segments < 2)
+    return gencode_run(ctx, newBuf, newSize, base->buf, base->size, base,
+                       true, deltaStream);
+  if (threads > segments)
+    threads = segments;
+  gdelta_ctx_reset(ctx);
+
+  uint64_t segmentSize = (newSize + segments - 1) / segments;
+  BufferStreamDescriptor *parts = (BufferStreamDescriptor *)calloc(segments, sizeof(BufferStreamDescriptor));
+  if (parts == nullptr)
+    return GDELTA_ERR_MEMORY;
+
+  std::atomic<uint64_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    gdelta_ctx *segmentCtx = gdelta_ctx_new_with_allocator(ctx->alloc);
+    if (segmentCtx == nullptr) {
+      failed = true;
+      return;
+    }
+    segmentCtx->acceleration = ctx->acceleration;
+    segmentCtx->level = ctx->level;
+    for (uint64_t s; (s = next++) < segments;) {
+      uint64_t begin = s * segmentSize;
+      uint64_t size = begin + segmentSize < newSize ? segmentSize : newSize - begin;
+      if (gencode_run(segmentCtx, newBuf + begin, size, base->buf, base->size, base, false, parts[s]) < 0)
+        failed = true;
+    }
+    gdelta_ctx_free(segmentCtx);
+  };
+
+  std::thread *pool = new std::thread[threads - 1];
+  for (unsigned t = 0; t + 1 < threads; t++)
+    pool[t] = std::thread(worker);
+  worker();
+  for (unsigned t = 0; t + 1 < threads; t++)
+    pool[t].join();
+  delete[] pool;
+
+  // Stitch the segment streams in target order
+  int64_t ret = GDELTA_ERR_MEMORY;
+  if (!failed) {
+    ReadOnlyBufferStreamDescriptor newStream = {newBuf, 0, newSize};
+    UnitWriter w = {ctx->inst, ctx->data, {}, 0};
+    uint64_t pos = 0;
+    for (uint64_t s = 0; s < segments; s++) {
+      ReadOnlyBufferStreamDescriptor part = {parts[s].buf, 0, parts[s].cursor};
+      const uint64_t instructionLength = read_varint(part);
+      const uint64_t instEnd = part.cursor + instructionLength;
+      bool seam = s > 0;
+      DeltaUnitMem unit;
+      while (part.cursor < instEnd) {
+        read_unit(part, unit);
+        if (seam && unit.length) {
+          extend_across_seam(w, unit, pos, newBuf, base);
+          seam = false;
+        }
+        uint64_t unitPos = pos;
+        pos += unit.length;
+        push_unit(w, newStream, unit, unitPos);
+      }
+    }
+    flush_unit(w, newStream);
+    ctx->inst = w.inst;
+    ctx->data = w.data;
+    ret = gencode_finish(ctx, newBuf, newSize, base->buf, base->size,
+                         deltaStream);
+  }
+
+  for (uint64_t s = 0; s < segments; s++)
+    free(parts[s].buf);
+  free(parts);
+  return ret;
+}
+
+int64_t gencode_parallel(const uint8_t *newBuf, uint64_t newSize,
+                         const gdelta_base *base, uint8_t **deltaBuf,
+                         uint64_t *deltaSize, unsigned threads) {
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  if (ctx == nullptr)
+    return GDELTA_ERR_MEMORY;
+
+  BufferStreamDescriptor deltaStream = {*deltaBuf, 0, *deltaSize};
+  if (deltaStream.buf == nullptr)
+    deltaStream.length = 0;
+  int64_t ret = parallel_run(ctx, newBuf, newSize, base, deltaStream, threads);
+  *deltaSize = deltaStream.cursor;
+  *deltaBuf = deltaStream.buf;
+
+  gdelta_ctx_free(ctx);
+  return ret;
+}
+
+int64_t gencode_ctx_parallel(gdelta_ctx *ctx, const uint8_t *newBuf,
+                             uint64_t newSize, const gdelta_base *base,
+                             const uint8_t **deltaBuf, uint64_t *deltaSize,
+                             unsigned threads) {
+  int64_t ret = parallel_run(ctx, newBuf, newSize, base, ctx->out, threads);
+  *deltaBuf = ctx->out.buf;
+  *deltaSize = ctx->out.cursor;
+  return ret;
+}
+
+// Copies the part of the target in [lo, hi) described by the sorted units
+static void copy_range(const PlacedUnit *units, uint64_t count, uint64_t lo,
+                       uint64_t hi, const uint8_t *deltaBuf,
+                       const uint8_t *baseBuf, uint8_t *out) {
+  // First unit ending after lo
+  uint64_t first = 0, last = count;
+  while (first < last) {
+    uint64_t mid = first + (last - first) / 2;
+    if (units[mid].dst + units[mid].length <= lo)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+
+  for (uint64_t i = first; i < count && units[i].dst < hi; i++) {
+    const PlacedUnit &u = units[i];
+    uint64_t begin = u.dst > lo ? u.dst : lo;
+    uint64_t end = u.dst + u.length < hi ? u.dst + u.length : hi;
+    const uint8_t *src = (u.flag ? baseBuf : deltaBuf) + u.src + (begin - u.dst);
+    memcpy(out + begin, src, end - begin);
+  }
+}
+
+// gdecode_parallel(), entropy-coded deltas are expanded into `plain`
+static int64_t decode_parallel(const uint8_t *deltaBuf, uint64_t deltaSize,
+                               const uint8_t *baseBuf, uint64_t baseSize,
+                               uint8_t **outBuf, uint64_t *outSize,
+                               unsigned threads,
+                               BufferStreamDescriptor &plain) {
+  // The header, when present, is checked before any work is done
+  bool headered = is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER);
+  DeltaHeader header = {};
+  if (headered) {
+    ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+    int ret = read_header(deltaStream, header);
+    if (ret != GDELTA_OK)
+      return ret;
+    if (header.baseSize != baseSize)
+      return GDELTA_ERR_BASE_MISMATCH;
+    // Placed units may overlap in the target, they are applied in order
+    if (header.flags & GDELTA_FLAG_IN_PLACE)
+      return gdecode64(deltaBuf, deltaSize, baseBuf, baseSize, outBuf,
+                       outSize);
+    if (header.flags & GDELTA_FLAG_ENTROPY) {
+      ret = use_expanded(deltaBuf, deltaSize, deltaStream, header, plain);
+      if (ret != GDELTA_OK)
+        return ret;
+    }
+    if ((header.flags & GDELTA_FLAG_CHECKSUM) &&
+        checksum(baseBuf, baseSize) != header.baseChecksum)
+      return GDELTA_ERR_BASE_MISMATCH;
+  }
+
+  // The scan and the copies trust the delta once it has been validated
+  int64_t valid = validate_delta(deltaBuf, deltaSize, baseSize);
+  if (valid < 0)
+    return valid;
+  BufferStreamDescriptor units = {};
+  uint64_t targetSize = scan_units(deltaBuf, deltaSize, units);
+  uint64_t count = units.cursor / sizeof(PlacedUnit);
+  if (units.failed) {
+    free(units.buf);
+    return GDELTA_ERR_MEMORY;
+  }
+
+  // Output is sized once from the pre-scan
+  if (*outBuf == nullptr || *outSize < targetSize) {
+    uint8_t *grown = (uint8_t *)realloc(*outBuf, targetSize ? targetSize : 1);
+    if (grown == nullptr) {
+      free(units.buf);
+      return GDELTA_ERR_MEMORY;
+    }
+    *outBuf = grown;
+  }
+
+  threads = worker_count(threads);
+  if (threads > targetSize / MIN_COPY_SIZE)
+    threads = targetSize / MIN_COPY_SIZE;
+  if (threads == 0)
+    threads = 1;
+
+  const PlacedUnit *placed = (const PlacedUnit *)units.buf;
+  uint64_t rangeSize = (targetSize + threads - 1) / threads;
+  uint8_t *out = *outBuf;
+  auto worker = [&](unsigned t) {
+    uint64_t lo = t * rangeSize;
+    uint64_t hi = lo + rangeSize < targetSize ? lo + rangeSize : targetSize;
+    if (lo < hi)
+      copy_range(placed, count, lo, hi, deltaBuf, baseBuf, out);
+  };
+
+  std::thread *pool = new std::thread[threads - 1];
+  for (unsigned t = 1; t < threads; t++)
+    pool[t - 1] = std::thread(worker, t);
+  worker(0);
+  for (unsigned t = 1; t < threads; t++)
+    pool[t - 1].join();
+  delete[] pool;
+
+  free(units.buf);
+  *outSize = targetSize;
+  // The ranges are written out of order, so the target is hashed afterwards
+  if (headered && (header.flags & GDELTA_FLAG_CHECKSUM) &&
+      checksum(out, targetSize) != header.targetChecksum)
+    return GDELTA_ERR_CHECKSUM;
+  return targetSize;
+}
+
+int64_t gdecode_parallel(const uint8_t *deltaBuf, uint64_t deltaSize,
+                         const uint8_t *baseBuf, uint64_t baseSize,
+                         uint8_t **outBuf, uint64_t *outSize,
+                         unsigned threads) {
+  BufferStreamDescriptor plain = {};
+  int64_t size = decode_parallel(deltaBuf, deltaSize, baseBuf, baseSize,
+                                 outBuf, outSize, threads, plain);
+  free(plain.buf);
+  return size;
+}
+
+/*
+ * Hands out the items of a batch one at a time from a shared cursor, so
+ * threads that draw cheap items simply come back for more. `job` runs one
+ * item with the calling worker's context.
+ */
+template <typename Job>
+static int run_batch(gdelta_batch_item *items, size_t count, unsigned threads,
+                     Job job) {
+  for (size_t i = 0; i < count; i++)
+    items[i].result = GDELTA_ERR_MEMORY; // Until a worker gets to it
+  threads = worker_count(threads);
+  if (threads > count)
+    threads = count ? count : 1;
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    gdelta_ctx *ctx = gdelta_ctx_new();
+    if (ctx == nullptr)
+      return;
+    for (size_t i; (i = next++) < count;)
+      items[i].result = job(ctx, items[i]);
+    gdelta_ctx_free(ctx);
+  };
+
+  std::thread *pool = new std::thread[threads - 1];
+  for (unsigned t = 0; t + 1 < threads; t++)
+    pool[t] = std::thread(worker);
+  worker();
+  for (unsigned t = 0; t + 1 < threads; t++)
+    pool[t].join();
+  delete[] pool;
+
+  for (size_t i = 0; i < count; i++)
+    if (items[i].result < 0)
+      return items[i].result;
+  return GDELTA_OK;
+}
+
+int gencode_batch(gdelta_batch_item *items, size_t count, unsigned threads) {
+  return run_batch(items, count, threads,
+                   [](gdelta_ctx *ctx, gdelta_batch_item &item) -> int64_t {
+    BufferStreamDescriptor deltaStream = {item.out, 0, item.outSize};
+    if (deltaStream.buf == nullptr)
+      deltaStream.length = 0;
+    int64_t ret = gencode_run(ctx, item.in, item.inSize, item.baseBuf,
+                              item.baseSize, item.base, true, deltaStream);
+    item.out = deltaStream.buf;
+    item.outSize = deltaStream.cursor;
+    return ret;
+  });
+}
+
+int gdecode_batch(gdelta_batch_item *items, size_t count, unsigned threads) {
+  return run_batch(items, count, threads,
+                   [](gdelta_ctx *ctx, gdelta_batch_item &item) -> int64_t {
+    // Decoded straight into the item's buffer, grown once to the validated
+    // size; the worker's context only holds the entropy expansion
+    return gdecode_with_scratch(ctx, item.in, item.inSize, item.baseBuf,
+                                item.baseSize, &item.out, &item.outSize);
+  });
+}
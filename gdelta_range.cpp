@@ -0,0 +1,204 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+void write_index(BufferStreamDescriptor &deltaStream, const uint8_t *inst,
+                 uint64_t instSize, uint64_t interval) {
+  // Counted first, the count goes in front of the entries
+  uint64_t count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    ReadOnlyBufferStreamDescriptor instStream = {inst, 0, instSize};
+    DeltaUnitMem unit = {};
+    uint64_t out = 0, literal = 0, next = interval;
+    if (pass == 1) {
+      write_varint(deltaStream, count);
+      if (!ensure_stream_length(deltaStream,
+                                deltaStream.cursor + count * INDEX_ENTRY_SIZE))
+        return;
+    }
+    while (instStream.cursor < instSize) {
+      if (out >= next) {
+        if (pass == 1) {
+          uint8_t *entry = deltaStream.buf + deltaStream.cursor;
+          store_le64(entry, out);
+          store_le64(entry + 8, instStream.cursor);
+          store_le64(entry + 16, literal);
+          deltaStream.cursor += INDEX_ENTRY_SIZE;
+        } else {
+          count++;
+        }
+        next = out + interval;
+      }
+      read_unit(instStream, unit);
+      if (!unit.flag)
+        literal += unit.length;
+      out += unit.length;
+    }
+  }
+}
+
+// The requested target bytes [begin, end) and where they go
+typedef struct {
+  const uint8_t *base;
+  uint64_t baseSize;
+  uint64_t begin;
+  uint64_t end;
+  uint8_t *out;
+} RangeRequest;
+
+// Copies the bytes of a unit for target offsets [pos, pos + length) that
+// fall into the range
+static void clip_unit(const RangeRequest &r, uint64_t pos, const uint8_t *src,
+                      uint64_t length) {
+  if (pos >= r.end)
+    return;
+  uint64_t lo = pos > r.begin ? pos : r.begin;
+  uint64_t hi = length < r.end - pos ? pos + length : r.end;
+  if (lo < hi)
+    memcpy(r.out + (lo - r.begin), src + (lo - pos), hi - lo);
+}
+
+/*
+ * Walks the plain delta at deltaStream.cursor from its unit at `start`
+ * (an index entry: target, instruction and literal offsets, or all 0),
+ * checking each unit and copying what falls into the range. `dst` is the
+ * target offset of the delta's first byte and ends past the last unit
+ * walked. Stops once the range is complete, unless units are placed and
+ * may come in any order; only a complete walk leaves the cursor past the
+ * delta.
+ */
+static bool range_plain(ReadOnlyBufferStreamDescriptor &deltaStream,
+                        const RangeRequest &r, bool inPlace, bool plain,
+                        const uint64_t start[3], uint64_t &dst) {
+  uint64_t instructionLength;
+  if (!read_varint_checked(deltaStream, instructionLength) ||
+      instructionLength > deltaStream.length - deltaStream.cursor)
+    return false;
+  const uint64_t instEnd = deltaStream.cursor + instructionLength;
+  uint64_t literalLeft = deltaStream.length - instEnd;
+  if (start[1] > instructionLength || start[2] > literalLeft)
+    return false;
+  ReadOnlyBufferStreamDescriptor instStream = {
+      deltaStream.buf, deltaStream.cursor + start[1], instEnd};
+  const uint8_t *literal = deltaStream.buf + instEnd + start[2];
+  literalLeft -= start[2];
+  dst += start[0];
+  DeltaUnitMem unit = {};
+
+  while (instStream.cursor < instEnd && (inPlace || dst < r.end)) {
+    if (inPlace && !read_varint_checked(instStream, dst))
+      return false;
+    if (!read_unit_checked(instStream, unit) || bad_empty_unit(unit, plain) ||
+        unit.length > UINT64_MAX - dst)
+      return false;
+    if (unit.flag) {
+      if (unit.offset > r.baseSize || unit.length > r.baseSize - unit.offset)
+        return false;
+      clip_unit(r, dst, r.base + unit.offset, unit.length);
+    } else {
+      if (unit.length > literalLeft)
+        return false;
+      clip_unit(r, dst, literal, unit.length);
+      literal += unit.length;
+      literalLeft -= unit.length;
+    }
+    dst += unit.length;
+  }
+  deltaStream.cursor = literal - deltaStream.buf;
+  return true;
+}
+
+// Last index entry at or before `offset`, left at 0 if there is none
+static void find_entry(const uint8_t *deltaBuf, const DeltaHeader &header,
+                       uint64_t offset, uint64_t entry[3]) {
+  const uint8_t *list = deltaBuf + header.indexList;
+  uint64_t lo = 0, hi = header.indexCount;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (load_le64(list + mid * INDEX_ENTRY_SIZE) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0) {
+    const uint8_t *found = list + (lo - 1) * INDEX_ENTRY_SIZE;
+    entry[0] = load_le64(found);
+    entry[1] = load_le64(found + 8);
+    entry[2] = load_le64(found + 16);
+  }
+}
+
+// gdecode_range(), entropy-coded deltas are expanded into `plain`
+static int64_t decode_range(const uint8_t *deltaBuf, uint64_t deltaSize,
+                            const uint8_t *baseBuf, uint64_t baseSize,
+                            uint64_t offset, uint64_t length, uint8_t *outBuf,
+                            BufferStreamDescriptor &plain) {
+  ReadOnlyBufferStreamDescriptor deltaStream = {deltaBuf, 0, deltaSize};
+  RangeRequest r = {baseBuf, baseSize, offset,
+                    length < UINT64_MAX - offset ? offset + length : UINT64_MAX,
+                    outBuf};
+  const uint64_t start[3] = {0, 0, 0};
+  uint64_t dst = 0;
+
+  DeltaHeader header;
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_HEADER)) {
+    int ret = read_header(deltaStream, header);
+    if (ret != GDELTA_OK)
+      return ret;
+    if (header.baseSize != baseSize)
+      return GDELTA_ERR_BASE_MISMATCH;
+    if (header.flags & GDELTA_FLAG_ENTROPY) {
+      ret = use_expanded(deltaBuf, deltaSize, deltaStream, header, plain);
+      if (ret != GDELTA_OK)
+        return ret;
+    }
+    if (offset >= header.targetSize)
+      return 0;
+    if (r.end > header.targetSize)
+      r.end = header.targetSize;
+
+    // Placed units are walked in full, they may come in any order
+    bool inPlace = header.flags & GDELTA_FLAG_IN_PLACE;
+    uint64_t entry[3] = {0, 0, 0};
+    if (!inPlace)
+      find_entry(deltaBuf, header, offset, entry);
+    else // bytes no unit covers are 0, as in decode_placed
+      memset(outBuf, 0, r.end - r.begin);
+    if (!range_plain(deltaStream, r, inPlace, false, entry, dst) ||
+        (!inPlace && dst < r.end))
+      return GDELTA_ERR_CORRUPT;
+    return r.end - r.begin;
+  }
+
+  // Framed and plain deltas are walked from the start
+  if (is_container(deltaBuf, deltaSize, GDELTA_FORMAT_FRAMED)) {
+    deltaStream.cursor = CONTAINER_PREFIX_SIZE;
+    uint64_t window;
+    while (dst < r.end) {
+      if (!read_varint_checked(deltaStream, window))
+        return GDELTA_ERR_CORRUPT;
+      if (window == 0)
+        break;
+      if (!range_plain(deltaStream, r, false, false, start, dst))
+        return GDELTA_ERR_CORRUPT;
+    }
+  } else if (!range_plain(deltaStream, r, false, true, start, dst)) {
+    return GDELTA_ERR_CORRUPT;
+  }
+  if (dst <= offset)
+    return 0;
+  return (dst < r.end ? dst : r.end) - offset;
+}
+
+int64_t gdecode_range(const uint8_t *deltaBuf, uint64_t deltaSize,
+                      const uint8_t *baseBuf, uint64_t baseSize,
+                      uint64_t offset, uint64_t length, uint8_t *outBuf) {
+  BufferStreamDescriptor plain = {};
+  int64_t size = decode_range(deltaBuf, deltaSize, baseBuf, baseSize, offset,
+                              length, outBuf, plain);
+  free(plain.buf);
+  return size;
+}
@@ -0,0 +1,456 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "gdelta_internal.h"
+#include "gdelta.h"
+
+// Worst case size of one encoded unit (head + two 64-bit varints)
+#define MAX_UNIT_SIZE 21
+#define DEFAULT_WINDOW_SIZE (8 * 1024 * 1024)
+
+enum DecoderState {
+  DECODE_PREFIX,       // telling plain deltas from containers
+  DECODE_HEADER,       // fields of the versioned header
+  DECODE_WINDOW,       // varint with the target size of the next frame
+  DECODE_LENGTH,       // varint with the instruction section size
+  DECODE_INSTRUCTIONS, // buffering the instruction section
+  DECODE_UNITS,        // executing units, literals come from the input
+  DECODE_DONE
+};
+
+/*
+ * Push-based decoder state. The format stores all literal data after the
+ * instructions, so the instruction section (of the current frame) is
+ * buffered; everything else is passed straight from the input/base to the
+ * caller's output chunks.
+ */
+struct gdelta_decoder {
+  const uint8_t *base;
+  uint64_t baseSize;
+  DecoderState state;
+  bool framed;
+  bool headered;
+  uint8_t prefix[CONTAINER_PREFIX_SIZE];
+  uint8_t prefixLength;
+  uint8_t headerField; // header fields read so far
+  uint8_t flags;       // header flags
+  uint64_t target;     // target size from the header
+  uint64_t bases;      // base sizes still to read (multi-base header)
+  uint64_t baseTotal;  // sum of the base sizes read so far
+  uint8_t checksums[2 * sizeof(uint64_t)]; // base and target, if flagged
+  uint8_t checksumBytes;
+  uint64_t indexBytes; // of the index still to skip
+  ChecksumState sum;   // of the output produced so far
+  uint64_t varint; // varint being read
+  uint8_t shift;   // bits of `varint` read so far
+  uint64_t window; // target bytes the current frame must produce
+  uint64_t produced;
+  uint64_t instLength;
+  BufferStreamDescriptor inst;
+  DeltaUnitMem unit; // unit being executed
+  uint64_t remaining; // bytes of `unit` not yet produced
+};
+
+gdelta_decoder *gdelta_decoder_new(const uint8_t *baseBuf, uint64_t baseSize) {
+  gdelta_decoder *dec = (gdelta_decoder *)calloc(1, sizeof(gdelta_decoder));
+  if (dec == nullptr)
+    return nullptr;
+  dec->base = baseBuf;
+  dec->baseSize = baseSize;
+  dec->state = DECODE_PREFIX;
+  return dec;
+}
+
+void gdelta_decoder_free(gdelta_decoder *dec) {
+  if (dec == nullptr)
+    return;
+  free(dec->inst.buf);
+  free(dec);
+}
+
+// Adds one byte to the varint being read, true once it is complete
+static bool push_varint_byte(gdelta_decoder *dec, uint8_t byte, int &ret) {
+  VarIntPart vi;
+  memcpy(&vi, &byte, sizeof(vi));
+  if (dec->shift >= 64) {
+    ret = GDELTA_ERR_CORRUPT;
+    return false;
+  }
+  dec->varint |= (uint64_t)vi.subint << dec->shift;
+  dec->shift += VarIntPart::lenbits;
+  if (vi.more)
+    return false;
+
+  dec->shift = 0;
+  return true;
+}
+
+// Length byte of a plain delta; the instruction buffer is only grown as the
+// instruction bytes arrive, so a corrupt length costs no memory up front
+static void push_length_byte(gdelta_decoder *dec, uint8_t byte, int &ret) {
+  if (!push_varint_byte(dec, byte, ret))
+    return;
+
+  dec->instLength = dec->varint;
+  dec->varint = 0;
+  if (dec->instLength > UINT64_MAX - MAX_UNIT_SIZE) {
+    ret = GDELTA_ERR_CORRUPT;
+    return;
+  }
+  dec->inst.cursor = 0;
+  dec->produced = 0;
+  dec->state = DECODE_INSTRUCTIONS;
+}
+
+// Classifies the stream once enough of its first bytes have been seen
+static void push_prefix_byte(gdelta_decoder *dec, uint8_t byte, int &ret) {
+  dec->prefix[dec->prefixLength++] = byte;
+  uint8_t n = dec->prefixLength;
+  if (n <= sizeof(GDELTA_MAGIC) && byte == GDELTA_MAGIC[n - 1])
+    return;
+
+  if (n == CONTAINER_PREFIX_SIZE && byte == GDELTA_FORMAT_FRAMED) {
+    dec->framed = true;
+    dec->state = DECODE_WINDOW;
+  } else if (n == CONTAINER_PREFIX_SIZE && byte == GDELTA_FORMAT_HEADER) {
+    dec->headered = true;
+    dec->state = DECODE_HEADER;
+  } else if (n <= 2) {
+    // Not a container, the bytes start the instruction length
+    dec->state = DECODE_LENGTH;
+    for (uint8_t i = 0; i < n && ret == GDELTA_OK; i++)
+      push_length_byte(dec, dec->prefix[i], ret);
+  } else {
+    ret = GDELTA_ERR_CORRUPT; // Unknown container format
+  }
+}
+
+// After the checksums: on to the index if there is one, else the delta
+static void end_checksum_fields(gdelta_decoder *dec) {
+  if (dec->flags & GDELTA_FLAG_INDEX)
+    dec->headerField = 7;
+  else
+    dec->state = DECODE_LENGTH;
+}
+
+// After the base fields: on to the checksums if there are any
+static void end_base_fields(gdelta_decoder *dec) {
+  if (dec->flags & GDELTA_FLAG_CHECKSUM)
+    dec->headerField = 6;
+  else
+    end_checksum_fields(dec);
+}
+
+// Version, flags, target size, base size, the sizes of multiple bases
+// (which then make up the base as concatenated), the checksums and the
+// index, which is skipped; the delta follows
+static void push_header_byte(gdelta_decoder *dec, uint8_t byte, int &ret) {
+  switch (dec->headerField) {
+  case 0:
+    if (byte != GDELTA_VERSION)
+      ret = GDELTA_ERR_UNSUPPORTED;
+    break;
+  case 1:
+    // Entropy-coded sections cannot be decoded in bounded memory, nor placed
+    // units that write the target out of order
+    if (byte & (~GDELTA_KNOWN_FLAGS | GDELTA_FLAG_ENTROPY | GDELTA_FLAG_IN_PLACE))
+      ret = GDELTA_ERR_UNSUPPORTED;
+    dec->flags = byte;
+    break;
+  case 2:
+    if (!push_varint_byte(dec, byte, ret))
+      return;
+    dec->target = dec->varint;
+    dec->varint = 0;
+    break;
+  case 3:
+    if (!push_varint_byte(dec, byte, ret))
+      return;
+    if (dec->varint != dec->baseSize)
+      ret = GDELTA_ERR_BASE_MISMATCH;
+    dec->varint = 0;
+    if (!(dec->flags & GDELTA_FLAG_MULTI_BASE))
+      end_base_fields(dec);
+    break;
+  case 4:
+    if (!push_varint_byte(dec, byte, ret))
+      return;
+    dec->bases = dec->varint;
+    dec->varint = 0;
+    break;
+  case 5: // One size per base, stays on this field
+    if (!push_varint_byte(dec, byte, ret))
+      return;
+    if (dec->varint > dec->baseSize - dec->baseTotal)
+      ret = GDELTA_ERR_CORRUPT;
+    dec->baseTotal += dec->varint;
+    dec->varint = 0;
+    dec->bases--;
+    break;
+  case 6: // Checksums, the base is checked as soon as they are complete
+    dec->checksums[dec->checksumBytes++] = byte;
+    if (dec->checksumBytes < sizeof(dec->checksums))
+      return;
+    if (checksum(dec->base, dec->baseSize) != load_le64(dec->checksums))
+      ret = GDELTA_ERR_BASE_MISMATCH;
+    checksum_init(dec->sum);
+    end_checksum_fields(dec);
+    return;
+  case 7: // Index entry count
+    if (!push_varint_byte(dec, byte, ret))
+      return;
+    if (dec->varint > UINT64_MAX / INDEX_ENTRY_SIZE)
+      ret = GDELTA_ERR_CORRUPT;
+    dec->indexBytes = dec->varint * INDEX_ENTRY_SIZE;
+    dec->varint = 0;
+    if (dec->indexBytes == 0)
+      dec->state = DECODE_LENGTH;
+    else
+      dec->headerField = 8;
+    return;
+  default: // Index entries
+    if (--dec->indexBytes == 0)
+      dec->state = DECODE_LENGTH;
+    return;
+  }
+  if (dec->headerField < 5)
+    dec->headerField++;
+  if (dec->headerField == 5 && dec->bases == 0) {
+    if (dec->baseTotal != dec->baseSize)
+      ret = GDELTA_ERR_CORRUPT;
+    end_base_fields(dec);
+  }
+}
+
+int gdelta_decoder_decode(gdelta_decoder *dec, const uint8_t *in,
+                          uint64_t inSize, uint64_t *inConsumed, uint8_t *out,
+                          uint64_t outSize, uint64_t *outProduced) {
+  uint64_t inPos = 0, outPos = 0;
+  int ret = GDELTA_OK;
+  bool stalled = false;
+
+  while (!stalled && ret == GDELTA_OK) {
+    switch (dec->state) {
+    case DECODE_PREFIX:
+    case DECODE_HEADER:
+    case DECODE_WINDOW:
+    case DECODE_LENGTH: {
+      if (inPos == inSize) {
+        stalled = true;
+        break;
+      }
+      uint8_t byte = in[inPos++];
+      if (dec->state == DECODE_PREFIX) {
+        push_prefix_byte(dec, byte, ret);
+      } else if (dec->state == DECODE_HEADER) {
+        push_header_byte(dec, byte, ret);
+      } else if (dec->state == DECODE_LENGTH) {
+        push_length_byte(dec, byte, ret);
+      } else if (push_varint_byte(dec, byte, ret)) {
+        dec->window = dec->varint;
+        dec->varint = 0;
+        dec->state = dec->window ? DECODE_LENGTH : DECODE_DONE;
+      }
+      break;
+    }
+    case DECODE_INSTRUCTIONS: {
+      uint64_t take = dec->instLength - dec->inst.cursor;
+      if (take > inSize - inPos)
+        take = inSize - inPos;
+      if (!ensure_stream_length(dec->inst,
+                                dec->inst.cursor + take + MAX_UNIT_SIZE)) {
+        ret = GDELTA_ERR_MEMORY;
+        break;
+      }
+      memcpy(dec->inst.buf + dec->inst.cursor, in + inPos, take);
+      dec->inst.cursor += take;
+      inPos += take;
+      if (dec->inst.cursor < dec->instLength) {
+        stalled = true;
+        break;
+      }
+      // Zeroed slack so a truncated unit is caught after parsing it
+      memset(dec->inst.buf + dec->instLength, 0, MAX_UNIT_SIZE);
+      dec->inst.cursor = 0;
+      dec->state = DECODE_UNITS;
+      break;
+    }
+    case DECODE_UNITS: {
+      DeltaUnitMem &unit = dec->unit;
+      if (dec->remaining == 0) {
+        if (dec->inst.cursor >= dec->instLength) {
+          if (!dec->framed) {
+            if (dec->headered && dec->produced != dec->target)
+              ret = GDELTA_ERR_CORRUPT;
+            else if ((dec->flags & GDELTA_FLAG_CHECKSUM) &&
+                     checksum_final(dec->sum) !=
+                         load_le64(dec->checksums + sizeof(uint64_t)))
+              ret = GDELTA_ERR_CHECKSUM;
+            else
+              dec->state = DECODE_DONE;
+          } else if (dec->produced != dec->window) {
+            ret = GDELTA_ERR_CORRUPT;
+          } else {
+            dec->state = DECODE_WINDOW;
+          }
+          break;
+        }
+        read_unit(dec->inst, unit);
+        if (dec->inst.cursor > dec->instLength ||
+            bad_empty_unit(unit, !dec->framed && !dec->headered) ||
+            (unit.flag && (unit.offset > dec->baseSize ||
+                           unit.length > dec->baseSize - unit.offset))) {
+          ret = GDELTA_ERR_CORRUPT;
+          break;
+        }
+        dec->remaining = unit.length;
+        break;
+      }
+
+      uint64_t n = outSize - outPos;
+      if (n > dec->remaining)
+        n = dec->remaining;
+      if (unit.flag) { // Copy from base, resuming inside the unit
+        memcpy(out + outPos, dec->base + unit.offset + unit.length - dec->remaining, n);
+      } else {        // Literal from the input
+        if (n > inSize - inPos)
+          n = inSize - inPos;
+        memcpy(out + outPos, in + inPos, n);
+        inPos += n;
+      }
+      if (n == 0) {
+        stalled = true;
+        break;
+      }
+      if (dec->flags & GDELTA_FLAG_CHECKSUM)
+        checksum_update(dec->sum, out + outPos, n);
+      outPos += n;
+      dec->produced += n;
+      dec->remaining -= n;
+      break;
+    }
+    case DECODE_DONE:
+      ret = GDELTA_STREAM_END;
+      break;
+    }
+  }
+
+  *inConsumed = inPos;
+  *outProduced = outPos;
+  return ret;
+}
+
+/*
+ * Windowed encoder producing a framed stream: every window of the target is
+ * encoded against the prepared base on its own and emitted as soon as it is
+ * complete, so memory stays bounded by the window size.
+ */
+struct gdelta_encoder {
+  const gdelta_base *base;
+  gdelta_ctx *ctx;
+  uint64_t windowSize;
+  BufferStreamDescriptor window; // target bytes not yet encoded
+  BufferStreamDescriptor out;    // output of the last call
+  bool started;
+};
+
+gdelta_encoder *gdelta_encoder_new(const gdelta_base *base,
+                                   uint64_t windowSize) {
+  gdelta_encoder *enc = (gdelta_encoder *)calloc(1, sizeof(gdelta_encoder));
+  if (enc == nullptr)
+    return nullptr;
+  enc->ctx = gdelta_ctx_new();
+  if (enc->ctx == nullptr) {
+    free(enc);
+    return nullptr;
+  }
+  enc->base = base;
+  enc->windowSize = windowSize ? windowSize : DEFAULT_WINDOW_SIZE;
+  return enc;
+}
+
+void gdelta_encoder_free(gdelta_encoder *enc) {
+  if (enc == nullptr)
+    return;
+  gdelta_ctx_free(enc->ctx);
+  free(enc->window.buf);
+  free(enc->out.buf);
+  free(enc);
+}
+
+// Appends one frame holding the delta of `size` target bytes
+static int encode_frame(gdelta_encoder *enc, const uint8_t *buf,
+                        uint64_t size) {
+  write_varint(enc->out, size);
+  int64_t ret = gencode_run(enc->ctx, buf, size, enc->base->buf,
+                            enc->base->size, enc->base, false, enc->out);
+  return ret < 0 ? (int)ret : GDELTA_OK;
+}
+
+// Rewinds the output, starting it with the stream prefix on first use
+static void begin_output(gdelta_encoder *enc) {
+  enc->out.cursor = 0;
+  enc->out.failed = false;
+  if (!enc->started) {
+    write_container_prefix(enc->out, GDELTA_FORMAT_FRAMED);
+    enc->started = true;
+  }
+}
+
+int gdelta_encoder_encode(gdelta_encoder *enc, const uint8_t *in,
+                          uint64_t inSize, const uint8_t **out,
+                          uint64_t *outSize) {
+  int ret = GDELTA_OK;
+  begin_output(enc);
+
+  while (inSize > 0 && ret == GDELTA_OK) {
+    if (enc->window.cursor == 0 && inSize >= enc->windowSize) {
+      // Whole window available in the input, no need to buffer it
+      ret = encode_frame(enc, in, enc->windowSize);
+      in += enc->windowSize;
+      inSize -= enc->windowSize;
+      continue;
+    }
+
+    uint64_t take = enc->windowSize - enc->window.cursor;
+    if (take > inSize)
+      take = inSize;
+    ReadOnlyBufferStreamDescriptor inStream = {in, 0, inSize};
+    stream_into(enc->window, inStream, take);
+    if (enc->window.failed) {
+      ret = GDELTA_ERR_MEMORY;
+      break;
+    }
+    in += take;
+    inSize -= take;
+    if (enc->window.cursor == enc->windowSize) {
+      ret = encode_frame(enc, enc->window.buf, enc->window.cursor);
+      enc->window.cursor = 0;
+    }
+  }
+
+  if (enc->out.failed)
+    ret = GDELTA_ERR_MEMORY;
+  *out = enc->out.buf;
+  *outSize = enc->out.cursor;
+  return ret;
+}
+
+int gdelta_encoder_finish(gdelta_encoder *enc, const uint8_t **out,
+                          uint64_t *outSize) {
+  int ret = GDELTA_OK;
+  begin_output(enc);
+
+  if (enc->window.cursor > 0) {
+    ret = encode_frame(enc, enc->window.buf, enc->window.cursor);
+    enc->window.cursor = 0;
+  }
+  write_varint(enc->out, 0); // End of stream
+  if (enc->out.failed)
+    ret = GDELTA_ERR_MEMORY;
+
+  *out = enc->out.buf;
+  *outSize = enc->out.cursor;
+  return ret;
+}
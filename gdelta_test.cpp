@@ -0,0 +1,1524 @@
+//
+// Regression tests: round trips through every encoder and decoder over
+// synthetic bases and targets, then truncated and mutated deltas that every
+// decoder must reject or agree on. Exits non-zero if any check fails; build
+// with CMAKE_BUILD_TYPE=Sanitize to run them under ASan and UBSan.
+//
+
+#include "gdelta.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#ifdef _MSC_VER
+#include <compat/msvc.h>
+#include <compat/getopt.h>
+#else
+#include <unistd.h>
+#endif
+
+#define DEFAULT_SEED 1
+#define DEFAULT_MUTATIONS 300
+// Output after which the push-based decoder is stopped, corrupt deltas may
+// declare any target size
+#define STREAM_LIMIT (16 * 1024 * 1024)
+
+typedef std::vector<uint8_t> Buffer;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// splitmix64
+typedef struct {
+  uint64_t state;
+} Rng;
+
+static uint64_t next(Rng &rng) {
+  uint64_t z = (rng.state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t below(Rng &rng, uint64_t bound) {
+  return bound ? next(rng) % bound : 0;
+}
+
+static Buffer random_bytes(Rng &rng, uint64_t size) {
+  Buffer buf(size);
+  for (uint64_t i = 0; i < size; i++)
+    buf[i] = next(rng);
+  return buf;
+}
+
+// Scattered overwrites, inserts and deletes of short runs
+static Buffer with_edits(Rng &rng, const Buffer &base, unsigned edits) {
+  Buffer target = base;
+  for (unsigned e = 0; e < edits; e++) {
+    uint64_t pos = below(rng, target.size() + 1);
+    uint64_t length = 1 + below(rng, 300);
+    switch (below(rng, 3)) {
+    case 0:
+      for (uint64_t i = pos; i < pos + length && i < target.size(); i++)
+        target[i] = next(rng);
+      break;
+    case 1: {
+      Buffer run = random_bytes(rng, length);
+      target.insert(target.begin() + pos, run.begin(), run.end());
+      break;
+    }
+    default:
+      target.erase(target.begin() + pos,
+                   target.begin() + std::min<uint64_t>(target.size(), pos + length));
+      break;
+    }
+  }
+  return target;
+}
+
+static bool same(const uint8_t *buf, uint64_t size, const Buffer &expected) {
+  return size == expected.size() &&
+         (size == 0 || memcmp(buf, expected.data(), size) == 0);
+}
+
+// Targets derived from `base`: itself, edited, unrelated and empty
+static std::vector<Buffer> targets_for(Rng &rng, const Buffer &base) {
+  uint64_t size = base.size();
+  return {base, with_edits(rng, base, 1 + size / 2000),
+          random_bytes(rng, below(rng, size + 1)), Buffer()};
+}
+
+static const uint64_t sizes[] = {0, 1, 100, 5000, 70000, 300000};
+
+static Buffer encode(const Buffer &target, const Buffer &base) {
+  uint8_t *delta = nullptr;
+  uint64_t deltaSize = 0;
+  int64_t ret = gencode64(target.data(), target.size(), base.data(),
+                          base.size(), &delta, &deltaSize);
+  CHECK(ret >= 0 && (uint64_t)ret == deltaSize);
+  Buffer out(delta, delta + (ret >= 0 ? deltaSize : 0));
+
+  // The 32-bit call writes the same delta
+  uint32_t narrowSize = 0;
+  CHECK(gencode(target.data(), target.size(), base.data(), base.size(),
+                &delta, &narrowSize) == (int)out.size());
+  CHECK(same(delta, narrowSize, out));
+  free(delta);
+  return out;
+}
+
+// Context parameters as (param, value) pairs
+typedef std::vector<std::pair<int, int64_t>> Params;
+
+static Buffer encode(const Buffer &target, const Buffer &base,
+                     const Params &params) {
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  for (const auto &param : params)
+    CHECK(gdelta_ctx_set_param(ctx, param.first, param.second) == GDELTA_OK);
+  const uint8_t *delta;
+  uint64_t deltaSize;
+  int64_t ret = gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                            base.size(), &delta, &deltaSize);
+  CHECK(ret >= 0 && (uint64_t)ret == deltaSize);
+  Buffer out(delta, delta + (ret >= 0 ? deltaSize : 0));
+  gdelta_ctx_free(ctx);
+  return out;
+}
+
+// Framed stream from the windowed encoder, the target pushed in uneven pieces
+static Buffer encode_framed(Rng &rng, const Buffer &target,
+                            const gdelta_base *base, uint64_t windowSize) {
+  gdelta_encoder *enc = gdelta_encoder_new(base, windowSize);
+  Buffer delta;
+  const uint8_t *out;
+  uint64_t outSize;
+  for (uint64_t pos = 0; pos < target.size();) {
+    uint64_t n = std::min<uint64_t>(target.size() - pos, 1 + below(rng, 3 * windowSize));
+    CHECK(gdelta_encoder_encode(enc, target.data() + pos, n, &out, &outSize) == GDELTA_OK);
+    delta.insert(delta.end(), out, out + outSize);
+    pos += n;
+  }
+  CHECK(gdelta_encoder_finish(enc, &out, &outSize) == GDELTA_OK);
+  delta.insert(delta.end(), out, out + outSize);
+  gdelta_encoder_free(enc);
+  return delta;
+}
+
+// Plain delta, the format of older versions, from a headered one written
+// without options: the prefix, version, flags and both size varints go
+static Buffer strip_header(const Buffer &delta) {
+  uint64_t pos = 6;
+  for (int field = 0; field < 2; field++)
+    while (delta[pos++] & 1) // varint `more` bit
+      ;
+  return Buffer(delta.begin() + pos, delta.end());
+}
+
+// Push-based decode with input and output in pieces of random size; stops
+// when the decoder needs input that will not come or past STREAM_LIMIT bytes
+static int decode_streaming(Rng &rng, const uint8_t *delta, uint64_t deltaSize,
+                            const Buffer &base, Buffer &out) {
+  gdelta_decoder *dec = gdelta_decoder_new(base.data(), base.size());
+  uint8_t chunk[4096];
+  uint64_t inPos = 0;
+  int ret = GDELTA_OK;
+  out.clear();
+  while (ret == GDELTA_OK && out.size() <= STREAM_LIMIT) {
+    uint64_t inSize = std::min<uint64_t>(deltaSize - inPos, 1 + below(rng, 256));
+    uint64_t consumed, produced;
+    ret = gdelta_decoder_decode(dec, delta + inPos, inSize, &consumed, chunk,
+                                1 + below(rng, sizeof(chunk)), &produced);
+    inPos += consumed;
+    out.insert(out.end(), chunk, chunk + produced);
+    if (consumed == 0 && produced == 0 && inPos == deltaSize)
+      break;
+  }
+  gdelta_decoder_free(dec);
+  return ret;
+}
+
+// Flags byte of a headered delta, 0 for other formats
+static uint8_t header_flags(const uint8_t *delta, uint64_t deltaSize) {
+  if (deltaSize > 5 && delta[0] == 'G' && delta[1] == 0 && delta[2] == 'D' &&
+      delta[3] == 'H')
+    return delta[5];
+  return 0;
+}
+
+static bool is_entropy_coded(const Buffer &delta) {
+  return header_flags(delta.data(), delta.size()) & 2;
+}
+
+// gdecode_range() into an exact-size buffer that starts out dirty, so that
+// bytes it skips show up
+static int64_t decode_range(const uint8_t *delta, uint64_t deltaSize,
+                            const Buffer &base, uint64_t offset,
+                            uint64_t length, uint64_t room, Buffer &out) {
+  uint8_t *buf = (uint8_t *)malloc(room ? room : 1);
+  memset(buf, 0xAA, room);
+  int64_t ret = gdecode_range(delta, deltaSize, base.data(), base.size(),
+                              offset, length, buf);
+  out.assign(buf, buf + (ret >= 0 && (uint64_t)ret <= room ? ret : 0));
+  free(buf);
+  return ret;
+}
+
+// Ranges at the edges and at random, compared with the full target
+static void check_ranges(Rng &rng, const Buffer &delta, const Buffer &base,
+                         const Buffer &target) {
+  uint64_t size = target.size();
+  for (int i = 0; i < 8; i++) {
+    uint64_t offset, length;
+    switch (i) {
+    case 0:
+      offset = 0, length = size;
+      break;
+    case 1:
+      offset = 0, length = UINT64_MAX;
+      break;
+    case 2:
+      offset = size, length = 10;
+      break;
+    case 3:
+      offset = size + 1 + below(rng, 100), length = 1;
+      break;
+    case 4:
+      offset = below(rng, size + 1), length = 0;
+      break;
+    case 5:
+      offset = below(rng, size + 1), length = size + 100;
+      break;
+    default:
+      offset = below(rng, size + 1), length = below(rng, size - offset + 1);
+      break;
+    }
+    uint64_t expected = offset < size ? std::min(length, size - offset) : 0;
+    Buffer out;
+    CHECK(decode_range(delta.data(), delta.size(), base, offset, length,
+                       expected, out) == (int64_t)expected);
+    CHECK(expected == 0 ||
+          memcmp(out.data(), target.data() + offset, expected) == 0);
+  }
+  if (header_flags(delta.data(), delta.size()) && !base.empty()) {
+    Buffer out, shorter(base.begin(), base.end() - 1);
+    CHECK(decode_range(delta.data(), delta.size(), shorter, 0, 1, 1, out) ==
+          GDELTA_ERR_BASE_MISMATCH);
+  }
+}
+
+// Every decoder must rebuild `target` from a valid delta; the push-based
+// decoder rejects entropy-coded and in-place ones
+static void check_decoders(Rng &rng, const Buffer &delta, const Buffer &base,
+                           const Buffer &target) {
+  uint8_t *out = nullptr;
+  uint32_t outSize = 0;
+  CHECK(gdecode(delta.data(), delta.size(), base.data(), base.size(), &out,
+                &outSize) == (int)target.size());
+  CHECK(same(out, outSize, target));
+  free(out);
+
+  out = nullptr;
+  uint64_t outSize64 = 0;
+  CHECK(gdecode64(delta.data(), delta.size(), base.data(), base.size(), &out,
+                  &outSize64) == (int64_t)target.size());
+  CHECK(same(out, outSize64, target));
+  free(out);
+
+  // A caller buffer that is too small is grown
+  out = (uint8_t *)malloc(1);
+  outSize64 = 1;
+  CHECK(gdecode64(delta.data(), delta.size(), base.data(), base.size(), &out,
+                  &outSize64) == (int64_t)target.size());
+  CHECK(same(out, outSize64, target));
+  free(out);
+
+  CHECK(gdecode_size(delta.data(), delta.size()) == (int64_t)target.size());
+
+  Buffer into(target.size() + 1);
+  CHECK(gdecode_into(delta.data(), delta.size(), base.data(), base.size(),
+                     into.data(), target.size()) == (int64_t)target.size());
+  CHECK(same(into.data(), target.size(), target));
+  if (!target.empty())
+    CHECK(gdecode_into(delta.data(), delta.size(), base.data(), base.size(),
+                       into.data(), target.size() - 1) == GDELTA_ERR_BUFFER);
+
+  check_ranges(rng, delta, base, target);
+
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  const uint8_t *ctxOut;
+  uint64_t ctxOutSize;
+  CHECK(gdecode_ctx(ctx, delta.data(), delta.size(), base.data(), base.size(),
+                    &ctxOut, &ctxOutSize) == (int64_t)target.size());
+  CHECK(same(ctxOut, ctxOutSize, target));
+  gdelta_ctx_free(ctx);
+
+  const unsigned threads[] = {1, 2, 8};
+  for (unsigned n : threads) {
+    out = nullptr;
+    outSize64 = 0;
+    CHECK(gdecode_parallel(delta.data(), delta.size(), base.data(),
+                           base.size(), &out, &outSize64, n) ==
+          (int64_t)target.size());
+    CHECK(same(out, outSize64, target));
+    free(out);
+  }
+
+  Buffer streamed;
+  if (header_flags(delta.data(), delta.size()) & (2 | 8)) {
+    CHECK(decode_streaming(rng, delta.data(), delta.size(), base, streamed) ==
+          GDELTA_ERR_UNSUPPORTED);
+  } else {
+    CHECK(decode_streaming(rng, delta.data(), delta.size(), base, streamed) ==
+          GDELTA_STREAM_END);
+    CHECK(streamed == target);
+  }
+}
+
+static void test_round_trips(Rng &rng) {
+  // One context serves every call, its output matches the one-shot calls'
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    // One prepared index serves every target
+    gdelta_base *prepared = gdelta_base_prepare(base.data(), base.size());
+    for (const Buffer &target : targets_for(rng, base)) {
+      Buffer delta = encode(target, base);
+      check_decoders(rng, delta, base, target);
+      const uint8_t *ctxOut;
+      uint64_t ctxOutSize;
+      CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                        base.size(), &ctxOut, &ctxOutSize) >= 0);
+      CHECK(same(ctxOut, ctxOutSize, delta));
+
+      uint8_t *out = nullptr;
+      uint64_t outSize = 0;
+      CHECK(gencode_with_base(target.data(), target.size(), prepared, &out,
+                              &outSize) >= 0);
+      check_decoders(rng, Buffer(out, out + outSize), base, target);
+      CHECK(gencode_ctx_with_base(ctx, target.data(), target.size(), prepared,
+                                  &ctxOut, &ctxOutSize) >= 0);
+      CHECK(same(ctxOut, ctxOutSize, Buffer(out, out + outSize)));
+      CHECK(gencode_parallel(target.data(), target.size(), prepared, &out,
+                             &outSize, 2) >= 0);
+      check_decoders(rng, Buffer(out, out + outSize), base, target);
+      check_decoders(rng, encode_framed(rng, target, prepared, 1 + below(rng, 20000)),
+                     base, target);
+
+      // Output of the previous call is only valid until this one
+      CHECK(gdecode_ctx(ctx, out, outSize, base.data(), base.size(), &ctxOut,
+                        &ctxOutSize) == (int64_t)target.size());
+      free(out);
+      CHECK(same(ctxOut, ctxOutSize, target));
+    }
+    gdelta_base_free(prepared);
+    gdelta_ctx_reset(ctx);
+  }
+  gdelta_ctx_free(ctx);
+}
+
+static void test_params(Rng &rng) {
+  const int64_t accelerations[] = {0, 1, 4, 64, GDELTA_MAX_ACCELERATION};
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    for (const Buffer &target : targets_for(rng, base)) {
+      for (int64_t acceleration : accelerations)
+        check_decoders(rng,
+                       encode(target, base,
+                              {{GDELTA_PARAM_ACCELERATION, acceleration}}),
+                       base, target);
+
+      for (int level = GDELTA_MIN_LEVEL; level <= GDELTA_MAX_LEVEL; level++) {
+        check_decoders(rng, encode(target, base, {{GDELTA_PARAM_LEVEL, level}}),
+                       base, target);
+        gdelta_base *prepared =
+            gdelta_base_prepare_level(base.data(), base.size(), level);
+        gdelta_ctx *ctx = gdelta_ctx_new();
+        CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_LEVEL, level) == GDELTA_OK);
+        const uint8_t *delta;
+        uint64_t deltaSize;
+        CHECK(gencode_ctx_with_base(ctx, target.data(), target.size(),
+                                    prepared, &delta, &deltaSize) >= 0);
+        check_decoders(rng, Buffer(delta, delta + deltaSize), base, target);
+        gdelta_ctx_free(ctx);
+        gdelta_base_free(prepared);
+      }
+
+      check_decoders(rng, encode(target, base, {{GDELTA_PARAM_ENTROPY, 1}}),
+                     base, target);
+      check_decoders(rng,
+                     encode(target, base,
+                            {{GDELTA_PARAM_ENTROPY, 1}, {GDELTA_PARAM_LEVEL, 3}}),
+                     base, target);
+      check_decoders(rng, encode(target, base, {{GDELTA_PARAM_CHECKSUM, 1}}),
+                     base, target);
+      check_decoders(rng,
+                     encode(target, base,
+                            {{GDELTA_PARAM_CHECKSUM, 1},
+                             {GDELTA_PARAM_ENTROPY, 1}}),
+                     base, target);
+    }
+  }
+
+  // Acceleration is opt-in: by default short matches after long runs of
+  // misses are still found
+  Buffer base = random_bytes(rng, 1 << 20), target;
+  for (int i = 0; i < 20; i++) {
+    Buffer run = random_bytes(rng, 5000);
+    uint64_t pos = below(rng, base.size() - 64), length = 16 + below(rng, 48);
+    target.insert(target.end(), run.begin(), run.end());
+    target.insert(target.end(), base.begin() + pos, base.begin() + pos + length);
+  }
+  Buffer expected = encode(target, base, {{GDELTA_PARAM_ACCELERATION, 0}});
+  CHECK(encode(target, base) == expected);
+  CHECK(encode(target, base, {}) == expected);
+
+  Buffer any(16);
+  CHECK(gdelta_base_prepare_level(any.data(), any.size(), GDELTA_MIN_LEVEL - 1) == nullptr);
+  CHECK(gdelta_base_prepare_level(any.data(), any.size(), GDELTA_MAX_LEVEL + 1) == nullptr);
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_LEVEL, GDELTA_MIN_LEVEL - 1) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_LEVEL, GDELTA_MAX_LEVEL + 1) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ACCELERATION, -1) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ACCELERATION,
+                             GDELTA_MAX_ACCELERATION + 1) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ENTROPY, 2) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_CHECKSUM, 2) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, 999, 0) == GDELTA_ERR_PARAM);
+
+  // Parameters survive a reset
+  base = random_bytes(rng, 100000);
+  target = with_edits(rng, base, 100);
+  expected = encode(target, base, {{GDELTA_PARAM_ACCELERATION, 64}});
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ACCELERATION, 64) == GDELTA_OK);
+  gdelta_ctx_reset(ctx);
+  const uint8_t *delta;
+  uint64_t deltaSize;
+  CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                    base.size(), &delta, &deltaSize) >= 0);
+  CHECK(same(delta, deltaSize, expected));
+  gdelta_ctx_free(ctx);
+}
+
+// Matches that stop at every alignment near either end of both buffers,
+// where forward and backward extension leave their wide loads
+static void test_match_edges(Rng &rng) {
+  Buffer base = random_bytes(rng, 4096);
+  for (uint64_t i = 0; i < 96; i++) {
+    const uint64_t positions[] = {i, base.size() - 1 - i, base.size() / 2 + i};
+    for (uint64_t pos : positions) {
+      Buffer target = base;
+      target[pos] ^= 0x5A;
+      Buffer delta = encode(target, base);
+      check_decoders(rng, delta, base, target);
+      CHECK(delta.size() < 64);
+    }
+    check_decoders(rng, encode(Buffer(base.begin(), base.begin() + i), base),
+                   base, Buffer(base.begin(), base.begin() + i));
+    check_decoders(rng, encode(Buffer(base.end() - i, base.end()), base), base,
+                   Buffer(base.end() - i, base.end()));
+    Buffer shorter(base.begin() + i, base.end() - i);
+    check_decoders(rng, encode(base, shorter), shorter, base);
+  }
+}
+
+static void test_header(Rng &rng) {
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    for (const Buffer &target : targets_for(rng, base)) {
+      Buffer delta = encode(target, base);
+      CHECK(delta.size() > 6 && delta[0] == 'G' && delta[1] == 0 &&
+            delta[2] == 'D' && delta[3] == 'H' && delta[4] == 1);
+      // Deltas of older versions have no header
+      check_decoders(rng, strip_header(delta), base, target);
+
+      // The recorded base size is checked before decoding
+      Buffer longer(base);
+      longer.push_back(0);
+      uint8_t *out = nullptr;
+      uint64_t outSize = 0;
+      CHECK(gdecode64(delta.data(), delta.size(), longer.data(), longer.size(),
+                      &out, &outSize) == GDELTA_ERR_BASE_MISMATCH);
+      Buffer into(target.size() + 1);
+      CHECK(gdecode_into(delta.data(), delta.size(), longer.data(),
+                         longer.size(), into.data(), into.size()) ==
+            GDELTA_ERR_BASE_MISMATCH);
+      CHECK(gdecode_parallel(delta.data(), delta.size(), longer.data(),
+                             longer.size(), &out, &outSize, 2) ==
+            GDELTA_ERR_BASE_MISMATCH);
+      Buffer streamed;
+      CHECK(decode_streaming(rng, delta.data(), delta.size(), longer,
+                             streamed) == GDELTA_ERR_BASE_MISMATCH);
+
+      // Versions and flags this library does not know
+      Buffer newer(delta), flagged(delta);
+      newer[4]++;
+      flagged[5] = 0x80;
+      CHECK(gdecode64(newer.data(), newer.size(), base.data(), base.size(),
+                      &out, &outSize) == GDELTA_ERR_UNSUPPORTED);
+      CHECK(gdecode64(flagged.data(), flagged.size(), base.data(), base.size(),
+                      &out, &outSize) == GDELTA_ERR_UNSUPPORTED);
+      CHECK(gdecode_size(newer.data(), newer.size()) == GDELTA_ERR_UNSUPPORTED);
+      free(out);
+    }
+  }
+}
+
+// Unit lengths and offsets on either side of each varint byte boundary,
+// and deltas short enough that whole-word loads would pass their end
+static void test_varint_edges(Rng &rng) {
+  Buffer base = random_bytes(rng, 70000);
+  const uint64_t edges[] = {1,    2,    62,    63,    64,    65,    127,  128,
+                            129,  8191, 8192,  8193,  16383, 16384, 16385,
+                            32767, 32768, 65535};
+  for (uint64_t edge : edges) {
+    // A literal of `edge` bytes, then a copy from offset `edge`
+    Buffer target = random_bytes(rng, edge);
+    uint64_t length = std::min<uint64_t>(200 + edge, base.size() - edge - 1);
+    target.insert(target.end(), base.begin() + edge,
+                  base.begin() + edge + length);
+    target.push_back(~base[edge + length]);
+    check_decoders(rng, encode(target, base), base, target);
+  }
+  for (uint64_t size = 0; size < 48; size++) {
+    Buffer tiny = random_bytes(rng, size);
+    Buffer target = with_edits(rng, tiny, 1);
+    check_decoders(rng, encode(target, tiny), tiny, target);
+    check_decoders(rng, encode(tiny, base), base, tiny);
+  }
+}
+
+// Lost matches still round-trip, they only show in the delta size
+static void test_ratio(Rng &rng) {
+  Buffer base = random_bytes(rng, 1 << 20);
+  Buffer target = with_edits(rng, base, 50);
+  uint64_t changed = 50 * 300; // at most, per with_edits()
+  CHECK(encode(target, base).size() < 2 * changed);
+  CHECK(encode(base, base).size() < 64);
+}
+
+// Targets of several 1MiB segments, split over varying thread counts
+static void test_parallel(Rng &rng) {
+  Buffer base = random_bytes(rng, 6 << 20);
+  Buffer target = with_edits(rng, base, 3000);
+  gdelta_base *prepared = gdelta_base_prepare(base.data(), base.size());
+  const unsigned threads[] = {0, 1, 2, 3, 8};
+  for (unsigned n : threads) {
+    uint8_t *out = nullptr;
+    uint64_t outSize = 0;
+    CHECK(gencode_parallel(target.data(), target.size(), prepared, &out,
+                           &outSize, n) >= 0);
+    check_decoders(rng, Buffer(out, out + outSize), base, target);
+    free(out);
+  }
+
+  // A context's params reach the stitched delta
+  const Params params[] = {
+      {{GDELTA_PARAM_CHECKSUM, 1}, {GDELTA_PARAM_ENTROPY, 1}},
+      {{GDELTA_PARAM_INDEX_INTERVAL, 1 << 16}},
+      {{GDELTA_PARAM_IN_PLACE, 1}, {GDELTA_PARAM_LEVEL, 3}}};
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  for (const Params &set : params) {
+    uint8_t flags = 0;
+    for (const auto &param : set) {
+      CHECK(gdelta_ctx_set_param(ctx, param.first, param.second) == GDELTA_OK);
+      flags |= param.first == GDELTA_PARAM_CHECKSUM ? 4
+             : param.first == GDELTA_PARAM_ENTROPY ? 2
+             : param.first == GDELTA_PARAM_INDEX_INTERVAL ? 16
+             : param.first == GDELTA_PARAM_IN_PLACE ? 8 : 0;
+    }
+    const uint8_t *out;
+    uint64_t outSize;
+    CHECK(gencode_ctx_parallel(ctx, target.data(), target.size(), prepared,
+                               &out, &outSize, 4) >= 0);
+    Buffer delta(out, out + outSize);
+    CHECK(header_flags(delta.data(), delta.size()) == flags);
+    check_decoders(rng, delta, base, target);
+    for (const auto &param : set)
+      gdelta_ctx_set_param(ctx, param.first,
+                           param.first == GDELTA_PARAM_LEVEL
+                               ? GDELTA_DEFAULT_LEVEL
+                               : 0);
+  }
+  gdelta_ctx_free(ctx);
+  gdelta_base_free(prepared);
+}
+
+// Several bases, decoded separately or concatenated into one
+static void test_multi(Rng &rng) {
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    Buffer target = with_edits(rng, base, 1 + size / 2000);
+    uint64_t cut1 = below(rng, size + 1);
+    uint64_t cut2 = cut1 + below(rng, size - cut1 + 1);
+    const uint8_t *bufs[] = {base.data(), base.data() + cut1,
+                             base.data() + cut2};
+    const uint64_t sizesOf[] = {cut1, cut2 - cut1, size - cut2};
+    uint8_t *delta = nullptr, *out = nullptr;
+    uint64_t deltaSize = 0, outSize = 0;
+    CHECK(gencode_multi(target.data(), target.size(), bufs, sizesOf, 3, &delta,
+                        &deltaSize) >= 0);
+    CHECK(gdecode_multi(delta, deltaSize, bufs, sizesOf, 3, &out, &outSize) ==
+          (int64_t)target.size());
+    CHECK(same(out, outSize, target));
+    check_decoders(rng, Buffer(delta, delta + deltaSize), base, target);
+
+    // The count and every size must match
+    CHECK(gdecode_multi(delta, deltaSize, bufs, sizesOf, 2, &out, &outSize) ==
+          GDELTA_ERR_BASE_MISMATCH);
+    if (cut1 > 0) {
+      const uint64_t shorter[] = {cut1 - 1, cut2 - cut1, size - cut2};
+      CHECK(gdecode_multi(delta, deltaSize, bufs, shorter, 3, &out,
+                          &outSize) == GDELTA_ERR_BASE_MISMATCH);
+    }
+    free(delta);
+    free(out);
+
+    // One base gives the plain delta
+    const uint8_t *whole[] = {base.data()};
+    const uint64_t wholeSize[] = {size};
+    delta = nullptr;
+    CHECK(gencode_multi(target.data(), target.size(), whole, wholeSize, 1,
+                        &delta, &deltaSize) >= 0);
+    CHECK(same(delta, deltaSize, encode(target, base)));
+    free(delta);
+  }
+
+  // Parts of two unrelated bases
+  Buffer first = random_bytes(rng, 100000), second = random_bytes(rng, 100000);
+  Buffer target(first.begin(), first.begin() + 50000);
+  target.insert(target.end(), second.begin() + 50000, second.end());
+  const uint8_t *bufs[] = {first.data(), second.data()};
+  const uint64_t sizesOf[] = {first.size(), second.size()};
+  uint8_t *delta = nullptr;
+  uint64_t deltaSize = 0;
+  CHECK(gencode_multi(target.data(), target.size(), bufs, sizesOf, 2, &delta,
+                      &deltaSize) >= 0);
+  CHECK(deltaSize < 256);
+  free(delta);
+}
+
+// gdecode_in_place() inside a copy of the base, allocated to the exact
+// capacity unless that is too small for the base itself
+static int64_t decode_in_place(const Buffer &delta, const Buffer &base,
+                               uint64_t capacity, Buffer &out) {
+  uint64_t allocated = std::max<uint64_t>(capacity, base.size());
+  uint8_t *buf = (uint8_t *)malloc(allocated ? allocated : 1);
+  if (!base.empty())
+    memcpy(buf, base.data(), base.size());
+  int64_t size = gdecode_in_place(delta.data(), delta.size(), buf, base.size(),
+                                  capacity);
+  out.assign(buf, buf + (size >= 0 ? size : base.size()));
+  free(buf);
+  return size;
+}
+
+static void test_in_place(Rng &rng) {
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    // Shifted copies overlap the bytes they read and are turned into literals
+    Buffer shifted = random_bytes(rng, below(rng, 500));
+    shifted.insert(shifted.end(), base.begin(), base.end());
+    Buffer targets[] = {base, with_edits(rng, base, 1 + size / 2000), shifted,
+                        Buffer(base.begin() + size / 3, base.end()),
+                        random_bytes(rng, below(rng, size + 1))};
+    for (const Buffer &target : targets) {
+      uint64_t capacity = std::max(base.size(), target.size());
+      for (int flags = 0; flags < 4; flags++) {
+        Buffer delta = encode(target, base,
+                              {{GDELTA_PARAM_IN_PLACE, 1},
+                               {GDELTA_PARAM_LEVEL, 1 + below(rng, GDELTA_MAX_LEVEL)},
+                               {GDELTA_PARAM_ENTROPY, flags & 1},
+                               {GDELTA_PARAM_CHECKSUM, flags >> 1}});
+        check_decoders(rng, delta, base, target);
+
+        Buffer out;
+        CHECK(decode_in_place(delta, base, capacity, out) ==
+              (int64_t)target.size());
+        CHECK(out == target);
+        CHECK(decode_in_place(delta, base, capacity + 100, out) ==
+              (int64_t)target.size());
+        CHECK(out == target);
+        if (capacity > 0) {
+          CHECK(decode_in_place(delta, base, capacity - 1, out) ==
+                GDELTA_ERR_BUFFER);
+          CHECK(out == base);
+        }
+        if (!base.empty()) {
+          Buffer shorter(base.begin(), base.end() - 1);
+          CHECK(decode_in_place(delta, shorter, capacity, out) ==
+                GDELTA_ERR_BASE_MISMATCH);
+        }
+      }
+
+      // Other deltas are not applied in place
+      Buffer out;
+      CHECK(decode_in_place(encode(target, base), base, capacity, out) ==
+            GDELTA_ERR_PARAM);
+      CHECK(out == base);
+    }
+  }
+}
+
+static int64_t compose(const Buffer &first, const Buffer &second, Buffer &out) {
+  uint8_t *delta = nullptr;
+  uint64_t deltaSize = 0;
+  int64_t ret = gdelta_compose(first.data(), first.size(), second.data(),
+                               second.size(), &delta, &deltaSize);
+  out.clear();
+  if (ret >= 0)
+    out.assign(delta, delta + deltaSize);
+  free(delta);
+  return ret;
+}
+
+static void test_compose(Rng &rng) {
+  for (uint64_t size : sizes) {
+    Buffer a = random_bytes(rng, size);
+    Buffer b = with_edits(rng, a, 1 + size / 2000);
+    Buffer c = with_edits(rng, b, 1 + size / 2000);
+    Buffer composed;
+    for (int flags = 0; flags < 4; flags++) {
+      Params params = {{GDELTA_PARAM_LEVEL, 1 + below(rng, GDELTA_MAX_LEVEL)},
+                       {GDELTA_PARAM_ENTROPY, flags & 1},
+                       {GDELTA_PARAM_CHECKSUM, flags >> 1}};
+      Buffer first = encode(b, a, params);
+      Buffer second = encode(c, b, params);
+      CHECK(compose(first, second, composed) == (int64_t)composed.size());
+      check_decoders(rng, composed, a, c);
+
+      // Checksums on both sides catch a second delta against another B
+      if ((flags >> 1) && !b.empty()) {
+        Buffer other = b;
+        other[below(rng, other.size())] ^= 1;
+        Buffer unrelated = encode(c, other, params);
+        CHECK(compose(first, unrelated, composed) == GDELTA_ERR_BASE_MISMATCH);
+      }
+    }
+
+    // Framed and plain deltas on either side, chained more than once
+    Buffer d = with_edits(rng, c, 3);
+    gdelta_base *prepared = gdelta_base_prepare(a.data(), a.size());
+    Buffer framed = encode_framed(rng, b, prepared, 1 + below(rng, 20000));
+    gdelta_base_free(prepared);
+    Buffer plain = strip_header(encode(c, b));
+    Buffer third = encode(d, c, {{GDELTA_PARAM_ENTROPY, 1}});
+    Buffer ab_c, ab_cd;
+    CHECK(compose(framed, plain, ab_c) >= 0);
+    check_decoders(rng, ab_c, a, c);
+    CHECK(compose(ab_c, third, ab_cd) >= 0);
+    check_decoders(rng, ab_cd, a, d);
+
+    // A multi-base first delta keeps its base list
+    const uint8_t *bufs[] = {a.data(), a.data() + size / 2};
+    const uint64_t sizesOf[] = {size / 2, size - size / 2};
+    uint8_t *multi = nullptr, *out = nullptr;
+    uint64_t multiSize = 0, outSize = 0;
+    CHECK(gencode_multi(b.data(), b.size(), bufs, sizesOf, 2, &multi,
+                        &multiSize) >= 0);
+    CHECK(compose(Buffer(multi, multi + multiSize), encode(c, b), composed) >=
+          0);
+    free(multi);
+    CHECK(gdecode_multi(composed.data(), composed.size(), bufs, sizesOf, 2,
+                        &out, &outSize) == (int64_t)c.size());
+    CHECK(same(out, outSize, c));
+    free(out);
+
+    // Placed units may overlap and come in any order
+    Buffer placed = encode(b, a, {{GDELTA_PARAM_IN_PLACE, 1}});
+    Buffer second = encode(c, b);
+    CHECK(compose(placed, second, composed) == GDELTA_ERR_UNSUPPORTED);
+    CHECK(compose(second, placed, composed) < 0);
+  }
+}
+
+// Indexed deltas decode like the others; ranges start at the nearest entry
+static void test_index(Rng &rng) {
+  const int64_t intervals[] = {1, 100, 4096};
+  for (uint64_t size : sizes) {
+    Buffer base = random_bytes(rng, size);
+    for (const Buffer &target : targets_for(rng, base)) {
+      for (int64_t interval : intervals) {
+        Buffer delta = encode(target, base,
+                              {{GDELTA_PARAM_INDEX_INTERVAL, interval}});
+        CHECK(target.size() <= (uint64_t)interval ||
+              (header_flags(delta.data(), delta.size()) & 16));
+        check_decoders(rng, delta, base, target);
+        check_decoders(rng,
+                       encode(target, base,
+                              {{GDELTA_PARAM_INDEX_INTERVAL, interval},
+                               {GDELTA_PARAM_ENTROPY, 1},
+                               {GDELTA_PARAM_CHECKSUM, 1}}),
+                       base, target);
+
+        // In-place deltas are never indexed
+        Buffer placed = encode(target, base,
+                               {{GDELTA_PARAM_INDEX_INTERVAL, interval},
+                                {GDELTA_PARAM_IN_PLACE, 1}});
+        CHECK(!(header_flags(placed.data(), placed.size()) & 16));
+        check_decoders(rng, placed, base, target);
+      }
+    }
+
+    // Framed and plain deltas are walked from the start
+    Buffer target = with_edits(rng, base, 1 + size / 2000);
+    gdelta_base *prepared = gdelta_base_prepare(base.data(), base.size());
+    check_ranges(rng, encode_framed(rng, target, prepared, 1 + below(rng, 20000)),
+                 base, target);
+    gdelta_base_free(prepared);
+    check_ranges(rng, strip_header(encode(target, base)), base, target);
+
+    // Composition drops the index
+    Buffer next = with_edits(rng, target, 3), composed;
+    Params indexed = {{GDELTA_PARAM_INDEX_INTERVAL, 256}};
+    CHECK(compose(encode(target, base, indexed), encode(next, target, indexed),
+                  composed) >= 0);
+    CHECK(!(header_flags(composed.data(), composed.size()) & 16));
+    check_decoders(rng, composed, base, next);
+  }
+
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_INDEX_INTERVAL, -1) ==
+        GDELTA_ERR_PARAM);
+  gdelta_ctx_free(ctx);
+}
+
+// Text-like literals shrink under the Huffman stage, random ones are
+// stored as they are
+static void test_entropy(Rng &rng) {
+  Buffer base = random_bytes(rng, 200000);
+  for (uint8_t &byte : base)
+    byte = 'a' + byte % 16;
+  Buffer target = base;
+  for (int i = 0; i < 300; i++) {
+    uint64_t pos = below(rng, target.size());
+    Buffer run(1 + below(rng, 200));
+    for (uint8_t &byte : run)
+      byte = 'a' + below(rng, 8);
+    target.insert(target.begin() + pos, run.begin(), run.end());
+  }
+  Buffer plain = encode(target, base);
+  Buffer coded = encode(target, base, {{GDELTA_PARAM_ENTROPY, 1}});
+  CHECK(is_entropy_coded(coded));
+  CHECK(coded.size() < plain.size());
+  check_decoders(rng, coded, base, target);
+
+  Buffer random = random_bytes(rng, 100000);
+  plain = encode(random, base);
+  coded = encode(random, base, {{GDELTA_PARAM_ENTROPY, 1}});
+  CHECK(coded.size() < plain.size() + 64);
+  check_decoders(rng, coded, base, random);
+
+  // Off by default
+  CHECK(!is_entropy_coded(encode(target, base, {{GDELTA_PARAM_ENTROPY, 0}})));
+}
+
+// Stats describe the last call of the context
+static void test_stats(Rng &rng) {
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  gdelta_stats stats;
+  CHECK(gdelta_ctx_stats(ctx, &stats) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_STATS, 1) == GDELTA_OK);
+  for (int entropy = 0; entropy <= 1; entropy++) {
+    CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ENTROPY, entropy) ==
+          GDELTA_OK);
+    Buffer base = random_bytes(rng, 300000);
+    Buffer target = with_edits(rng, base, 40);
+    const uint8_t *out;
+    uint64_t outSize;
+    CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                      base.size(), &out, &outSize) >= 0);
+    Buffer delta(out, out + outSize);
+    CHECK(gdelta_ctx_stats(ctx, &stats) == GDELTA_OK);
+    CHECK(stats.copy_bytes + stats.literal_bytes == target.size());
+    CHECK(stats.copy_units > 0 && stats.literal_units > 0);
+    CHECK(stats.hits > 0 && stats.hits <= stats.probes);
+    CHECK(stats.index_used > 0 && stats.index_used <= stats.index_slots);
+    CHECK(stats.decode_ns == 0);
+    gdelta_stats encoded = stats;
+
+    CHECK(gdecode_ctx(ctx, delta.data(), delta.size(), base.data(),
+                      base.size(), &out, &outSize) == (int64_t)target.size());
+    CHECK(same(out, outSize, target));
+    CHECK(gdelta_ctx_stats(ctx, &stats) == GDELTA_OK);
+    CHECK(stats.copy_units == encoded.copy_units);
+    CHECK(stats.copy_bytes == encoded.copy_bytes);
+    CHECK(stats.literal_units == encoded.literal_units);
+    CHECK(stats.literal_bytes == encoded.literal_bytes);
+    CHECK(stats.probes == 0 && stats.index_slots == 0);
+
+    // A prepared base reports the occupancy counted when it was indexed
+    gdelta_base *prepared = gdelta_base_prepare(base.data(), base.size());
+    CHECK(gencode_ctx_with_base(ctx, target.data(), target.size(), prepared,
+                                &out, &outSize) >= 0);
+    CHECK(gdelta_ctx_stats(ctx, &stats) == GDELTA_OK);
+    CHECK(stats.index_used > 0 && stats.index_used <= stats.index_slots);
+    gdelta_base_free(prepared);
+  }
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_STATS, 2) == GDELTA_ERR_PARAM);
+  CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_STATS, 0) == GDELTA_OK);
+  CHECK(gdelta_ctx_stats(ctx, &stats) == GDELTA_ERR_PARAM);
+  gdelta_ctx_free(ctx);
+}
+
+// Every decoder of a checksummed delta catches a wrong base of the right
+// size before it decodes, and a corrupted literal after
+static void test_checksum(Rng &rng) {
+  Buffer base = random_bytes(rng, 20000);
+  Buffer other = with_edits(rng, base, 1);
+  other.resize(base.size());
+  Buffer target = random_bytes(rng, 5000);
+  Buffer corrupt = encode(target, base, {{GDELTA_PARAM_CHECKSUM, 1}});
+  corrupt.back() ^= 1;
+  Buffer delta = encode(target, base, {{GDELTA_PARAM_CHECKSUM, 1}});
+  const Buffer *bases[] = {&other, &base};
+  const Buffer *deltas[] = {&delta, &corrupt};
+  const int expected[] = {GDELTA_ERR_BASE_MISMATCH, GDELTA_ERR_CHECKSUM};
+
+  for (int i = 0; i < 2; i++) {
+    const Buffer &b = *bases[i], &d = *deltas[i];
+    uint8_t *out = nullptr;
+    uint64_t outSize = 0;
+    CHECK(gdecode64(d.data(), d.size(), b.data(), b.size(), &out, &outSize) ==
+          expected[i]);
+    free(out);
+    Buffer into(target.size());
+    CHECK(gdecode_into(d.data(), d.size(), b.data(), b.size(), into.data(),
+                       into.size()) == expected[i]);
+    gdelta_ctx *ctx = gdelta_ctx_new();
+    const uint8_t *ctxOut;
+    uint64_t ctxOutSize;
+    CHECK(gdecode_ctx(ctx, d.data(), d.size(), b.data(), b.size(), &ctxOut,
+                      &ctxOutSize) == expected[i]);
+    gdelta_ctx_free(ctx);
+    out = nullptr;
+    CHECK(gdecode_parallel(d.data(), d.size(), b.data(), b.size(), &out,
+                           &outSize, 2) == expected[i]);
+    free(out);
+    Buffer streamed;
+    CHECK(decode_streaming(rng, d.data(), d.size(), b, streamed) ==
+          expected[i]);
+  }
+}
+
+// Batches reuse one context per worker; outputs are allocated, or grown
+// when the caller's buffer is too small
+static void test_batch(Rng &rng) {
+  const size_t count = 24;
+  std::vector<Buffer> bases, targets;
+  std::vector<gdelta_base *> prepared(count, nullptr);
+  for (size_t i = 0; i < count; i++) {
+    bases.push_back(random_bytes(rng, below(rng, 50000)));
+    targets.push_back(with_edits(rng, bases[i], 1 + below(rng, 20)));
+    if (i % 3 == 0)
+      prepared[i] = gdelta_base_prepare(bases[i].data(), bases[i].size());
+  }
+  const unsigned threads[] = {0, 1, 3};
+  for (unsigned n : threads) {
+    std::vector<gdelta_batch_item> items(count), decoded(count);
+    for (size_t i = 0; i < count; i++) {
+      items[i] = {targets[i].data(), targets[i].size(), bases[i].data(),
+                  bases[i].size(), prepared[i], nullptr, 0, 0};
+      if (i % 2) {
+        items[i].out = (uint8_t *)malloc(1);
+        items[i].outSize = 1;
+      }
+    }
+    CHECK(gencode_batch(items.data(), count, n) == GDELTA_OK);
+    for (size_t i = 0; i < count; i++) {
+      CHECK(items[i].result == (int64_t)items[i].outSize);
+      decoded[i] = {items[i].out, items[i].outSize, bases[i].data(),
+                    bases[i].size(), nullptr, nullptr, 0, 0};
+    }
+    CHECK(gdecode_batch(decoded.data(), count, n) == GDELTA_OK);
+    for (size_t i = 0; i < count; i++) {
+      CHECK(decoded[i].result == (int64_t)targets[i].size());
+      CHECK(same(decoded[i].out, decoded[i].outSize, targets[i]));
+      free(items[i].out);
+      free(decoded[i].out);
+    }
+  }
+  for (gdelta_base *base : prepared)
+    gdelta_base_free(base);
+
+  // Caller buffers that are large enough are kept, plain and entropy-coded
+  // deltas included
+  {
+    Buffer base = random_bytes(rng, 30000), target = with_edits(rng, base, 5);
+    Buffer deltas[] = {encode(target, base), strip_header(encode(target, base)),
+                       encode(target, base, {{GDELTA_PARAM_ENTROPY, 1}})};
+    std::vector<gdelta_batch_item> items;
+    std::vector<uint8_t *> bufs;
+    for (const Buffer &delta : deltas) {
+      bufs.push_back((uint8_t *)malloc(target.size() + 100));
+      items.push_back({delta.data(), delta.size(), base.data(), base.size(),
+                       nullptr, bufs.back(), target.size() + 100, 0});
+    }
+    CHECK(gdecode_batch(items.data(), items.size(), 2) == GDELTA_OK);
+    for (size_t i = 0; i < items.size(); i++) {
+      CHECK(items[i].result == (int64_t)target.size());
+      CHECK(items[i].out == bufs[i]);
+      CHECK(same(items[i].out, items[i].outSize, target));
+      free(items[i].out);
+    }
+  }
+
+  // One failed item does not stop the others
+  Buffer base = random_bytes(rng, 1000), target = with_edits(rng, base, 3);
+  Buffer delta = encode(target, base);
+  Buffer other(base.size() + 1);
+  gdelta_batch_item items[] = {
+      {delta.data(), delta.size(), other.data(), other.size(), nullptr, nullptr, 0, 0},
+      {delta.data(), delta.size(), base.data(), base.size(), nullptr, nullptr, 0, 0}};
+  CHECK(gdecode_batch(items, 2, 2) == GDELTA_ERR_BASE_MISMATCH);
+  CHECK(items[0].result == GDELTA_ERR_BASE_MISMATCH);
+  CHECK(items[1].result == (int64_t)target.size());
+  CHECK(same(items[1].out, items[1].outSize, target));
+  free(items[0].out);
+  free(items[1].out);
+}
+
+// Allocator that counts its calls and the blocks it has handed out
+typedef struct {
+  uint64_t calls;
+  int64_t live;
+} Counts;
+
+static void *counted_alloc(void *opaque, size_t size) {
+  Counts *counts = (Counts *)opaque;
+  void *ptr = malloc(size);
+  counts->calls++;
+  counts->live += ptr != nullptr;
+  return ptr;
+}
+
+static void *counted_realloc(void *opaque, void *ptr, size_t size) {
+  Counts *counts = (Counts *)opaque;
+  void *moved = realloc(ptr, size);
+  counts->calls++;
+  counts->live += ptr == nullptr && moved != nullptr;
+  return moved;
+}
+
+static void counted_free(void *opaque, void *ptr) {
+  ((Counts *)opaque)->live -= ptr != nullptr;
+  free(ptr);
+}
+
+static void test_allocator(Rng &rng) {
+  // Entropy-coded deltas are expanded into the context as well, also when
+  // stats are collected from them
+  for (int mode = 0; mode < 4; mode++) {
+    int resizable = mode & 1, entropy = mode >> 1;
+    Counts counts = {0, 0};
+    gdelta_allocator alloc = {counted_alloc,
+                              resizable ? counted_realloc : nullptr,
+                              counted_free, &counts};
+    gdelta_ctx *ctx = gdelta_ctx_new_with_allocator(&alloc);
+    CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ENTROPY, entropy) ==
+          GDELTA_OK);
+    CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_STATS, entropy) == GDELTA_OK);
+    for (uint64_t size : sizes) {
+      Buffer base = random_bytes(rng, size);
+      for (const Buffer &target : targets_for(rng, base)) {
+        const uint8_t *out;
+        uint64_t outSize;
+        CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                          base.size(), &out, &outSize) >= 0);
+        Buffer delta(out, out + outSize);
+        CHECK(gdecode_ctx(ctx, delta.data(), delta.size(), base.data(),
+                          base.size(), &out, &outSize) == (int64_t)target.size());
+        CHECK(same(out, outSize, target));
+
+        // Once the buffers have grown, the same calls allocate nothing
+        uint64_t calls = counts.calls;
+        CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                          base.size(), &out, &outSize) >= 0);
+        CHECK(same(out, outSize, delta));
+        CHECK(gdecode_ctx(ctx, delta.data(), delta.size(), base.data(),
+                          base.size(), &out, &outSize) == (int64_t)target.size());
+        CHECK(counts.calls == calls);
+      }
+    }
+    gdelta_ctx_free(ctx);
+    CHECK(counts.live == 0);
+  }
+}
+
+// Decodes `delta` against `base` into `out`, false if it is rejected
+static bool decode(const Buffer &delta, const Buffer &base, Buffer &out) {
+  uint8_t *buf = nullptr;
+  uint64_t size = 0;
+  int64_t ret = gdecode64(delta.data(), delta.size(), base.data(), base.size(),
+                          &buf, &size);
+  out.clear();
+  if (ret >= 0)
+    out.assign(buf, buf + size);
+  free(buf);
+  return ret >= 0;
+}
+
+// Allocator that fails requests over a size limit, and every request once
+// `calls` of them have succeeded (unless negative)
+typedef struct {
+  size_t size;
+  int64_t calls;
+} Limit;
+
+static bool allowed(Limit *limit, size_t size) {
+  if (size > limit->size || limit->calls == 0)
+    return false;
+  if (limit->calls > 0)
+    limit->calls--;
+  return true;
+}
+
+static void *limited_alloc(void *opaque, size_t size) {
+  return allowed((Limit *)opaque, size) ? malloc(size) : nullptr;
+}
+
+static void *limited_realloc(void *opaque, void *ptr, size_t size) {
+  return allowed((Limit *)opaque, size) ? realloc(ptr, size) : nullptr;
+}
+
+static void limited_free(void *, void *ptr) { free(ptr); }
+
+// A call that cannot allocate fails with GDELTA_ERR_MEMORY or succeeds, and
+// the context keeps working once memory is available again
+static void test_allocation_failures(Rng &rng) {
+  Limit limit = {SIZE_MAX, -1};
+  gdelta_allocator alloc = {limited_alloc, limited_realloc, limited_free,
+                            &limit};
+  Buffer base = random_bytes(rng, 1 << 19);
+  Buffer target = with_edits(rng, base, 300);
+  const size_t sizeLimits[] = {SIZE_MAX, 64 << 10};
+  for (int flags = 0; flags < 8; flags++) {
+    // Every failure point of the first calls, then some of the in-place
+    // reordering's
+    for (int64_t calls = 0; calls < 60; calls += calls < 20 ? 1 : 7) {
+      for (size_t size : sizeLimits) {
+        limit = {SIZE_MAX, -1};
+        gdelta_ctx *ctx = gdelta_ctx_new_with_allocator(&alloc);
+        CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_ENTROPY, flags & 1) ==
+              GDELTA_OK);
+        CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_IN_PLACE,
+                                   (flags >> 1) & 1) == GDELTA_OK);
+        CHECK(gdelta_ctx_set_param(ctx, GDELTA_PARAM_INDEX_INTERVAL,
+                                   flags & 4 ? 4096 : 0) == GDELTA_OK);
+        limit = {size, calls};
+        const uint8_t *out;
+        uint64_t outSize;
+        int64_t ret = gencode_ctx(ctx, target.data(), target.size(),
+                                  base.data(), base.size(), &out, &outSize);
+        limit = {SIZE_MAX, -1};
+        Buffer decoded;
+        if (ret >= 0) {
+          CHECK(decode(Buffer(out, out + outSize), base, decoded));
+          CHECK(decoded == target);
+        } else {
+          CHECK(ret == GDELTA_ERR_MEMORY);
+        }
+        CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                          base.size(), &out, &outSize) >= 0);
+        Buffer delta(out, out + outSize);
+
+        // Decoding through a context of its own
+        gdelta_ctx *decoder = gdelta_ctx_new_with_allocator(&alloc);
+        limit = {size, calls};
+        ret = gdecode_ctx(decoder, delta.data(), delta.size(), base.data(),
+                          base.size(), &out, &outSize);
+        limit = {SIZE_MAX, -1};
+        if (ret >= 0)
+          CHECK(same(out, outSize, target));
+        else
+          CHECK(ret == GDELTA_ERR_MEMORY);
+        CHECK(gdecode_ctx(decoder, delta.data(), delta.size(), base.data(),
+                          base.size(), &out, &outSize) ==
+              (int64_t)target.size());
+        gdelta_ctx_free(decoder);
+        gdelta_ctx_free(ctx);
+      }
+    }
+  }
+
+  // A hash table that cannot grow keeps the old one
+  base = random_bytes(rng, 4 << 20);
+  target = with_edits(rng, base, 100);
+  gdelta_ctx *ctx = gdelta_ctx_new_with_allocator(&alloc);
+  Buffer small = random_bytes(rng, 1000);
+  const uint8_t *out;
+  uint64_t outSize;
+  CHECK(gencode_ctx(ctx, small.data(), small.size(), small.data(),
+                    small.size(), &out, &outSize) >= 0);
+  limit.size = 256 << 10;
+  CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                    base.size(), &out, &outSize) == GDELTA_ERR_MEMORY);
+  limit.size = SIZE_MAX;
+  CHECK(gencode_ctx(ctx, target.data(), target.size(), base.data(),
+                    base.size(), &out, &outSize) >= 0);
+  Buffer delta(out, out + outSize);
+  check_decoders(rng, delta, base, target);
+  gdelta_ctx_free(ctx);
+}
+
+/*
+ * Runs a delta that may be corrupt through every decoder. None may crash;
+ * whatever one of them accepts the others must agree on.
+ */
+static void decode_untrusted(Rng &rng, const uint8_t *delta,
+                             uint64_t deltaSize, const Buffer &base) {
+  uint8_t *out = nullptr;
+  uint64_t outSize = 0;
+  int64_t size = gdecode64(delta, deltaSize, base.data(), base.size(), &out,
+                           &outSize);
+  Buffer decoded;
+  if (size >= 0)
+    decoded.assign(out, out + outSize);
+  free(out);
+
+  int64_t declared = gdecode_size(delta, deltaSize);
+  if (size >= 0)
+    CHECK(declared == size);
+
+  if (size >= 0) {
+    Buffer into(size + 1);
+    CHECK(gdecode_into(delta, deltaSize, base.data(), base.size(), into.data(),
+                       size) == size);
+    CHECK(same(into.data(), size, decoded));
+  } else if (declared >= 0 && declared <= STREAM_LIMIT) {
+    Buffer into(declared + 1);
+    CHECK(gdecode_into(delta, deltaSize, base.data(), base.size(), into.data(),
+                       declared) < 0);
+  }
+
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  const uint8_t *ctxOut;
+  uint64_t ctxOutSize;
+  int64_t ctxSize = gdecode_ctx(ctx, delta, deltaSize, base.data(), base.size(),
+                                &ctxOut, &ctxOutSize);
+  CHECK(ctxSize == size);
+  if (ctxSize >= 0)
+    CHECK(same(ctxOut, ctxOutSize, decoded));
+  gdelta_ctx_free(ctx);
+
+  out = nullptr;
+  outSize = 0;
+  int64_t parallel = gdecode_parallel(delta, deltaSize, base.data(),
+                                      base.size(), &out, &outSize, 2);
+  CHECK(parallel == size);
+  if (parallel >= 0)
+    CHECK(same(out, outSize, decoded));
+  free(out);
+
+  // Ranges only walk part of the delta and may accept what the full decode
+  // rejects. Without an index to start from, what both accept must agree.
+  for (int i = 0; i < 3; i++) {
+    uint64_t bound = size >= 0 ? size + 1 : 70000;
+    uint64_t offset = below(rng, bound), length = below(rng, bound);
+    Buffer range;
+    int64_t ret = decode_range(delta, deltaSize, base, offset, length, length,
+                               range);
+    CHECK(ret < 0 || (uint64_t)ret <= length);
+    if (ret >= 0 && size >= 0 && !(header_flags(delta, deltaSize) & 16)) {
+      CHECK((uint64_t)ret == (offset < (uint64_t)size
+                                  ? std::min<uint64_t>(length, size - offset)
+                                  : 0));
+      CHECK(ret == 0 ||
+            memcmp(range.data(), decoded.data() + offset, ret) == 0);
+    }
+  }
+
+  // In place, a corrupt delta must leave the base untouched; only a target
+  // checksum mismatch shows after decoding. Placed units of a delta that is
+  // well-formed but wrong may read bytes written before them, so only the
+  // sizes have to agree.
+  uint64_t capacity = base.size();
+  if (declared > (int64_t)capacity && declared <= STREAM_LIMIT)
+    capacity = declared;
+  Buffer placed;
+  int64_t placedSize = decode_in_place(Buffer(delta, delta + deltaSize), base,
+                                       capacity, placed);
+  if (placedSize >= 0)
+    CHECK(placedSize == size);
+  else if (placedSize != GDELTA_ERR_CHECKSUM)
+    CHECK(placed == base);
+
+  // The push-based decoder checks as it goes and may stop in other places
+  Buffer streamed;
+  if (decode_streaming(rng, delta, deltaSize, base, streamed) ==
+          GDELTA_STREAM_END &&
+      size >= 0)
+    CHECK(streamed == decoded);
+}
+
+// Copy of a buffer in an allocation of its exact size, so that the sanitizer
+// sees any read past its end
+static void decode_untrusted(Rng &rng, const Buffer &delta,
+                             const Buffer &base) {
+  uint8_t *exact = (uint8_t *)malloc(delta.size() ? delta.size() : 1);
+  if (!delta.empty())
+    memcpy(exact, delta.data(), delta.size());
+  decode_untrusted(rng, exact, delta.size(), base);
+  free(exact);
+}
+
+/*
+ * Composes deltas of which one may be corrupt. Whatever is accepted must
+ * decode to what applying both in turn gives.
+ */
+static void compose_untrusted(Rng &rng, const Buffer &first,
+                              const Buffer &second, const Buffer &a) {
+  Buffer composed;
+  if (compose(first, second, composed) < 0)
+    return;
+  decode_untrusted(rng, composed, a);
+  Buffer b, c, direct;
+  if (decode(first, a, b) && decode(second, b, c)) {
+    CHECK(decode(composed, a, direct));
+    CHECK(direct == c);
+  }
+}
+
+static Buffer mutated(Rng &rng, const Buffer &delta) {
+  Buffer out = delta;
+  unsigned edits = 1 + below(rng, 4);
+  for (unsigned e = 0; e < edits && !out.empty(); e++) {
+    uint64_t pos = below(rng, out.size());
+    switch (below(rng, 5)) {
+    case 0:
+      out[pos] ^= 1 << below(rng, 8);
+      break;
+    case 1:
+      out[pos] = next(rng);
+      break;
+    case 2:
+      out[pos] = below(rng, 2) ? 0xFF : 0x00;
+      break;
+    case 3:
+      out.insert(out.begin() + pos, (uint8_t)next(rng));
+      break;
+    default:
+      out.erase(out.begin() + pos);
+      break;
+    }
+  }
+  if (below(rng, 4) == 0)
+    out.resize(below(rng, out.size() + 1));
+  return out;
+}
+
+// Truncated prefixes of a delta, all of them for short ones
+static void check_truncated(Rng &rng, const Buffer &delta, const Buffer &base,
+                            bool headered) {
+  uint64_t step = delta.size() / 200 + 1;
+  for (uint64_t length = 0; length < delta.size();
+       length += 1 + below(rng, step)) {
+    Buffer prefix(delta.begin(), delta.begin() + length);
+    // A header records the target, no strict prefix can rebuild it
+    if (headered) {
+      uint8_t *out = nullptr;
+      uint64_t outSize = 0;
+      CHECK(gdecode64(prefix.data(), prefix.size(), base.data(), base.size(),
+                      &out, &outSize) < 0);
+      free(out);
+    }
+    decode_untrusted(rng, prefix, base);
+  }
+}
+
+static void test_corrupt_input(Rng &rng, unsigned mutations) {
+  Buffer base = random_bytes(rng, 60000);
+  Buffer target = with_edits(rng, base, 40);
+
+  // Headered deltas first
+  std::vector<Buffer> deltas;
+  for (int flags = 0; flags < 8; flags++)
+    deltas.push_back(encode(target, base,
+                            {{GDELTA_PARAM_LEVEL, GDELTA_MAX_LEVEL},
+                             {GDELTA_PARAM_ENTROPY, flags & 1},
+                             {GDELTA_PARAM_CHECKSUM, (flags >> 1) & 1},
+                             {GDELTA_PARAM_IN_PLACE, flags >> 2}}));
+  for (int entropy = 0; entropy <= 1; entropy++)
+    deltas.push_back(encode(target, base,
+                            {{GDELTA_PARAM_INDEX_INTERVAL, 2048},
+                             {GDELTA_PARAM_ENTROPY, entropy},
+                             {GDELTA_PARAM_CHECKSUM, entropy}}));
+  const uint8_t *bufs[] = {base.data(), base.data() + 20000};
+  const uint64_t sizesOf[] = {20000, base.size() - 20000};
+  uint8_t *multi = nullptr;
+  uint64_t multiSize = 0;
+  CHECK(gencode_multi(target.data(), target.size(), bufs, sizesOf, 2, &multi,
+                      &multiSize) >= 0);
+  deltas.push_back(Buffer(multi, multi + multiSize));
+  free(multi);
+  size_t headered = deltas.size();
+  gdelta_base *prepared = gdelta_base_prepare(base.data(), base.size());
+  deltas.push_back(encode_framed(rng, target, prepared, 8192));
+  gdelta_base_free(prepared);
+  deltas.push_back(strip_header(deltas[0]));
+
+  for (size_t i = 0; i < deltas.size(); i++) {
+    check_truncated(rng, deltas[i], base, i < headered);
+    for (unsigned m = 0; m < mutations; m++)
+      decode_untrusted(rng, mutated(rng, deltas[i]), base);
+  }
+
+  // Either side of a composition
+  Buffer next = with_edits(rng, target, 40);
+  for (int flags = 0; flags < 4; flags++) {
+    Params params = {{GDELTA_PARAM_ENTROPY, flags & 1},
+                     {GDELTA_PARAM_CHECKSUM, flags >> 1},
+                     {GDELTA_PARAM_INDEX_INTERVAL, 4096}};
+    Buffer first = encode(target, base, params);
+    Buffer second = encode(next, target, params);
+    for (unsigned m = 0; m < mutations / 4; m++) {
+      compose_untrusted(rng, mutated(rng, first), second, base);
+      compose_untrusted(rng, first, mutated(rng, second), base);
+    }
+  }
+
+  // Short malformed deltas that once read past their end, and a header
+  // target size above INT64_MAX
+  const Buffer shortCases[] = {
+      {0xC8, 0x01, 0x07},
+      {'G', 0x00, 'D', 'F', 0x05, 0x7F},
+      {'G', 0x00, 'D', 'H', 0x01, 0x00, 0xFF},
+      {0x01},
+      {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+      {'G', 0x00, 'D', 'H', 0x01, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+       0x01, 0x01, 0x01, 0x02, 0x00, 0x00},
+  };
+  for (const Buffer &delta : shortCases) {
+    CHECK(gdecode_size(delta.data(), delta.size()) == GDELTA_ERR_CORRUPT);
+    decode_untrusted(rng, delta, base);
+  }
+
+  // Instruction lengths near 2^64 must not size the streaming decoder's
+  // buffer: 2^64 - 6 overflows it, 2^64 - 22 waits for more input
+  const Buffer lengths[] = {
+      {0xF5, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02},
+      {0xD5, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02},
+  };
+  for (Buffer delta : lengths) {
+    delta.resize(delta.size() + 64, 1);
+    Buffer streamed;
+    CHECK(decode_streaming(rng, delta.data(), delta.size(), base, streamed) !=
+          GDELTA_STREAM_END);
+  }
+
+  // Writers never emit empty units, older ones left an empty literal after
+  // every short unit: plain deltas still decode with those, anything else
+  // empty is rejected
+  Buffer small(16, 'a'), xyz = {'x', 'y', 'z'};
+  check_decoders(rng, {0x04, 0x0C, 0x00, 'x', 'y', 'z'}, small, xyz);
+  const Buffer empty[] = {
+      {0x04, 0x01, 0x00},
+      {'G', 0x00, 'D', 'F', 0x06, 0x04, 0x0C, 0x00, 'x', 'y', 'z', 0x00},
+      {'G', 0x00, 'D', 'H', 0x01, 0x00, 0x06, 0x20, 0x04, 0x0C, 0x00, 'x',
+       'y', 'z'},
+  };
+  for (const Buffer &delta : empty) {
+    Buffer decoded, streamed;
+    CHECK(!decode(delta, small, decoded));
+    CHECK(decode_streaming(rng, delta.data(), delta.size(), small, streamed) ==
+          GDELTA_ERR_CORRUPT);
+    decode_untrusted(rng, delta, small);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned mutations = DEFAULT_MUTATIONS;
+  uint64_t seed = DEFAULT_SEED;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:S:")) != -1) {
+    switch (c) {
+    case 'n':
+      mutations = atoi(optarg);
+      break;
+    case 'S':
+      seed = strtoull(optarg, nullptr, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: gdelta_test [-n <mutations per delta>] [-S <seed>]\n");
+      return 1;
+    }
+  }
+
+  Rng rng = {seed};
+  test_round_trips(rng);
+  test_allocator(rng);
+  test_allocation_failures(rng);
+  test_params(rng);
+  test_header(rng);
+  test_varint_edges(rng);
+  test_parallel(rng);
+  test_batch(rng);
+  test_multi(rng);
+  test_entropy(rng);
+  test_stats(rng);
+  test_checksum(rng);
+  test_in_place(rng);
+  test_compose(rng);
+  test_index(rng);
+  test_ratio(rng);
+  test_match_edges(rng);
+  test_corrupt_input(rng, mutations);
+
+  if (failures) {
+    fprintf(stderr, "gdelta_test: %d checks failed (seed %llu)\n", failures,
+            (unsigned long long)seed);
+    return 1;
+  }
+  printf("gdelta_test: all checks passed\n");
+  return 0;
+}
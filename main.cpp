@@ -4,11 +4,13 @@
 
 #include "cstring"
 #include "gdelta.h"
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <ctype.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <thread>
 #ifdef _MSC_VER
 #include <compat/msvc.h>
 #include <compat/getopt.h>
@@ -16,23 +18,264 @@
 #include <unistd.h>
 #endif
 
-int load_file_to_memory(const char *filename, uint8_t **result) {
+// Reads a file into *buffer, which is only reallocated when its *capacity
+// is too small, and NUL-terminates it
+int load_file_into(const char *filename, uint8_t **buffer, uint64_t *capacity,
+                   uint64_t *size) {
   FILE *f = fopen(filename, "rb");
-  if (f == NULL) {
-    *result = NULL;
+  if (f == NULL)
     return -1; // -1 means file opening fail
+  fseeko(f, 0, SEEK_END);
+  *size = ftello(f);
+  fseeko(f, 0, SEEK_SET);
+  if (*buffer == NULL || *capacity < *size + 1) {
+    uint8_t *grown = (uint8_t *)realloc(*buffer, *size + 1);
+    if (grown == NULL) {
+      fclose(f);
+      return -2;
+    }
+    *buffer = grown;
+    *capacity = *size + 1;
   }
-  fseek(f, 0, SEEK_END);
-  size_t size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  *result = (uint8_t *)malloc(size + 1);
-  if (size != fread(*result, sizeof(char), size, f)) {
-    free(*result);
+  if (*size != fread(*buffer, sizeof(char), *size, f)) {
+    fclose(f);
     return -2; // -2 means file reading fail
   }
   fclose(f);
-  (*result)[size] = 0;
-  return size;
+  (*buffer)[*size] = 0;
+  return 0;
+}
+
+int load_file_to_memory(const char *filename, uint8_t **result,
+                        uint64_t *size) {
+  uint64_t capacity = 0;
+  *result = NULL;
+  int ret = load_file_into(filename, result, &capacity, size);
+  if (ret < 0) {
+    free(*result);
+    *result = NULL;
+  }
+  return ret;
+}
+
+// write() may return early for large buffers, keep going until done
+int write_all(int fd, const uint8_t *buf, uint64_t size) {
+  while (size > 0) {
+    size_t chunk = size < (1u << 30) ? size : (1u << 30);
+    int written = write(fd, buf, chunk);
+    if (written < 0)
+      return written;
+    buf += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int open_output(const char *filename) {
+#ifdef _WIN32
+  return open(filename, O_RDWR | O_TRUNC | O_CREAT);
+#else
+  return open(filename, O_RDWR | O_TRUNC | O_CREAT,
+              S_IRGRP | S_IWGRP | S_IWUSR | S_IRUSR);
+#endif
+}
+
+// Encoder settings from the command line
+typedef struct {
+  int level;
+  int entropy;
+  int checksum;
+  int in_place;
+  int64_t index_interval;
+} Settings;
+
+gdelta_ctx *new_ctx(const Settings &settings) {
+  gdelta_ctx *ctx = gdelta_ctx_new();
+  if (ctx == nullptr ||
+      gdelta_ctx_set_param(ctx, GDELTA_PARAM_LEVEL, settings.level) != GDELTA_OK ||
+      gdelta_ctx_set_param(ctx, GDELTA_PARAM_ENTROPY, settings.entropy) != GDELTA_OK ||
+      gdelta_ctx_set_param(ctx, GDELTA_PARAM_CHECKSUM, settings.checksum) != GDELTA_OK ||
+      gdelta_ctx_set_param(ctx, GDELTA_PARAM_IN_PLACE, settings.in_place) != GDELTA_OK ||
+      gdelta_ctx_set_param(ctx, GDELTA_PARAM_INDEX_INTERVAL, settings.index_interval) != GDELTA_OK) {
+    gdelta_ctx_free(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+/*
+ * Batch mode: one job per manifest line, "e|d <base> <input> <output>"
+ * (paths without whitespace, '#' starts a comment). Every worker thread keeps
+ * its context and file buffers across jobs and rereads a base only when it
+ * changes. Prints "<line> ok <output size>" or "<line> error <code> <stage>"
+ * per job, in manifest order, and exits with 1 if any job failed.
+ */
+typedef struct {
+  size_t line;
+  char mode;
+  const char *base;
+  const char *input;
+  const char *output;
+  int64_t result; // output size or error code
+  const char *failed; // stage that failed, if any
+} BatchJob;
+
+// Splits the manifest (NUL-terminated, modified in place) into jobs
+int parse_manifest(char *text, BatchJob **jobs, size_t *count) {
+  size_t capacity = 0;
+  *jobs = nullptr;
+  *count = 0;
+  char *next = text;
+  for (size_t line = 1; next != nullptr; line++) {
+    char *cur = next;
+    next = strchr(cur, '\n');
+    if (next != nullptr)
+      *next++ = 0;
+    char *hash = strchr(cur, '#');
+    if (hash != nullptr)
+      *hash = 0;
+
+    char *fields[5];
+    int n = 0;
+    for (char *tok = strtok(cur, " \t\r"); tok != nullptr && n < 5;
+         tok = strtok(nullptr, " \t\r"))
+      fields[n++] = tok;
+    if (n == 0)
+      continue;
+    if (n != 4 || strlen(fields[0]) != 1 ||
+        (fields[0][0] != 'e' && fields[0][0] != 'd')) {
+      fprintf(stderr, "Manifest line %zu: expected \"e|d <base> <input> <output>\"\n",
+              line);
+      return -1;
+    }
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      BatchJob *grown = (BatchJob *)realloc(*jobs, capacity * sizeof(BatchJob));
+      if (grown == nullptr)
+        return -1;
+      *jobs = grown;
+    }
+    (*jobs)[(*count)++] = {line, fields[0][0], fields[1], fields[2], fields[3],
+                           -1, "not run"};
+  }
+  return 0;
+}
+
+typedef struct {
+  uint8_t *base;
+  uint64_t base_capacity;
+  uint64_t base_size;
+  const char *base_name; // file currently in `base`
+  uint8_t *input;
+  uint64_t input_capacity;
+  uint64_t input_size;
+} BatchBuffers;
+
+void run_job(gdelta_ctx *ctx, BatchBuffers &buffers, BatchJob &job) {
+  job.failed = nullptr;
+  if (buffers.base_name == nullptr || strcmp(buffers.base_name, job.base) != 0) {
+    buffers.base_name = nullptr;
+    if (load_file_into(job.base, &buffers.base, &buffers.base_capacity,
+                       &buffers.base_size) < 0) {
+      job.result = -1;
+      job.failed = "reading base";
+      return;
+    }
+    buffers.base_name = job.base;
+  }
+  if (load_file_into(job.input, &buffers.input, &buffers.input_capacity,
+                     &buffers.input_size) < 0) {
+    job.result = -1;
+    job.failed = "reading input";
+    return;
+  }
+
+  const uint8_t *out;
+  uint64_t out_size;
+  if (job.mode == 'e')
+    job.result = gencode_ctx(ctx, buffers.input, buffers.input_size,
+                             buffers.base, buffers.base_size, &out, &out_size);
+  else
+    job.result = gdecode_ctx(ctx, buffers.input, buffers.input_size,
+                             buffers.base, buffers.base_size, &out, &out_size);
+  if (job.result < 0) {
+    job.failed = job.mode == 'e' ? "encoding" : "decoding";
+    return;
+  }
+  job.result = out_size;
+
+  int fd = open_output(job.output);
+  if (fd < 0 || write_all(fd, out, out_size) < 0) {
+    job.result = -1;
+    job.failed = "writing output";
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+int run_batch(const char *manifest, unsigned threads, const Settings &settings) {
+  uint8_t *text;
+  uint64_t text_size;
+  if (load_file_to_memory(manifest, &text, &text_size) < 0) {
+    fprintf(stderr, "Failed to read %s\n", manifest);
+    return 1;
+  }
+  BatchJob *jobs;
+  size_t count;
+  if (parse_manifest((char *)text, &jobs, &count) < 0) {
+    free(jobs);
+    free(text);
+    return 1;
+  }
+
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+  if (threads > count)
+    threads = count ? count : 1;
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> setup_failed(false);
+  auto worker = [&]() {
+    gdelta_ctx *ctx = new_ctx(settings);
+    if (ctx == nullptr) {
+      setup_failed = true;
+      return;
+    }
+    BatchBuffers buffers = {};
+    for (size_t i = next++; i < count; i = next++)
+      run_job(ctx, buffers, jobs[i]);
+    free(buffers.base);
+    free(buffers.input);
+    gdelta_ctx_free(ctx);
+  };
+
+  std::thread *pool = new std::thread[threads - 1];
+  for (unsigned t = 1; t < threads; t++)
+    pool[t - 1] = std::thread(worker);
+  worker();
+  for (unsigned t = 1; t < threads; t++)
+    pool[t - 1].join();
+  delete[] pool;
+
+  int status = 0;
+  if (setup_failed) {
+    fprintf(stderr, "Failed to set up the encoder\n");
+    status = 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (jobs[i].failed == nullptr) {
+      printf("%zu ok %lld\n", jobs[i].line, (long long)jobs[i].result);
+    } else {
+      printf("%zu error %lld %s\n", jobs[i].line, (long long)jobs[i].result,
+             jobs[i].failed);
+      status = 1;
+    }
+  }
+  free(jobs);
+  free(text);
+  return status;
 }
 
 int main(int argc, char *argv[]) {
@@ -41,8 +284,11 @@ int main(int argc, char *argv[]) {
   char *cvalue = nullptr;
   char *basefp = nullptr;
   char *targetfp = nullptr;
+  char *manifest = nullptr;
+  unsigned jobs = 0;
+  Settings settings = {GDELTA_DEFAULT_LEVEL, 0, 0, 0, 0};
 
-  while ((c = getopt(argc, argv, "edo:c")) != -1) {
+  while ((c = getopt(argc, argv, "edo:l:czkib:j:s:")) != -1) {
     switch (c) {
     case 'd':
       edflags |= 0b01;
@@ -53,8 +299,35 @@ int main(int argc, char *argv[]) {
     case 'o':
       cvalue = optarg;
       break;
+    case 'l':
+      settings.level = atoi(optarg);
+      if (settings.level < GDELTA_MIN_LEVEL || settings.level > GDELTA_MAX_LEVEL) {
+        fprintf(stderr, "Level must be between %d and %d.\n",
+                GDELTA_MIN_LEVEL, GDELTA_MAX_LEVEL);
+        return 1;
+      }
+      break;
+    case 'z':
+      settings.entropy = 1;
+      break;
+    case 'k':
+      settings.checksum = 1;
+      break;
+    case 'i':
+      settings.in_place = 1;
+      break;
+    case 'b':
+      manifest = optarg;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 's':
+      settings.index_interval = strtoll(optarg, nullptr, 10);
+      break;
     case '?':
-      if (optopt == 'o')
+      if (optopt == 'o' || optopt == 'l' || optopt == 'b' || optopt == 'j' ||
+          optopt == 's')
         fprintf(stderr, "Option -%o requires an argument.\n", optopt);
       else if (isprint(optopt))
         fprintf(stderr, "Unknown option `-%o'.\n", optopt);
@@ -66,10 +339,18 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // Jobs, and whether each encodes or decodes, come from the manifest
+  if (manifest != nullptr) {
+    if (edflags != 0 || cvalue != nullptr || optind < argc)
+      goto usage;
+    return run_batch(manifest, jobs, settings);
+  }
+
   if (edflags > 2 || edflags == 0) {
   usage:
-    fprintf(stderr, "Usage: gdelta [-d|-e] [-o <outputfile>] <basefile> "
-                    "<delta|target-file> \n");
+    fprintf(stderr, "Usage: gdelta [-d|-e] [-l <level>] [-z] [-k] [-i] [-s <interval>] [-o <outputfile>] "
+                    "<basefile> <delta|target-file> \n"
+                    "       gdelta -b <manifest> [-j <threads>] [-l <level>] [-z] [-k] [-i] [-s <interval>]\n");
     return 1;
   }
 
@@ -94,12 +375,7 @@ int main(int argc, char *argv[]) {
   // Set output filedescriptor (stdout or file)
   int output_fd = fileno(stdout);
   if (cvalue != nullptr) {
-#ifdef _WIN32
-    output_fd = open(cvalue, O_RDWR | O_TRUNC | O_CREAT);
-#else
-    output_fd = open(cvalue, O_RDWR | O_TRUNC | O_CREAT,
-                     S_IRGRP | S_IWGRP | S_IWUSR | S_IRUSR);
-#endif
+    output_fd = open_output(cvalue);
     if (output_fd < 0) {
       printf("Failed to open output file (%d)\n", output_fd);
       return 1;
@@ -107,39 +383,74 @@ int main(int argc, char *argv[]) {
   }
 
   uint8_t *target_delta;
-  uint64_t target_delta_size = load_file_to_memory(targetfp, &target_delta);
+  uint64_t target_delta_size;
+  if (load_file_to_memory(targetfp, &target_delta, &target_delta_size) < 0) {
+    fprintf(stderr, "Failed to read %s\n", targetfp);
+    return 1;
+  }
   uint8_t *origin;
-  uint64_t origin_size = load_file_to_memory(basefp, &origin);
+  uint64_t origin_size;
+  if (load_file_to_memory(basefp, &origin, &origin_size) < 0) {
+    fprintf(stderr, "Failed to read %s\n", basefp);
+    return 1;
+  }
 
   if (edflags & 0b10) {
     // Encode target, origin -> delta
 
-    // Maximum size for delta is the target state (since it's only useful if
-    // it's less than that)
-    uint32_t delta_size = target_delta_size;
-    uint8_t *delta = (uint8_t *)malloc(delta_size);
-    int status = gencode(target_delta, target_delta_size, origin, origin_size,
-                         &delta, &delta_size);
+    gdelta_ctx *ctx = new_ctx(settings);
+    if (ctx == nullptr) {
+      fprintf(stderr, "Failed to set up the encoder\n");
+      return 1;
+    }
+    const uint8_t *delta;
+    uint64_t delta_size;
+    int64_t ret = gencode_ctx(ctx, target_delta, target_delta_size, origin,
+                              origin_size, &delta, &delta_size);
+    if (ret < 0) {
+      fprintf(stderr, "Failed to encode %s (%d)\n", targetfp, (int)ret);
+      gdelta_ctx_free(ctx);
+      return 1;
+    }
 
-    if (write(output_fd, delta, delta_size) < 0) {
+    if (write_all(output_fd, delta, delta_size) < 0) {
       printf("Failed to write output file (%d)\n", output_fd);
       return 1;
     }
 
-    free(delta);
+    gdelta_ctx_free(ctx);
     return 0;
   }
 
   if (edflags & 0b01) {
-    // Decode origin, delta -> target
-    // Allocate slightly more than the origin and delta combined
-    // TODO: handle status and increase buffer if too small
-    uint32_t target_size = target_delta_size + origin_size * 11 / 10;
-    uint8_t *target = (uint8_t *)malloc(target_size);
-    int status = gdecode(target_delta, target_delta_size, origin, origin_size,
-                         &target, &target_size);
-
-    if (write(output_fd, target, target_size) < 0) {
+    // Decode origin, delta -> target, into a buffer allocated once, or
+    // with -i into the base grown to fit the target
+    int64_t target_size = gdecode_size(target_delta, target_delta_size);
+    uint8_t *target = nullptr;
+    if (target_size >= 0 && settings.in_place) {
+      uint64_t capacity = (uint64_t)target_size > origin_size ? target_size : origin_size;
+      target = (uint8_t *)realloc(origin, capacity ? capacity : 1);
+      if (target != nullptr)
+        origin = nullptr;
+      if (target == nullptr)
+        target_size = GDELTA_ERR_MEMORY;
+      else
+        target_size = gdecode_in_place(target_delta, target_delta_size, target,
+                                       origin_size, capacity);
+    } else if (target_size >= 0) {
+      target = (uint8_t *)malloc(target_size ? target_size : 1);
+      if (target == nullptr)
+        target_size = GDELTA_ERR_MEMORY;
+      else
+        target_size = gdecode_into(target_delta, target_delta_size, origin,
+                                   origin_size, target, target_size);
+    }
+    if (target_size < 0) {
+      fprintf(stderr, "Failed to decode %s (%d)\n", targetfp, (int)target_size);
+      return 1;
+    }
+
+    if (write_all(output_fd, target, target_size) < 0) {
       printf("Failed to write output file (%d)\n", output_fd);
       return 1;
     }
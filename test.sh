@@ -23,3 +23,56 @@ else
    exit
 fi
 
+
+for flags in "-l 4" "-z" "-k" "-z -k -l 3" "-s 1024" "-s 4096 -z -k"; do
+   ./gdelta.exe -e $flags -o gdelta.gdelta ../gdelta.cpp ../gdelta.h
+   ./gdelta.exe -d -o gdelta.out ../gdelta.cpp ./gdelta.gdelta
+   if cmp -s ./gdelta.out ../gdelta.h; then
+      echo "Successfully reconstructed gdelta.h from gdelta.cpp with $flags, no issues found"
+   else
+      echo "Failed to delta/reconstruct gdelta.h from gdelta.cpp with $flags, this is likely a bug please compare build/gdelta.out, gdelta.h, gdelta.cpp"
+      exit 1
+   fi
+done
+
+for flags in "-i" "-i -z -k"; do
+   ./gdelta.exe -e $flags -o gdelta.gdelta ../gdelta.cpp ../gdelta.h
+   ./gdelta.exe -d -i -o gdelta.out ../gdelta.cpp ./gdelta.gdelta
+   ./gdelta.exe -d -o gdelta.plain.out ../gdelta.cpp ./gdelta.gdelta
+   if cmp -s ./gdelta.out ../gdelta.h && cmp -s ./gdelta.plain.out ../gdelta.h; then
+      echo "Successfully reconstructed gdelta.h from gdelta.cpp in place with $flags, no issues found"
+   else
+      echo "Failed to delta/reconstruct gdelta.h from gdelta.cpp in place with $flags, this is likely a bug please compare build/gdelta.out, gdelta.h, gdelta.cpp"
+      exit 1
+   fi
+done
+
+printf "e ../gdelta.cpp ../gdelta.h batch1.gdelta\ne ../gdelta.h ../gdelta.cpp batch2.gdelta\n" > batch.manifest
+printf "d ../gdelta.cpp batch1.gdelta batch1.out\nd ../gdelta.h batch2.gdelta batch2.out\n" > unbatch.manifest
+./gdelta.exe -e -k -o gdelta.gdelta ../gdelta.cpp ../gdelta.h
+if ./gdelta.exe -b batch.manifest -j 2 -k && ./gdelta.exe -b unbatch.manifest -j 2 &&
+   cmp -s batch1.out ../gdelta.h && cmp -s batch2.out ../gdelta.cpp &&
+   cmp -s batch1.gdelta gdelta.gdelta; then
+   echo "Successfully reconstructed gdelta.h and gdelta.cpp in batch mode, no issues found"
+else
+   echo "Failed to delta/reconstruct in batch mode, this is likely a bug please compare build/batch1.out, build/batch2.out, gdelta.h, gdelta.cpp"
+   exit 1
+fi
+printf "d ../gdelta.h batch1.gdelta batch3.out\n" > mismatch.manifest
+if ./gdelta.exe -b mismatch.manifest > /dev/null 2>&1; then
+   echo "Batch mode accepted a delta against the wrong base, this is likely a bug"
+   exit 1
+fi
+
+./gdelta.exe -e -o gdelta.gdelta ../gdelta.cpp ../gdelta.h
+if ./gdelta.exe -d -o gdelta.out ../gdelta.h ./gdelta.gdelta > /dev/null 2>&1; then
+   echo "Decoding against the wrong base succeeded, this is likely a bug"
+   exit 1
+fi
+
+if ./gdelta_test; then
+   echo "Regression tests passed"
+else
+   echo "Regression tests failed"
+   exit 1
+fi